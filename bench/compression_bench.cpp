@@ -0,0 +1,132 @@
+// license:MIT
+// copyright-holders:Miodrag Milanovic
+// Bandwidth saved by response compression against the CPU time it costs, for typical bodies, compression levels
+// and the chunk sizes of streamed responses (each chunk being flushed as Response does). The break-even link
+// speed is the speed below which sending the saved bytes would have taken longer than compressing them.
+#include "compression.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+
+namespace {
+	volatile size_t sink;
+
+	/// Deterministic pseudo random numbers, so that every run compresses the same bodies
+	struct random {
+		std::uint64_t state = 0x9e3779b97f4a7c15ull;
+		std::uint32_t operator()() {
+			state = state * 6364136223846793005ull + 1442695040888963407ull;
+			return static_cast<std::uint32_t>(state >> 33);
+		}
+	};
+
+	std::string make_json(size_t size) {
+		static const char *names[] = { "alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel" };
+		random next;
+		std::string body = "{\"items\":[";
+		for (size_t c = 0; body.size() < size; c++) {
+			if (c > 0)
+				body += ',';
+			body += "{\"id\":" + std::to_string(100000 + next() % 900000) + ",\"name\":\"" + names[next() % 8] + "-" +
+				std::to_string(next() % 1000) + "\",\"price\":" + std::to_string(next() % 10000) + "." + std::to_string(next() % 100) +
+				",\"in_stock\":" + (next() % 2 ? "true" : "false") + ",\"tags\":[\"" + names[next() % 8] + "\",\"" + names[next() % 8] + "\"]}";
+		}
+		return body + "]}";
+	}
+
+	std::string make_html(size_t size) {
+		random next;
+		std::string body = "<!DOCTYPE html><html><head><title>Catalog</title><link rel=\"stylesheet\" href=\"/css/site.css\"></head><body><table>\n";
+		while (body.size() < size) {
+			body += "<tr class=\"row\"><td class=\"id\">" + std::to_string(next() % 100000) + "</td><td class=\"name\"><a href=\"/items/" +
+				std::to_string(next() % 100000) + "\">Item " + std::to_string(next() % 1000) + "</a></td><td class=\"price\">" +
+				std::to_string(next() % 500) + ".99</td></tr>\n";
+		}
+		return body + "</table></body></html>\n";
+	}
+
+	std::string make_random(size_t size) {
+		random next;
+		std::string body(size, '\0');
+		for (auto &c : body)
+			c = static_cast<char>(next());
+		return body;
+	}
+
+	double seconds_since(std::chrono::steady_clock::time_point start) {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	/// Compresses body in chunks of chunk_size bytes (the whole body if 0) with a reused deflater, as the server does
+	void measure(const std::string &name, const std::string &body, int level, size_t chunk_size) {
+		webpp::deflater_cache deflaters;
+		std::string out;
+		size_t compressed = 0;
+		size_t iterations = 0;
+		auto start = std::chrono::steady_clock::now();
+		do {
+			auto deflater = deflaters.acquire(webpp::content_coding::gzip, level);
+			compressed = 0;
+			if (chunk_size == 0) {
+				out.clear();
+				deflater->compress(body.data(), body.size(), out, webpp::deflater::flush::finish);
+				compressed = out.size();
+			}
+			else {
+				for (size_t pos = 0; pos < body.size(); pos += chunk_size) {
+					out.clear();
+					auto last = pos + chunk_size >= body.size();
+					deflater->compress(body.data() + pos, std::min(chunk_size, body.size() - pos), out,
+						last ? webpp::deflater::flush::finish : webpp::deflater::flush::sync);
+					compressed += out.size();
+				}
+			}
+			deflaters.release(std::move(deflater));
+			sink = out.size();
+			iterations++;
+		} while (seconds_since(start) < 0.2);
+		auto cpu = seconds_since(start) / double(iterations);
+
+		double saved = body.size() > compressed ? double(body.size() - compressed) : 0.0;
+		std::cout << "  " << std::left << std::setw(8) << name << std::right << std::setw(6) << level
+			<< std::setw(8) << (chunk_size ? std::to_string(chunk_size) : std::string("whole"))
+			<< std::setw(10) << body.size() << std::setw(10) << compressed
+			<< std::fixed << std::setprecision(1) << std::setw(8) << 100.0 * saved / double(body.size()) << "%"
+			<< std::setw(10) << double(body.size()) / cpu / 1e6
+			<< std::setw(10) << cpu * 1e6;
+		if (saved > 0)
+			std::cout << std::setw(12) << saved * 8 / cpu / 1e6;
+		else
+			std::cout << std::setw(12) << "never";
+		std::cout << std::endl;
+	}
+}
+
+int main() {
+	std::cout << "gzip with zlib " << zlibVersion() << std::endl;
+	std::cout << "  body     level   chunk      size   gzipped   saved      MB/s  us/body  break-even Mbit/s" << std::endl;
+
+	struct body { const char *name; std::string data; };
+	std::vector<body> bodies = {
+		{ "json", make_json(2048) },
+		{ "json", make_json(65536) },
+		{ "json", make_json(1 << 20) },
+		{ "html", make_html(65536) },
+		{ "random", make_random(65536) },
+	};
+	for (auto &b : bodies) {
+		for (int level : { 1, 6, 9 })
+			measure(b.name, b.data, level, 0);
+		std::cout << std::endl;
+	}
+
+	std::cout << "streamed, level 6, one flush per chunk" << std::endl;
+	auto json = make_json(1 << 20);
+	for (size_t chunk_size : { 1024, 4096, 16384, 65536 })
+		measure("json", json, 6, chunk_size);
+	return 0;
+}
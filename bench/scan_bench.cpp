@@ -0,0 +1,151 @@
+// license:MIT
+// copyright-holders:Miodrag Milanovic
+// Microbenchmark of the HTTP head scanning: the byte-by-byte paths used before (string delimiter
+// search as done by asio::read_until, std::getline/find based header parsing) against simd_scan.hpp
+// and request_parser. Reports bytes per cycle (bytes per nanosecond where no cycle counter is available).
+#include "asio.h"
+#include "http_parser.hpp"
+#include "simd_scan.hpp"
+
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <istream>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define HAVE_RDTSC
+#endif
+
+namespace {
+	volatile size_t sink;
+
+	unsigned long long ticks() {
+#ifdef HAVE_RDTSC
+		return __rdtsc();
+#else
+		return static_cast<unsigned long long>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+	}
+
+	template <class F>
+	double bytes_per_tick(const std::string &name, size_t bytes, size_t iterations, F &&func) {
+		for (size_t c = 0; c < iterations / 10; c++)
+			func();
+		auto start = ticks();
+		for (size_t c = 0; c < iterations; c++)
+			func();
+		auto elapsed = ticks() - start;
+		double result = double(bytes) * double(iterations) / double(elapsed);
+		std::cout << "  " << std::left << std::setw(34) << name << std::fixed << std::setprecision(3) << result << std::endl;
+		return result;
+	}
+
+	std::string make_head(size_t cookie_size) {
+		std::string head = "GET /api/v1/items/12345?fields=name,price HTTP/1.1\r\n"
+			"Host: www.example.com\r\n"
+			"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+			"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+			"Accept-Language: en-US,en;q=0.5\r\n"
+			"Accept-Encoding: gzip, deflate, br\r\n"
+			"Referer: https://www.example.com/\r\n"
+			"Connection: keep-alive\r\n";
+		if (cookie_size > 0)
+			head += "Cookie: session=" + std::string(cookie_size, 'x') + "\r\n";
+		head += "\r\n";
+		return head;
+	}
+
+	/// The search performed by asio::read_until for a string delimiter, one byte at a time
+	size_t legacy_head_end(const std::string &data) {
+		const char delim[] = "\r\n\r\n";
+		for (size_t c = 0; c + 4 <= data.size(); c++) {
+			size_t d = 0;
+			while (d < 4 && data[c + d] == delim[d])
+				d++;
+			if (d == 4)
+				return c;
+		}
+		return data.size();
+	}
+
+	/// The std::getline based header parsing used by ServerBase::parse_request before request_parser
+	size_t legacy_parse(asio::streambuf &streambuf) {
+		std::istream stream(&streambuf);
+		std::unordered_multimap<std::string, std::string, case_insensitive_hash, case_insensitive_equals> header;
+		std::string line, method, path, version;
+		getline(stream, line);
+		size_t method_end = line.find(' ');
+		size_t path_end = line.find(' ', method_end + 1);
+		method = line.substr(0, method_end);
+		path = line.substr(method_end + 1, path_end - method_end - 1);
+		size_t protocol_end = line.find('/', path_end + 1);
+		version = line.substr(protocol_end + 1, line.size() - protocol_end - 2);
+		getline(stream, line);
+		size_t param_end;
+		while ((param_end = line.find(':')) != std::string::npos) {
+			size_t value_start = param_end + 1;
+			if (value_start < line.size()) {
+				if (line[value_start] == ' ')
+					value_start++;
+				if (value_start < line.size())
+					header.emplace(line.substr(0, param_end), line.substr(value_start, line.size() - value_start - 1));
+			}
+			getline(stream, line);
+		}
+		return header.size() + path.size();
+	}
+}
+
+int main() {
+#if defined(WEBPP_SCAN_AVX2)
+	std::cout << "scanner: AVX2" << std::endl;
+#elif defined(WEBPP_SCAN_SSE2)
+	std::cout << "scanner: SSE2" << std::endl;
+#else
+	std::cout << "scanner: scalar" << std::endl;
+#endif
+#ifdef HAVE_RDTSC
+	std::cout << "unit: bytes/cycle (rdtsc)" << std::endl;
+#else
+	std::cout << "unit: bytes/ns" << std::endl;
+#endif
+
+	for (size_t cookie_size : {0, 4096}) {
+		auto head = make_head(cookie_size);
+		const size_t iterations = cookie_size > 0 ? 50000 : 200000;
+		std::cout << std::endl << "head of " << head.size() << " bytes" << std::endl;
+
+		auto old_end = bytes_per_tick("header end, byte loop", head.size(), iterations, [&] {
+			sink = legacy_head_end(head);
+		});
+		auto new_end = bytes_per_tick("header end, scan_for_head_end", head.size(), iterations, [&] {
+			sink = static_cast<size_t>(webpp::scan_for_head_end(head.data(), head.data() + head.size()) - head.data());
+		});
+
+		asio::streambuf streambuf;
+		auto old_parse = bytes_per_tick("parse, getline", head.size(), iterations, [&] {
+			std::ostream(&streambuf).write(head.data(), static_cast<std::streamsize>(head.size()));
+			sink = legacy_parse(streambuf);
+			streambuf.consume(streambuf.size());
+		});
+		webpp::request_parser parser;
+		webpp::header_fields header;
+		auto new_parse = bytes_per_tick("parse, request_parser", head.size(), iterations, [&] {
+			parser.reset();
+			parser.parse(head.data(), head.size());
+			parser.fields(head.data(), header);
+			sink = header.size() + parser.path(head.data()).size();
+		});
+
+		std::cout << "  speedup: header end " << std::setprecision(1) << new_end / old_end << "x, parse " << new_parse / old_parse << "x" << std::endl;
+	}
+	return 0;
+}
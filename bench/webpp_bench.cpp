@@ -0,0 +1,386 @@
+// license:MIT
+// copyright-holders:Miodrag Milanovic
+// Load generator running http_server and its clients in one process over loopback. Each scenario keeps a number
+// of connections busy for a fixed time and reports requests per second, latency percentiles and heap allocations
+// per request (server and client together; the clients themselves do not allocate while measuring).
+//
+//     webpp_bench [--duration seconds] [--server-threads n] [--port n] [--filter text] [--json]
+//
+// --json prints one JSON document instead of the table, for comparing runs across releases.
+#include "server_http.hpp"
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+	std::atomic<std::uint64_t> allocations{0};
+}
+
+void *operator new(size_t size) {
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	if (auto p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+namespace {
+	using clock = std::chrono::steady_clock;
+
+	enum class mode {
+		/// One request at a time on a persistent connection
+		keep_alive,
+		/// A new connection for every request
+		close,
+		/// depth requests written at once on a persistent connection, then their responses read
+		pipelined
+	};
+
+	const char *mode_name(mode m) {
+		switch (m) {
+		case mode::keep_alive: return "keep-alive";
+		case mode::close: return "close";
+		default: return "pipelined";
+		}
+	}
+
+	struct scenario {
+		const char *name;
+		mode kind;
+		size_t connections;
+		size_t depth;
+		/// Requests sent in turn, all with the same kind of response
+		std::vector<std::string> requests;
+	};
+
+	struct result {
+		std::uint64_t requests = 0;
+		std::uint64_t errors = 0;
+		double seconds = 0;
+		std::uint64_t allocations = 0;
+		webpp::latency_histogram latency;
+	};
+
+	std::string get(const std::string &path, bool close = false) {
+		return "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n" + (close ? "Connection: close\r\n" : "") + "\r\n";
+	}
+
+	std::string post(const std::string &path, size_t body_size) {
+		return "POST " + path + " HTTP/1.1\r\nHost: localhost\r\nContent-Length: " + std::to_string(body_size) + "\r\n\r\n" +
+			std::string(body_size, 'x');
+	}
+
+	/// Blocking client of one connection, reading responses with Content-Length into a buffer of its own
+	class client {
+	public:
+		client(asio::io_context &io_context, const asio::ip::tcp::endpoint &endpoint) : m_socket(io_context), m_endpoint(endpoint),
+			m_buffer(1 << 20) {}
+
+		bool connect() {
+			std::error_code ec;
+			m_socket.close(ec);
+			m_socket.connect(m_endpoint, ec);
+			if (!ec)
+				m_socket.set_option(asio::ip::tcp::no_delay(true), ec);
+			m_start = m_end = 0;
+			return !ec;
+		}
+
+		void close() {
+			std::error_code ec;
+			m_socket.shutdown(asio::ip::tcp::socket::shutdown_both, ec);
+			m_socket.close(ec);
+		}
+
+		bool write(const std::string &data) {
+			std::error_code ec;
+			asio::write(m_socket, asio::buffer(data), ec);
+			return !ec;
+		}
+
+		/// Reads one response, returns false on errors and on responses other than 200
+		bool read_response() {
+			size_t head_end;
+			while ((head_end = find_head_end()) == 0) {
+				if (!fill())
+					return false;
+			}
+			auto head = &m_buffer[m_start];
+			bool ok = head_end - m_start > 12 && std::memcmp(head, "HTTP/1.1 200", 12) == 0;
+			size_t length = content_length(head, head_end - m_start);
+			m_start = head_end;
+			while (m_end - m_start < length) {
+				length -= m_end - m_start;
+				m_start = m_end;
+				if (!fill())
+					return false;
+			}
+			m_start += length;
+			return ok;
+		}
+	private:
+		/// Returns the offset behind the empty line ending the head, 0 if it has not been received yet
+		size_t find_head_end() const {
+			for (size_t c = m_start; c + 4 <= m_end; c++) {
+				if (m_buffer[c] == '\r' && m_buffer[c + 1] == '\n' && m_buffer[c + 2] == '\r' && m_buffer[c + 3] == '\n')
+					return c + 4;
+			}
+			return 0;
+		}
+
+		static size_t content_length(const char *head, size_t size) {
+			static const char field[] = "\r\nContent-Length: ";
+			auto end = head + size;
+			auto found = std::search(head, end, field, field + sizeof(field) - 1);
+			if (found == end)
+				return 0;
+			return static_cast<size_t>(std::strtoull(found + sizeof(field) - 1, nullptr, 10));
+		}
+
+		bool fill() {
+			if (m_start == m_end)
+				m_start = m_end = 0;
+			else if (m_end == m_buffer.size()) {
+				std::memmove(&m_buffer[0], &m_buffer[m_start], m_end - m_start);
+				m_end -= m_start;
+				m_start = 0;
+			}
+			std::error_code ec;
+			m_end += m_socket.read_some(asio::buffer(&m_buffer[m_end], m_buffer.size() - m_end), ec);
+			return !ec;
+		}
+
+		asio::ip::tcp::socket m_socket;
+		asio::ip::tcp::endpoint m_endpoint;
+		std::vector<char> m_buffer;
+		size_t m_start = 0;
+		size_t m_end = 0;
+	};
+
+	/// Runs one connection of a scenario until stop is set, recording while measuring is set
+	void run_connection(const scenario &s, size_t index, const asio::ip::tcp::endpoint &endpoint, const std::atomic<bool> &measuring,
+		const std::atomic<bool> &stop, result &out) {
+		asio::io_context io_context;
+		client c(io_context, endpoint);
+		//Requests of a batch go out with one write; a buffer of a sequence would be copied by asio::write()
+		std::string batch;
+		size_t longest = 0;
+		for (auto &request : s.requests)
+			longest = std::max(longest, request.size());
+		batch.reserve(longest * s.depth);
+		size_t next = index;
+		bool connected = false;
+		while (!stop) {
+			if (!connected && !(connected = c.connect())) {
+				if (measuring)
+					out.errors++;
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				continue;
+			}
+			size_t depth = s.kind == mode::pipelined ? s.depth : 1;
+			batch.clear();
+			for (size_t d = 0; d < depth; d++)
+				batch += s.requests[next++ % s.requests.size()];
+			auto start = clock::now();
+			bool ok = c.write(batch);
+			for (size_t d = 0; d < depth && ok; d++) {
+				ok = c.read_response();
+				if (ok && measuring) {
+					out.requests++;
+					out.latency.record(static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count()));
+				}
+			}
+			if (!ok) {
+				if (measuring)
+					out.errors++;
+				connected = false;
+			}
+			else if (s.kind == mode::close) {
+				c.close();
+				connected = false;
+			}
+		}
+		c.close();
+	}
+
+	result run(const scenario &s, const asio::ip::tcp::endpoint &endpoint, double duration) {
+		std::atomic<bool> measuring{false}, stop{false};
+		std::vector<result> results(s.connections);
+		std::vector<std::thread> threads;
+		for (size_t c = 0; c < s.connections; c++)
+			threads.emplace_back([&, c]() { run_connection(s, c, endpoint, measuring, stop, results[c]); });
+
+		//Warm up, so that connections, recycled objects and caches are in place before measuring
+		std::this_thread::sleep_for(std::chrono::milliseconds(300));
+		auto allocations_before = allocations.load();
+		auto start = clock::now();
+		measuring = true;
+		std::this_thread::sleep_for(std::chrono::duration<double>(duration));
+		measuring = false;
+		auto seconds = std::chrono::duration<double>(clock::now() - start).count();
+		auto allocations_after = allocations.load();
+		stop = true;
+		for (auto &t : threads)
+			t.join();
+
+		result total;
+		for (auto &r : results) {
+			total.requests += r.requests;
+			total.errors += r.errors;
+			total.latency.merge(r.latency);
+		}
+		total.seconds = seconds;
+		total.allocations = allocations_after - allocations_before;
+		return total;
+	}
+
+	std::vector<scenario> make_scenarios() {
+		std::vector<scenario> scenarios = {
+			{ "small keep-alive", mode::keep_alive, 1, 1, { get("/hello") } },
+			{ "small keep-alive x16", mode::keep_alive, 16, 1, { get("/hello") } },
+			{ "small close x16", mode::close, 16, 1, { get("/hello", true) } },
+			{ "small pipelined x4 depth 16", mode::pipelined, 4, 16, { get("/hello") } },
+			{ "large 64K keep-alive x16", mode::keep_alive, 16, 1, { get("/large") } },
+			{ "post 16K keep-alive x16", mode::keep_alive, 16, 1, { post("/echo", 16384) } },
+			{ "routes keep-alive x16", mode::keep_alive, 16, 1, {} },
+		};
+		//Every registered route in turn, with and without parameters
+		auto &routes = scenarios.back().requests;
+		for (int c = 0; c < 100; c++) {
+			routes.push_back(get("/api/v1/resource" + std::to_string(c)));
+			routes.push_back(get("/api/v1/items/" + std::to_string(c * 7919)));
+		}
+		return scenarios;
+	}
+
+	double ms(std::uint64_t ns) {
+		return static_cast<double>(ns) / 1e6;
+	}
+
+	std::string json_string(const std::string &str) {
+		std::string result = "\"";
+		for (auto c : str) {
+			if (c == '"' || c == '\\')
+				result += '\\';
+			result += c;
+		}
+		return result + "\"";
+	}
+}
+
+int main(int argc, char **argv) {
+	double duration = 2.0;
+	size_t server_threads = 1;
+	unsigned short port = 18181;
+	std::string filter;
+	bool json = false;
+	for (int c = 1; c < argc; c++) {
+		std::string arg = argv[c];
+		auto value = [&]() { return c + 1 < argc ? std::string(argv[++c]) : std::string(); };
+		if (arg == "--duration")
+			duration = std::atof(value().c_str());
+		else if (arg == "--server-threads")
+			server_threads = static_cast<size_t>(std::atoi(value().c_str()));
+		else if (arg == "--port")
+			port = static_cast<unsigned short>(std::atoi(value().c_str()));
+		else if (arg == "--filter")
+			filter = value();
+		else if (arg == "--json")
+			json = true;
+		else {
+			std::cerr << "usage: webpp_bench [--duration seconds] [--server-threads n] [--port n] [--filter text] [--json]" << std::endl;
+			return 1;
+		}
+	}
+
+	webpp::http_server server;
+	server.m_config.address = "127.0.0.1";
+	server.m_config.port = port;
+	server.m_config.thread_pool_size = server_threads;
+	auto large = std::make_shared<const std::string>(65536, 'x');
+	server.on_get("/hello", [](std::shared_ptr<webpp::http_server::Response> response, std::shared_ptr<webpp::http_server::Request>) {
+		response->status(200).send("Hello World!");
+	});
+	server.on_get("/large", [large](std::shared_ptr<webpp::http_server::Response> response, std::shared_ptr<webpp::http_server::Request>) {
+		response->status(200).send(large);
+	});
+	server.on_post("/echo", [](std::shared_ptr<webpp::http_server::Response> response, std::shared_ptr<webpp::http_server::Request> request) {
+		char size[32];
+		std::snprintf(size, sizeof(size), "%zu", request->content.size());
+		response->status(200).send(std::string(size));
+	});
+	for (int c = 0; c < 100; c++) {
+		server.on_get("/api/v1/resource" + std::to_string(c), [](std::shared_ptr<webpp::http_server::Response> response, std::shared_ptr<webpp::http_server::Request>) {
+			response->status(200).send("resource");
+		});
+	}
+	server.on_get("/api/v1/items/:id", [](std::shared_ptr<webpp::http_server::Response> response, std::shared_ptr<webpp::http_server::Request> request) {
+		response->status(200).send(request->params["id"]);
+	});
+	std::thread server_thread([&server]() { server.start(); });
+
+	asio::ip::tcp::endpoint endpoint(asio::ip::make_address("127.0.0.1"), port);
+	{
+		//Wait for the server to listen
+		asio::io_context io_context;
+		asio::ip::tcp::socket socket(io_context);
+		std::error_code ec;
+		for (int c = 0; c < 100 && (socket.connect(endpoint, ec), ec); c++) {
+			socket.close(ec);
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		}
+	}
+
+	std::ostringstream report;
+	if (json)
+		report << "{\"duration\":" << duration << ",\"server_threads\":" << server_threads << ",\"scenarios\":[";
+	else {
+		report << "server threads: " << server_threads << ", " << duration << " s per scenario" << std::endl;
+		report << std::left << std::setw(30) << "scenario" << std::right << std::setw(12) << "req/s" << std::setw(10) << "p50 ms"
+			<< std::setw(10) << "p99 ms" << std::setw(10) << "p999 ms" << std::setw(12) << "allocs/req" << std::setw(8) << "errors" << std::endl;
+	}
+	bool first = true;
+	for (auto &s : make_scenarios()) {
+		if (!filter.empty() && std::string(s.name).find(filter) == std::string::npos)
+			continue;
+		auto r = run(s, endpoint, duration);
+		double rate = r.seconds > 0 ? static_cast<double>(r.requests) / r.seconds : 0.0;
+		double per_request = r.requests > 0 ? static_cast<double>(r.allocations) / static_cast<double>(r.requests) : 0.0;
+		if (json) {
+			report << (first ? "" : ",") << "{\"name\":" << json_string(s.name) << ",\"mode\":\"" << mode_name(s.kind)
+				<< "\",\"connections\":" << s.connections << ",\"depth\":" << s.depth << ",\"requests\":" << r.requests
+				<< ",\"errors\":" << r.errors << ",\"requests_per_second\":" << std::fixed << std::setprecision(1) << rate
+				<< std::setprecision(4) << ",\"latency_ms\":{\"p50\":" << ms(r.latency.quantile(0.5)) << ",\"p99\":" << ms(r.latency.quantile(0.99))
+				<< ",\"p999\":" << ms(r.latency.quantile(0.999)) << "},\"allocations_per_request\":" << per_request << "}";
+			report.unsetf(std::ios::floatfield);
+		}
+		else {
+			report << std::left << std::setw(30) << s.name << std::right << std::fixed << std::setprecision(0) << std::setw(12) << rate
+				<< std::setprecision(3) << std::setw(10) << ms(r.latency.quantile(0.5)) << std::setw(10) << ms(r.latency.quantile(0.99))
+				<< std::setw(10) << ms(r.latency.quantile(0.999)) << std::setprecision(2) << std::setw(12) << per_request
+				<< std::setw(8) << r.errors << std::endl;
+		}
+		first = false;
+	}
+	if (json)
+		report << "]}" << std::endl;
+	std::cout << report.str() << std::flush;
+
+	server.stop();
+	server_thread.join();
+	return 0;
+}
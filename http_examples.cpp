@@ -2,100 +2,7 @@
 // copyright-holders:Ole Christian Eidheim, Miodrag Milanovic
 #include "server_http.hpp"
 #include "client_http.hpp"
-#include <fstream>
-struct mapping
-{
-	const char* extension;
-	const char* mime_type;
-} mappings[] =
-{
-	{ "aac",     "audio/aac" },
-	{ "aat",     "application/font-sfnt" },
-	{ "aif",     "audio/x-aif" },
-	{ "arj",     "application/x-arj-compressed" },
-	{ "asf",     "video/x-ms-asf" },
-	{ "avi",     "video/x-msvideo" },
-	{ "bmp",     "image/bmp" },
-	{ "cff",     "application/font-sfnt" },
-	{ "css",     "text/css" },
-	{ "csv",     "text/csv" },
-	{ "doc",     "application/msword" },
-	{ "eps",     "application/postscript" },
-	{ "exe",     "application/octet-stream" },
-	{ "gif",     "image/gif" },
-	{ "gz",      "application/x-gunzip" },
-	{ "htm",     "text/html" },
-	{ "html",    "text/html" },
-	{ "ico",     "image/x-icon" },
-	{ "ief",     "image/ief" },
-	{ "jpeg",    "image/jpeg" },
-	{ "jpg",     "image/jpeg" },
-	{ "jpm",     "image/jpm" },
-	{ "jpx",     "image/jpx" },
-	{ "js",      "application/javascript" },
-	{ "json",    "application/json" },
-	{ "m3u",     "audio/x-mpegurl" },
-	{ "m4v",     "video/x-m4v" },
-	{ "mid",     "audio/x-midi" },
-	{ "mov",     "video/quicktime" },
-	{ "mp3",     "audio/mpeg" },
-	{ "mp4",     "video/mp4" },
-	{ "mpeg",    "video/mpeg" },
-	{ "mpg",     "video/mpeg" },
-	{ "oga",     "audio/ogg" },
-	{ "ogg",     "audio/ogg" },
-	{ "ogv",     "video/ogg" },
-	{ "otf",     "application/font-sfnt" },
-	{ "pct",     "image/x-pct" },
-	{ "pdf",     "application/pdf" },
-	{ "pfr",     "application/font-tdpfr" },
-	{ "pict",    "image/pict" },
-	{ "png",     "image/png" },
-	{ "ppt",     "application/x-mspowerpoint" },
-	{ "ps",      "application/postscript" },
-	{ "qt",      "video/quicktime" },
-	{ "ra",      "audio/x-pn-realaudio" },
-	{ "ram",     "audio/x-pn-realaudio" },
-	{ "rar",     "application/x-arj-compressed" },
-	{ "rgb",     "image/x-rgb" },
-	{ "rtf",     "application/rtf" },
-	{ "sgm",     "text/sgml" },
-	{ "shtm",    "text/html" },
-	{ "shtml",   "text/html" },
-	{ "sil",     "application/font-sfnt" },
-	{ "svg",     "image/svg+xml" },
-	{ "swf",     "application/x-shockwave-flash" },
-	{ "tar",     "application/x-tar" },
-	{ "tgz",     "application/x-tar-gz" },
-	{ "tif",     "image/tiff" },
-	{ "tiff",    "image/tiff" },
-	{ "torrent", "application/x-bittorrent" },
-	{ "ttf",     "application/font-sfnt" },
-	{ "txt",     "text/plain" },
-	{ "wav",     "audio/x-wav" },
-	{ "webm",    "video/webm" },
-	{ "woff",    "application/font-woff" },
-	{ "wrl",     "model/vrml" },
-	{ "xhtml",   "application/xhtml+xml" },
-	{ "xls",     "application/x-msexcel" },
-	{ "xml",     "text/xml" },
-	{ "xsl",     "application/xml" },
-	{ "xslt",    "application/xml" },
-	{ "zip",     "application/x-zip-compressed" }
-};
-
-std::string extension_to_type(const std::string& extension)
-{
-	for (mapping m : mappings)
-	{
-		if (m.extension == extension)
-		{
-			return m.mime_type;
-		}
-	}
-
-	return "text/plain";
-}
+#include "static_files.hpp"
 
 int main() {
 	std::shared_ptr<asio::io_context> io_context = std::make_shared<asio::io_context>();
@@ -104,6 +11,10 @@ int main() {
 	//1 thread is usually faster than several threads
 	webpp::http_server server;
 	server.m_config.port = 8080;
+	//Compress larger text responses for clients that accept gzip or deflate, when built with zlib
+	server.m_config.compression = true;
+	//Request counts and latencies in the Prometheus text format at /metrics
+	server.serve_metrics();
 
 	server.set_io_context(io_context);
 
@@ -165,51 +76,13 @@ int main() {
 		work_thread.detach();
 	});
 
-	//Default GET-example. If no other matches, this anonymous function will be called.
+	//Default GET-example. If no other matches, this handler will be called.
 	//Will respond with content in the web/-directory, and its subdirectories.
 	//Default file: index.html
 	//Can for instance be used to retrieve an HTML 5 client that uses REST-resources on this server
-	server.on_get([&server](auto response, auto request) {
-
-		std::string doc_root = "web/";
-		std::string path = request->path;
-		// If path ends in slash (i.e. is a directory) then add "index.html".
-		if (path[path.size() - 1] == '/')
-		{
-			path += "index.html";
-		}
-
-		std::size_t last_qmark_pos = path.find_last_of("?");
-		if (last_qmark_pos != std::string::npos)
-			path = path.substr(0, last_qmark_pos - 1);
-
-		// Determine the file extension.
-		std::size_t last_slash_pos = path.find_last_of("/");
-		std::size_t last_dot_pos = path.find_last_of(".");
-		std::string extension;
-		if (last_dot_pos != std::string::npos && last_dot_pos > last_slash_pos)
-		{
-			extension = path.substr(last_dot_pos + 1);
-		}
-
-		// Open the file to send back.
-		std::string full_path = doc_root + path;
-		std::ifstream is(full_path.c_str(), std::ios::in | std::ios::binary);
-		if (!is)
-		{
-			response->status(400).send("Error");
-		}
-
-		// Fill out the reply to be sent to the client.
-		std::string content;
-		char buf[512];
-		while (is.read(buf, sizeof(buf)).gcount() > 0)
-			content.append(buf, size_t(is.gcount()));
-
-		response->type(extension_to_type(extension));
-		response->status(200).send(content);
-
-	});
+	webpp::static_files<webpp::HTTP> files(server, "web/");
+	server.on_get(files);
+	server.on_head(files);
 
 	std::thread server_thread([&server, &io_context](){
 		//Start server
@@ -232,6 +105,16 @@ int main() {
 	auto r3=client.request("POST", "/json", json_string);
 	std::cout << r3->content.rdbuf() << std::endl;
 
+	//Asynchronous requests run on an io_context run elsewhere, here the server's
+	client.set_io_context(io_context);
+	auto r5=client.async_request("GET", "/match/456");
+	std::cout << r5.get()->content.rdbuf() << std::endl;
+
+	//Several requests written at once on one connection, the responses come in the same order
+	auto r6=client.async_batch({{"GET", "/match/7"}, {"GET", "/match/8"}}).get();
+	for(auto &response: r6)
+		std::cout << response->content.rdbuf() << std::endl;
+
 	server.remove_handler("/match/:id(\\d+)");
 	auto r4 = client.request("GET", "/match/123");
 //	std::cout << r4->content.rdbuf() << std::endl;
@@ -0,0 +1,140 @@
+// license:MIT
+// copyright-holders:Miodrag Milanovic
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace webpp {
+	/// Bump allocator for the small, short-lived allocations made while serving the requests of one connection.
+	///
+	/// Memory is handed out from a fixed buffer, and the buffer is reused from its start once everything that
+	/// was allocated from it has been released again, which in steady state is between two requests.
+	/// Allocations that do not fit fall back to the heap. Allocation and release may happen on any thread.
+	class arena {
+	public:
+		explicit arena(size_t capacity) : m_buffer(new char[capacity]), m_capacity(capacity), m_used(0), m_live(0) {}
+		arena(const arena&) = delete;
+		arena &operator=(const arena&) = delete;
+
+		void *allocate(size_t size, size_t alignment) {
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				size_t offset = (m_used + alignment - 1) & ~(alignment - 1);
+				if (offset + size <= m_capacity) {
+					m_used = offset + size;
+					m_live++;
+					return m_buffer.get() + offset;
+				}
+			}
+			return ::operator new(size);
+		}
+
+		void deallocate(void *ptr) {
+			auto address = static_cast<char*>(ptr);
+			if (address < m_buffer.get() || address >= m_buffer.get() + m_capacity) {
+				::operator delete(ptr);
+				return;
+			}
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (--m_live == 0)
+				m_used = 0;
+		}
+	private:
+		std::unique_ptr<char[]> m_buffer;
+		size_t m_capacity;
+		size_t m_used;
+		size_t m_live;
+		std::mutex m_mutex;
+	};
+
+	/// Standard allocator drawing from an arena. Copies share the arena, which stays alive as long as any copy does.
+	template <class T>
+	class arena_allocator {
+		template <class U> friend class arena_allocator;
+	public:
+		using value_type = T;
+
+		explicit arena_allocator(const std::shared_ptr<arena> &source) : m_arena(source) {}
+		template <class U>
+		arena_allocator(const arena_allocator<U> &other) : m_arena(other.m_arena) {}
+
+		T *allocate(size_t n) { return static_cast<T*>(m_arena->allocate(n * sizeof(T), alignof(T))); }
+		void deallocate(T *ptr, size_t) { m_arena->deallocate(ptr); }
+
+		template <class U>
+		bool operator==(const arena_allocator<U> &rhs) const { return m_arena == rhs.m_arena; }
+		template <class U>
+		bool operator!=(const arena_allocator<U> &rhs) const { return m_arena != rhs.m_arena; }
+	private:
+		std::shared_ptr<arena> m_arena;
+	};
+
+	/// Per-thread cache of memory blocks for asio's asynchronous operations. asio itself recycles a single block
+	/// per thread, while serving a request keeps several operations (read, write, strand dispatch) in flight.
+	/// Blocks freed on another thread than the one that allocated them simply move to that thread's cache.
+	class handler_memory {
+	public:
+		static void *allocate(size_t size) {
+			if (size > block_size)
+				return ::operator new(size);
+			auto &blocks = local();
+			if (blocks.count > 0)
+				return blocks.free[--blocks.count];
+			return ::operator new(block_size);
+		}
+
+		static void deallocate(void *ptr, size_t size) {
+			auto &blocks = local();
+			if (size > block_size || blocks.count == max_blocks)
+				::operator delete(ptr);
+			else
+				blocks.free[blocks.count++] = ptr;
+		}
+	private:
+		static const size_t block_size = 512;
+		static const size_t max_blocks = 32;
+
+		struct cache {
+			void *free[max_blocks];
+			size_t count = 0;
+			~cache() {
+				while (count > 0)
+					::operator delete(free[--count]);
+			}
+		};
+
+		static cache &local() {
+			static thread_local cache blocks;
+			return blocks;
+		}
+	};
+
+	/// Completion handler wrapper that makes asio take the memory of its operations from handler_memory.
+	/// When used with strand::wrap(), this is the inner handler.
+	template <class Handler>
+	class recycling_handler {
+	public:
+		explicit recycling_handler(Handler handler) : m_handler(std::move(handler)) {}
+
+		template <class... Args>
+		void operator()(Args&&... args) { m_handler(std::forward<Args>(args)...); }
+
+		friend void *asio_handler_allocate(size_t size, recycling_handler*) { return handler_memory::allocate(size); }
+		friend void asio_handler_deallocate(void *ptr, size_t size, recycling_handler*) { handler_memory::deallocate(ptr, size); }
+	private:
+		Handler m_handler;
+	};
+
+	template <class Handler>
+	recycling_handler<typename std::decay<Handler>::type> make_recycling_handler(Handler &&handler) {
+		return recycling_handler<typename std::decay<Handler>::type>(std::forward<Handler>(handler));
+	}
+}
+
+#endif  /* ARENA_HPP */
@@ -0,0 +1,438 @@
+// license:MIT
+// copyright-holders:Miodrag Milanovic
+#ifndef ASSET_STORE_HPP
+#define ASSET_STORE_HPP
+
+#include "static_files.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <dirent.h>
+#include <sys/mman.h>
+#endif
+
+namespace webpp {
+	/// Read-only store of static assets held in memory, such as the files of a single page application.
+	///
+	/// All files are loaded at startup into one memory region: a mapping of an archive written by pack(), or an
+	/// anonymous mapping filled from a directory. Responses refer into the region, so serving an asset copies
+	/// nothing. A file named like an asset plus ".gz" or ".br" is stored as a precompressed variant of it, sent
+	/// instead to clients whose Accept-Encoding allows it. The store is a request handler for GET and HEAD, and
+	/// copies share the loaded assets:
+	///
+	///     auto assets = webpp::asset_store::load_directory("web");
+	///     assets.fallback("/index.html");
+	///     server.on_get(assets);
+	///     server.on_head(assets);
+	class asset_store {
+	public:
+		/// Loads the files below directory. Throws std::runtime_error if they cannot be read.
+		static asset_store load_directory(const std::string &directory) {
+			auto entries = list_entries(directory, 0);
+			uint64_t total = 0;
+			for (auto &entry : entries)
+				total += entry.size;
+
+			std::unique_ptr<region> memory(new region(static_cast<size_t>(total)));
+			for (auto &entry : entries) {
+				std::ifstream file(entry.source, std::ios::in | std::ios::binary);
+				if (!file.read(memory->data() + entry.offset, static_cast<std::streamsize>(entry.size)))
+					throw std::runtime_error("cannot read " + entry.source);
+			}
+			memory->seal();
+			return asset_store(build(std::move(memory), entries));
+		}
+
+		/// Loads an archive written by pack(). Throws std::runtime_error if it cannot be read or is invalid.
+		static asset_store load_archive(const std::string &path) {
+			std::unique_ptr<region> memory(new region(path));
+			auto data = memory->data();
+			auto size = memory->size();
+			uint64_t count;
+			if (size < archive_head_size || std::memcmp(data, archive_magic(), archive_magic_size) != 0)
+				throw std::runtime_error(path + " is not an asset archive");
+			std::memcpy(&count, data + archive_magic_size, sizeof(count));
+
+			std::vector<entry> entries;
+			size_t position = archive_head_size;
+			for (uint64_t c = 0; c < count; c++) {
+				entry item;
+				uint32_t path_size;
+				if (size - position < archive_entry_size)
+					throw std::runtime_error(path + " is truncated");
+				read_field(data, position, item.offset);
+				read_field(data, position, item.size);
+				read_field(data, position, item.modified);
+				read_field(data, position, item.encoding);
+				read_field(data, position, path_size);
+				if (size - position < path_size || item.encoding >= encoding_count || item.offset > size || item.size > size - item.offset)
+					throw std::runtime_error(path + " is invalid");
+				item.path.assign(data + position, path_size);
+				position += path_size;
+				entries.push_back(std::move(item));
+			}
+			return asset_store(build(std::move(memory), entries));
+		}
+
+		/// Writes the files below directory into an archive for load_archive(). Throws std::runtime_error on errors.
+		static void pack(const std::string &directory, const std::string &path) {
+			auto entries = list_entries(directory, 0);
+			uint64_t index_size = archive_head_size;
+			for (auto &entry : entries)
+				index_size += archive_entry_size + entry.path.size();
+
+			std::ofstream archive(path, std::ios::out | std::ios::binary | std::ios::trunc);
+			uint64_t count = entries.size();
+			archive.write(archive_magic(), archive_magic_size);
+			archive.write(reinterpret_cast<const char*>(&count), sizeof(count));
+			for (auto &entry : entries) {
+				uint64_t offset = index_size + entry.offset;
+				uint32_t path_size = static_cast<uint32_t>(entry.path.size());
+				archive.write(reinterpret_cast<const char*>(&offset), sizeof(offset));
+				archive.write(reinterpret_cast<const char*>(&entry.size), sizeof(entry.size));
+				archive.write(reinterpret_cast<const char*>(&entry.modified), sizeof(entry.modified));
+				archive.write(reinterpret_cast<const char*>(&entry.encoding), sizeof(entry.encoding));
+				archive.write(reinterpret_cast<const char*>(&path_size), sizeof(path_size));
+				archive.write(entry.path.data(), static_cast<std::streamsize>(entry.path.size()));
+			}
+			for (auto &entry : entries) {
+				std::ifstream file(entry.source, std::ios::in | std::ios::binary);
+				if (entry.size > 0 && !(archive << file.rdbuf()))
+					throw std::runtime_error("cannot read " + entry.source);
+			}
+			if (!archive.flush())
+				throw std::runtime_error("cannot write " + path);
+		}
+
+		/// Sets the asset served for paths that have none, for instance "/index.html" when the client does its own
+		/// routing. By default such requests get a 404. To be set before the store is registered as a handler.
+		void fallback(const std::string &path) { m_fallback = path; }
+
+		/// Number of assets, not counting their variants
+		size_t size() const { return m_bundle->count; }
+
+		template<class Response, class Request>
+		void operator()(const std::shared_ptr<Response> &response, const std::shared_ptr<Request> &request) const {
+			//Paths are looked up as static_files would map them to a file
+			std::string path;
+			if (!decode_target_path(request->path, path)) {
+				response->status(400).send(std::string("Bad Request"));
+				return;
+			}
+			auto found = find(path);
+			if (!found && !m_fallback.empty())
+				found = find(m_fallback);
+			if (!found) {
+				response->status(404).send(std::string("Not Found"));
+				return;
+			}
+
+			auto content = &found->encodings[identity];
+			const char *content_encoding = nullptr;
+			auto accept = request->header.find("Accept-Encoding");
+			if (found->has_variants && accept != request->header.end()) {
+				if (found->encodings[brotli].present && accepts_coding(accept->second, "br")) {
+					content = &found->encodings[brotli];
+					content_encoding = "br";
+				}
+				else if (found->encodings[gzip].present && accepts_coding(accept->second, "gzip")) {
+					content = &found->encodings[gzip];
+					content_encoding = "gzip";
+				}
+			}
+
+			response->type(found->type);
+			if (content_encoding)
+				response->header("Content-Encoding", content_encoding);
+			if (found->has_variants)
+				response->header("Vary", "Accept-Encoding");
+			response->header("Last-Modified", found->last_modified);
+			response->header("ETag", content->etag);
+			if (not_modified(request->header, content->etag, found->modified)) {
+				response->status(304).send_head(content->size);
+				return;
+			}
+			response->status(200);
+			if (request->method == "HEAD")
+				response->send_head(content->size);
+			else
+				response->send(asio::buffer(content->data, content->size), m_bundle);
+		}
+	private:
+		enum encoding : uint32_t { identity, gzip, brotli, encoding_count };
+
+		/// Memory holding the contents of all assets, mapped from an archive or filled by load_directory()
+		class region {
+		public:
+			/// Allocates size bytes to be filled, then seal()ed
+			explicit region(size_t size) : m_size(size) {
+				if (size == 0)
+					return;
+#if defined(_WIN32)
+				m_heap.reset(new char[size]);
+				m_data = m_heap.get();
+#else
+				auto data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+				if (data == MAP_FAILED)
+					throw std::runtime_error("cannot allocate the asset store");
+				m_data = static_cast<char*>(data);
+#endif
+			}
+
+			/// Maps the file at path, read-only
+			explicit region(const std::string &path) {
+#if defined(_WIN32)
+				std::ifstream file(path, std::ios::in | std::ios::binary | std::ios::ate);
+				if (!file)
+					throw std::runtime_error("cannot open " + path);
+				m_size = static_cast<size_t>(file.tellg());
+				m_heap.reset(new char[m_size]);
+				m_data = m_heap.get();
+				file.seekg(0);
+				if (!file.read(m_data, static_cast<std::streamsize>(m_size)))
+					throw std::runtime_error("cannot read " + path);
+#else
+				struct stat status;
+				auto handle = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+				if (handle < 0 || ::fstat(handle, &status) != 0) {
+					if (handle >= 0)
+						::close(handle);
+					throw std::runtime_error("cannot open " + path);
+				}
+				m_size = static_cast<size_t>(status.st_size);
+				void *data = m_size > 0 ? ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, handle, 0) : nullptr;
+				::close(handle);
+				if (data == MAP_FAILED)
+					throw std::runtime_error("cannot map " + path);
+				m_data = static_cast<char*>(data);
+#endif
+			}
+
+			region(const region&) = delete;
+			region &operator=(const region&) = delete;
+
+			~region() {
+#if !defined(_WIN32)
+				if (m_data)
+					::munmap(m_data, m_size);
+#endif
+			}
+
+			char *data() const { return m_data; }
+			size_t size() const { return m_size; }
+
+			/// Makes the memory read-only once it has been filled
+			void seal() {
+#if !defined(_WIN32)
+				if (m_data)
+					::mprotect(m_data, m_size, PROT_READ);
+#endif
+			}
+		private:
+			char *m_data = nullptr;
+			size_t m_size = 0;
+#if defined(_WIN32)
+			std::unique_ptr<char[]> m_heap;
+#endif
+		};
+
+		struct representation {
+			bool present = false;
+			const char *data = nullptr;
+			size_t size = 0;
+			std::string etag;
+		};
+
+		struct asset {
+			const char *type = nullptr;
+			std::time_t modified = 0;
+			std::string last_modified;
+			bool has_variants = false;
+			representation encodings[encoding_count];
+		};
+
+		struct bundle {
+			std::unique_ptr<region> memory;
+			/// Paths of directories ending with '/' lead to their index.html as well
+			std::unordered_map<std::string, asset> assets;
+			size_t count = 0;
+		};
+
+		/// A file of the store, as listed in an archive
+		struct entry {
+			std::string path;
+			/// File the contents are read from, when loading or packing a directory
+			std::string source;
+			uint64_t offset = 0;
+			uint64_t size = 0;
+			int64_t modified = 0;
+			uint32_t encoding = identity;
+		};
+
+		static const char *archive_magic() { return "WEBPPAK1"; }
+		static const size_t archive_magic_size = 8;
+		/// Magic and number of entries
+		static const size_t archive_head_size = 16;
+		/// Offset, size, modification time, encoding and path size, followed by the path
+		static const size_t archive_entry_size = 32;
+
+		explicit asset_store(std::shared_ptr<const bundle> assets) : m_bundle(std::move(assets)) {}
+
+		template<class T>
+		static void read_field(const char *data, size_t &position, T &value) {
+			std::memcpy(&value, data + position, sizeof(value));
+			position += sizeof(value);
+		}
+
+		const asset *find(const std::string &path) const {
+			auto &assets = m_bundle->assets;
+			auto it = assets.find(path);
+			return it == assets.end() ? nullptr : &it->second;
+		}
+
+		struct found_file {
+			std::string path;
+			std::string source;
+			uint64_t size;
+			int64_t modified;
+		};
+
+		static void list_files(const std::string &directory, const std::string &prefix, std::vector<found_file> &files) {
+#if defined(_WIN32)
+			_finddata64_t data;
+			auto handle = _findfirst64((directory + "\\*").c_str(), &data);
+			if (handle == -1)
+				throw std::runtime_error("cannot read " + directory);
+			do {
+				std::string name = data.name;
+				if (name == "." || name == "..")
+					continue;
+				if (data.attrib & _A_SUBDIR)
+					list_files(directory + "\\" + name, prefix + "/" + name, files);
+				else
+					files.push_back(found_file{ prefix + "/" + name, directory + "\\" + name, static_cast<uint64_t>(data.size), static_cast<int64_t>(data.time_write) });
+			} while (_findnext64(handle, &data) == 0);
+			_findclose(handle);
+#else
+			auto dir = ::opendir(directory.c_str());
+			if (!dir)
+				throw std::runtime_error("cannot read " + directory);
+			while (auto item = ::readdir(dir)) {
+				std::string name = item->d_name;
+				if (name == "." || name == "..")
+					continue;
+				auto source = directory + "/" + name;
+				struct stat status;
+				if (::stat(source.c_str(), &status) != 0)
+					continue;
+				if (S_ISDIR(status.st_mode))
+					list_files(source, prefix + "/" + name, files);
+				else if (S_ISREG(status.st_mode))
+					files.push_back(found_file{ prefix + "/" + name, source, static_cast<uint64_t>(status.st_size), static_cast<int64_t>(status.st_mtime) });
+			}
+			::closedir(dir);
+#endif
+		}
+
+		/// Lists the files below directory as entries, the precompressed ones as variants, laid out from offset
+		static std::vector<entry> list_entries(const std::string &directory, uint64_t offset) {
+			std::vector<found_file> files;
+			list_files(directory, std::string(), files);
+			std::set<std::string> paths;
+			for (auto &file : files)
+				paths.insert(file.path);
+
+			std::vector<entry> entries;
+			for (auto &file : files) {
+				entry item;
+				item.path = file.path;
+				item.source = file.source;
+				item.size = file.size;
+				item.modified = file.modified;
+				item.offset = offset;
+				auto size = file.path.size();
+				if (size > 3 && paths.count(file.path.substr(0, size - 3)) != 0) {
+					if (file.path.compare(size - 3, 3, ".gz") == 0)
+						item.encoding = gzip;
+					else if (file.path.compare(size - 3, 3, ".br") == 0)
+						item.encoding = brotli;
+					if (item.encoding != identity)
+						item.path.resize(size - 3);
+				}
+				offset += file.size;
+				entries.push_back(std::move(item));
+			}
+			return entries;
+		}
+
+		/// Strong entity tag from the 64-bit FNV-1a hash of the contents
+		static std::string content_etag(const char *data, size_t size) {
+			uint64_t hash = 14695981039346656037ull;
+			for (size_t c = 0; c < size; c++) {
+				hash ^= static_cast<unsigned char>(data[c]);
+				hash *= 1099511628211ull;
+			}
+			char buffer[24];
+			std::snprintf(buffer, sizeof(buffer), "\"%016llx\"", static_cast<unsigned long long>(hash));
+			return buffer;
+		}
+
+		static std::shared_ptr<const bundle> build(std::unique_ptr<region> memory, const std::vector<entry> &entries) {
+			auto result = std::make_shared<bundle>();
+			auto &assets = result->assets;
+			//Variants are attached once all assets exist
+			for (int pass = 0; pass < 2; pass++) {
+				for (auto &item : entries) {
+					if ((item.encoding == identity) != (pass == 0))
+						continue;
+					if (pass == 1 && assets.count(item.path) == 0)
+						continue;
+					auto &content = assets[item.path];
+					if (pass == 0) {
+						content.type = path_to_type(item.path);
+						content.modified = static_cast<std::time_t>(item.modified);
+						char date[32];
+						format_http_date(content.modified, date);
+						content.last_modified = date;
+						result->count++;
+					}
+					else
+						content.has_variants = true;
+					auto &encoded = content.encodings[item.encoding];
+					encoded.present = true;
+					encoded.data = memory->data() + item.offset;
+					encoded.size = static_cast<size_t>(item.size);
+					encoded.etag = content_etag(encoded.data, encoded.size);
+				}
+			}
+			for (auto &item : entries) {
+				auto size = item.path.size();
+				if (item.encoding == identity && size >= 11 && item.path.compare(size - 11, 11, "/index.html") == 0) {
+					auto index = assets.at(item.path);
+					assets[item.path.substr(0, size - 10)] = std::move(index);
+				}
+			}
+			result->memory = std::move(memory);
+			return result;
+		}
+
+		std::shared_ptr<const bundle> m_bundle;
+		std::string m_fallback;
+	};
+}
+
+#endif  /* ASSET_STORE_HPP */
@@ -8,11 +8,24 @@
 #endif
 
 #include "asio.h"
+#include "asio/system_timer.hpp"
+#include "asio/steady_timer.hpp"
+#include "simd_scan.hpp"
+#include "http_parser.hpp"
+#include "dns_cache.hpp"
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <future>
 #include <unordered_map>
 #include <map>
+#include <memory>
 #include <random>
 #include <mutex>
+#include <vector>
 
 #ifndef CASE_INSENSITIVE_EQUALS_AND_HASH
 #define CASE_INSENSITIVE_EQUALS_AND_HASH
@@ -42,6 +55,166 @@ namespace webpp {
 	template <class socket_type>
 	class Client;
 
+	/// Keep-alive connections of asynchronous client requests, by scheme, host and port (see ClientBase::async_request()).
+	///
+	/// A connection goes back to the pool after a response that leaves it usable, and the next request to the
+	/// same host takes the connection that was used last, whose TCP and TLS state is the warmest. Idle connections
+	/// are checked for having been closed by the server before reuse and are closed after an idle timeout. When
+	/// a host has max_connections open, further requests wait for one of them. A pool serves clients on one
+	/// io_context; clients of the same host can share it with ClientBase::set_connection_pool(). While idle
+	/// connections are kept, the io_context does not run out of work.
+	template <class socket_type>
+	class connection_pool : public std::enable_shared_from_this<connection_pool<socket_type>> {
+	public:
+		using clock = std::chrono::steady_clock;
+		/// Called with an idle connection, or with a null one when the caller is to connect a new one
+		using ready_handler = std::function<void(std::unique_ptr<socket_type>)>;
+
+		explicit connection_pool(asio::io_context &io_context) : m_io_context(io_context), m_timer(io_context) {}
+		connection_pool(const connection_pool&) = delete;
+		connection_pool &operator=(const connection_pool&) = delete;
+
+		/// Calls ready with a connection to key, or with a null one once fewer than max_connections (0 for any
+		/// number) are open. Idle connections older than idle_timeout are closed on the way.
+		void acquire(const std::string &key, size_t max_connections, clock::duration idle_timeout, ready_handler ready) {
+			std::unique_ptr<socket_type> socket;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				auto &host = m_hosts[key];
+				host.idle_timeout = idle_timeout;
+				auto now = clock::now();
+				while (!host.idle.empty() && !socket) {
+					auto entry = std::move(host.idle.back());
+					host.idle.pop_back();
+					if (now - entry.since < idle_timeout && healthy(*entry.socket))
+						socket = std::move(entry.socket);
+					else
+						host.open--;
+				}
+				if (!socket) {
+					if (max_connections != 0 && host.open >= max_connections) {
+						host.waiting.push_back(std::move(ready));
+						return;
+					}
+					host.open++;
+				}
+			}
+			ready(std::move(socket));
+		}
+
+		/// Returns a connection acquired from the pool. A reusable one is kept for the next request, otherwise it is
+		/// closed (socket may then be null) and its place goes to the next request waiting, if any.
+		void release(const std::string &key, std::unique_ptr<socket_type> socket, bool reusable) {
+			ready_handler next;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				auto &host = m_hosts[key];
+				if (!reusable)
+					socket.reset();
+				if (!host.waiting.empty()) {
+					next = std::move(host.waiting.front());
+					host.waiting.pop_front();
+				}
+				else if (socket) {
+					host.idle.push_back(idle_connection{ std::move(socket), clock::now() });
+					sweep_later();
+					return;
+				}
+				else {
+					host.open--;
+					return;
+				}
+			}
+			//Posted, so that a long queue of waiting requests does not recurse
+			auto shared = std::make_shared<std::unique_ptr<socket_type>>(std::move(socket));
+			m_io_context.post([next, shared]() {
+				next(std::move(*shared));
+			});
+		}
+
+		/// Closes all idle connections
+		void clear() {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			for (auto &host : m_hosts) {
+				host.second.open -= host.second.idle.size();
+				host.second.idle.clear();
+			}
+		}
+	private:
+		struct idle_connection {
+			std::unique_ptr<socket_type> socket;
+			clock::time_point since;
+		};
+
+		struct host_connections {
+			/// Connections in use and idle
+			size_t open = 0;
+			/// Most recently used last
+			std::vector<idle_connection> idle;
+			std::deque<ready_handler> waiting;
+			clock::duration idle_timeout = clock::duration::zero();
+		};
+
+		/// Returns false if the server closed the connection, or sent something without having been asked
+		static bool healthy(socket_type &socket) {
+			auto &lowest = socket.lowest_layer();
+			if (!lowest.is_open())
+				return false;
+			std::error_code ec;
+			lowest.non_blocking(true, ec);
+			if (ec)
+				return false;
+			//basic_socket has no receive(), peek with the native call
+			char c;
+			auto received = ::recv(lowest.native_handle(), &c, 1, MSG_PEEK);
+#if defined(_WIN32)
+			bool result = received < 0 && WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+			bool result = received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+#endif
+			lowest.non_blocking(false, ec);
+			return result;
+		}
+
+		/// Arms the timer closing idle connections that timed out, called with the lock held
+		void sweep_later() {
+			if (m_sweeping)
+				return;
+			m_sweeping = true;
+			//Does not keep the pool alive, its destruction cancels the timer
+			std::weak_ptr<connection_pool> weak = this->shared_from_this();
+			m_timer.expires_after(std::chrono::seconds(1));
+			m_timer.async_wait([weak](const std::error_code &ec) {
+				auto self = weak.lock();
+				if (!self)
+					return;
+				std::lock_guard<std::mutex> lock(self->m_mutex);
+				self->m_sweeping = false;
+				if (ec)
+					return;
+				auto now = clock::now();
+				bool idle = false;
+				for (auto &host : self->m_hosts) {
+					auto &connections = host.second.idle;
+					auto expired = std::remove_if(connections.begin(), connections.end(), [&](const idle_connection &entry) {
+						return now - entry.since >= host.second.idle_timeout;
+					});
+					host.second.open -= static_cast<size_t>(connections.end() - expired);
+					connections.erase(expired, connections.end());
+					idle = idle || !connections.empty();
+				}
+				if (idle)
+					self->sweep_later();
+			});
+		}
+
+		asio::io_context &m_io_context;
+		std::mutex m_mutex;
+		std::map<std::string, host_connections> m_hosts;
+		asio::steady_timer m_timer;
+		bool m_sweeping = false;
+	};
+
 	template <class socket_type>
 	class ClientBase {
 	public:
@@ -74,6 +247,18 @@ namespace webpp {
 			size_t timeout_connect=0;
 			/// Set proxy server (server:port)
 			std::string proxy_server;
+			/// Maximum number of connections of async_request() to the host, further requests wait for one of them.
+			/// Default value: 0 (no limit).
+			size_t max_connections = 0;
+			/// Close connections of async_request() that have been idle for this number of seconds. Default value: 30.
+			size_t idle_timeout = 30;
+			/// Milliseconds to wait for a connection to one address of the host before also trying the next one,
+			/// see connect_race. Default value: 250.
+			size_t attempt_delay = 250;
+			/// Requests of async_batch() written at once, before reading their responses. Default value: 32.
+			size_t pipeline_depth = 32;
+			/// Most bytes of the body async_stream() reads at once. Default value: 65536.
+			size_t stream_buffer = 65536;
 		};
 
 		/// Set before calling request
@@ -81,27 +266,12 @@ namespace webpp {
 
 		std::shared_ptr<Response> request(const std::string& request_type, const std::string& path="/", const std::string content="",
 				const std::map<std::string, std::string>& header=std::map<std::string, std::string>()) {
-			auto corrected_path=path;
-			if(corrected_path=="")
-				corrected_path="/";
-			if (!config.proxy_server.empty() && std::is_same<socket_type, asio::ip::tcp::socket>::value)
-				corrected_path = "http://" + host + ':' + std::to_string(port) + corrected_path;
-
-			asio::streambuf write_buffer;
-			std::ostream write_stream(&write_buffer);
-			write_stream << request_type << " " << corrected_path << " HTTP/1.1\r\n";
-			write_stream << "Host: " << host << "\r\n";
-			for(auto& h: header) {
-				write_stream << h.first << ": " << h.second << "\r\n";
-			}
-			if(content.size()>0)
-				write_stream << "Content-Length: " << content.size() << "\r\n";
-			write_stream << "\r\n";
+			auto head = request_head(request_type, path, header, content.size());
 
 			connect();
 
 			auto timer = get_timeout_timer();
-			asio::async_write(*socket, write_buffer,
+			asio::async_write(*socket, asio::buffer(head),
 				[this, &content, timer](const std::error_code &ec, size_t /*bytes_transferred*/) {
 				if (timer)
 					timer->cancel();
@@ -133,26 +303,13 @@ namespace webpp {
 
 		std::shared_ptr<Response> request(const std::string& request_type, const std::string& path, std::iostream& content,
 				const std::map<std::string, std::string>& header=std::map<std::string, std::string>()) {
-			auto corrected_path=path;
-			if(corrected_path=="")
-				corrected_path="/";
-			if (!config.proxy_server.empty() && std::is_same<socket_type, asio::ip::tcp::socket>::value)
-				corrected_path = "http://" + host + ':' + std::to_string(port) + corrected_path;
-
 			content.seekp(0, std::ios::end);
 			auto content_length=content.tellp();
 			content.seekp(0, std::ios::beg);
 
 			asio::streambuf write_buffer;
 			std::ostream write_stream(&write_buffer);
-			write_stream << request_type << " " << corrected_path << " HTTP/1.1\r\n";
-			write_stream << "Host: " << host << "\r\n";
-			for(auto& h: header) {
-				write_stream << h.first << ": " << h.second << "\r\n";
-			}
-			if(content_length>0)
-				write_stream << "Content-Length: " << content_length << "\r\n";
-			write_stream << "\r\n";
+			write_stream << request_head(request_type, path, header, static_cast<size_t>(content_length));
 			if(content_length>0)
 				write_stream << content.rdbuf();
 
@@ -174,6 +331,132 @@ namespace webpp {
 
 			return request_read();
 		}
+		/// Called with the response, or with the error that ended the request and a null response
+		using response_handler = std::function<void(const std::error_code&, std::shared_ptr<Response>)>;
+		/// Called with the responses of async_batch() in the order of the requests, on an error with those received before it
+		using batch_handler = std::function<void(const std::error_code&, std::vector<std::shared_ptr<Response>>)>;
+
+		/// Receives the body of async_stream() as it arrives, without transfer coding. data stays valid until next is
+		/// called: with no error to read on, or with an error to end the request with it. Until then no more of the
+		/// body is read, which also holds the server back.
+		using body_sink = std::function<void(const std::shared_ptr<Response> &response, const string_ref &data,
+				const std::function<void(const std::error_code&)> &next)>;
+
+		/// A request of async_batch()
+		class Request {
+		public:
+			Request(std::string method, std::string path="/", std::string content="",
+					std::map<std::string, std::string> header=std::map<std::string, std::string>()) :
+				method(std::move(method)), path(std::move(path)), content(std::move(content)), header(std::move(header)) {}
+
+			std::string method;
+			std::string path;
+			std::string content;
+			std::map<std::string, std::string> header;
+		};
+
+		/// Sets the io_context that async_request() runs on. The caller runs it, on any number of threads.
+		void set_io_context(std::shared_ptr<asio::io_context> io_context) {
+			m_io_context = std::move(io_context);
+			m_pool = std::make_shared<connection_pool<socket_type>>(*m_io_context);
+		}
+
+		/// Resolves host names with the given cache instead of dns_cache::shared()
+		void set_dns_cache(std::shared_ptr<dns_cache> cache) {
+			m_dns = std::move(cache);
+		}
+
+		/// Shares the keep-alive connections of async_request() with other clients on the same io_context,
+		/// replacing the pool of the client's own that set_io_context() created.
+		void set_connection_pool(std::shared_ptr<connection_pool<socket_type>> pool) {
+			m_pool = std::move(pool);
+		}
+
+		/// Sends a request without blocking, on the io_context given to set_io_context(), and calls handler from
+		/// that io_context when the response has been received. Any number of requests may be in flight at once,
+		/// each on a connection of its own, which is kept for later requests (see connection_pool and
+		/// Config::max_connections). Config::timeout limits the whole request, Config::timeout_connect
+		/// connecting, including the wait for a connection. The client must outlive its requests.
+		void async_request(const std::string& request_type, const std::string& path, std::string content,
+				const std::map<std::string, std::string>& header, response_handler handler) {
+			if (!m_io_context) {
+				handler(std::make_error_code(std::errc::invalid_argument), nullptr);
+				return;
+			}
+			auto op = std::make_shared<exchange>(*this, *m_io_context, [handler](const std::error_code &ec, std::vector<std::shared_ptr<Response>> responses) {
+				handler(ec, ec ? nullptr : std::move(responses.front()));
+			});
+			op->add(request_type, path, content, header);
+			op->start();
+		}
+
+		/// As async_request(), but passes the body to sink piece by piece, each of at most Config::stream_buffer
+		/// bytes, instead of collecting it in the response, so that a body of any size takes bounded memory. handler
+		/// is called after the last piece, with the response head and an empty content. Config::timeout limits each
+		/// wait for the server instead of the whole request, the time the sink takes does not count.
+		void async_stream(const std::string& request_type, const std::string& path, std::string content,
+				const std::map<std::string, std::string>& header, body_sink sink, response_handler handler) {
+			if (!m_io_context) {
+				handler(std::make_error_code(std::errc::invalid_argument), nullptr);
+				return;
+			}
+			auto op = std::make_shared<exchange>(*this, *m_io_context, [handler](const std::error_code &ec, std::vector<std::shared_ptr<Response>> responses) {
+				handler(ec, ec ? nullptr : std::move(responses.front()));
+			});
+			op->add(request_type, path, content, header);
+			op->sink = std::move(sink);
+			op->start();
+		}
+
+		/// As async_request() with a handler, returning a future that holds the response or a std::system_error
+		std::future<std::shared_ptr<Response>> async_request(const std::string& request_type, const std::string& path="/",
+				std::string content="", const std::map<std::string, std::string>& header=std::map<std::string, std::string>()) {
+			auto promise = std::make_shared<std::promise<std::shared_ptr<Response>>>();
+			auto future = promise->get_future();
+			async_request(request_type, path, std::move(content), header, [promise](const std::error_code &ec, std::shared_ptr<Response> response) {
+				if (ec)
+					promise->set_exception(std::make_exception_ptr(std::system_error(ec)));
+				else
+					promise->set_value(std::move(response));
+			});
+			return future;
+		}
+
+		/// Sends requests to the host on one connection like async_request(), writing up to Config::pipeline_depth
+		/// of them at once before reading their responses (HTTP/1.1 pipelining), which saves a round trip per
+		/// request. If the server closes the connection before all responses are in, the remaining requests are
+		/// sent again one at a time on a new connection, unless one of them that may have been processed already
+		/// is not idempotent (such as POST), which then fails the batch. Config::timeout limits each connection's
+		/// part of the batch.
+		void async_batch(const std::vector<Request> &requests, batch_handler handler) {
+			if (!m_io_context) {
+				handler(std::make_error_code(std::errc::invalid_argument), std::vector<std::shared_ptr<Response>>());
+				return;
+			}
+			if (requests.empty()) {
+				handler(std::error_code(), std::vector<std::shared_ptr<Response>>());
+				return;
+			}
+			auto op = std::make_shared<exchange>(*this, *m_io_context, std::move(handler));
+			for (auto &request : requests)
+				op->add(request.method, request.path, request.content, request.header);
+			op->depth = std::max<size_t>(config.pipeline_depth, 1);
+			op->start();
+		}
+
+		/// As async_batch() with a handler, returning a future that holds the responses or a std::system_error
+		std::future<std::vector<std::shared_ptr<Response>>> async_batch(const std::vector<Request> &requests) {
+			auto promise = std::make_shared<std::promise<std::vector<std::shared_ptr<Response>>>>();
+			auto future = promise->get_future();
+			async_batch(requests, [promise](const std::error_code &ec, std::vector<std::shared_ptr<Response>> responses) {
+				if (ec)
+					promise->set_exception(std::make_exception_ptr(std::system_error(ec)));
+				else
+					promise->set_value(std::move(responses));
+			});
+			return future;
+		}
+
 		void close() {
 			std::lock_guard<std::mutex> lock(socket_mutex);
 			if (socket) {
@@ -184,7 +467,10 @@ namespace webpp {
 		}
 	protected:
 		asio::io_context io_context;
-		asio::ip::tcp::resolver resolver;
+		std::shared_ptr<dns_cache> m_dns = dns_cache::shared();
+		/// io_context and keep-alive connections of async_request()
+		std::shared_ptr<asio::io_context> m_io_context;
+		std::shared_ptr<connection_pool<socket_type>> m_pool;
 
 		std::unique_ptr<socket_type> socket;
 		std::mutex socket_mutex;
@@ -192,7 +478,7 @@ namespace webpp {
 		std::string host;
 		unsigned short port;
 
-		ClientBase(const std::string& host_port, unsigned short default_port) : resolver(io_context) {
+		ClientBase(const std::string& host_port, unsigned short default_port) {
 			auto parsed_host_port = parse_host_port(host_port, default_port);
 			host = parsed_host_port.first;
 			port = parsed_host_port.second;
@@ -215,6 +501,533 @@ namespace webpp {
 
 		virtual void connect()=0;
 
+		/// Host or proxy to connect to
+		std::pair<std::string, unsigned short> connect_target() const {
+			if (config.proxy_server.empty())
+				return std::make_pair(host, port);
+			return parse_host_port(config.proxy_server, 8080);
+		}
+
+		/// Sets up the TCP connection of socket for connect(), run io_context to complete it. Throws on failure.
+		void connect_socket() {
+			auto target = connect_target();
+			m_dns->async_resolve(io_context, target.first, target.second, [this](const std::error_code &ec,
+					std::shared_ptr<const dns_cache::endpoints> endpoints) {
+				if (ec) {
+					std::lock_guard<std::mutex> lock(socket_mutex);
+					socket = nullptr;
+					throw std::system_error(ec);
+				}
+				{
+					std::lock_guard<std::mutex> lock(socket_mutex);
+					socket = make_socket(io_context);
+				}
+				auto timer = std::make_shared<asio::system_timer>(io_context);
+				auto race = connect_race::start(io_context, endpoints, std::chrono::milliseconds(config.attempt_delay),
+						[this, timer](const std::error_code &ec, std::shared_ptr<asio::ip::tcp::socket> winner) {
+					timer->cancel();
+					if (ec) {
+						std::lock_guard<std::mutex> lock(socket_mutex);
+						socket = nullptr;
+						throw std::system_error(ec);
+					}
+					socket->lowest_layer() = std::move(*winner);
+					asio::ip::tcp::no_delay option(true);
+					socket->lowest_layer().set_option(option);
+				});
+				auto timeout = config.timeout_connect ? config.timeout_connect : config.timeout;
+				if (timeout != 0) {
+					timer->expires_from_now(std::chrono::seconds(timeout));
+					timer->async_wait([race](const std::error_code &ec) {
+						if (!ec)
+							race->cancel();
+					});
+				}
+			});
+		}
+
+		/// Creates the socket of an asynchronous request
+		virtual std::unique_ptr<socket_type> make_socket(asio::io_context &io_context)=0;
+
+		/// Completes the connection of an asynchronous request once its TCP connection is up. Handlers of
+		/// intermediate operations run on strand.
+		virtual void async_handshake(socket_type &/*socket*/, asio::io_context::strand &/*strand*/, const std::function<void(const std::error_code&)> &handler) {
+			handler(std::error_code());
+		}
+
+		/// Returns the request line, Host and the given header fields, and Content-Length for a body of content_length bytes
+		std::string request_head(const std::string& request_type, const std::string& path, const std::map<std::string, std::string>& header,
+				size_t content_length) const {
+			auto corrected_path=path;
+			if(corrected_path=="")
+				corrected_path="/";
+			if (!config.proxy_server.empty() && std::is_same<socket_type, asio::ip::tcp::socket>::value)
+				corrected_path = "http://" + host + ':' + std::to_string(port) + corrected_path;
+
+			std::string head = request_type + " " + corrected_path + " HTTP/1.1\r\nHost: " + host + "\r\n";
+			for(auto& h: header)
+				head += h.first + ": " + h.second + "\r\n";
+			if(content_length>0)
+				head += "Content-Length: " + std::to_string(content_length) + "\r\n";
+			head += "\r\n";
+			return head;
+		}
+
+		/// Identifies the connections of the client in its connection_pool
+		std::string pool_key() const {
+			auto key = std::string(std::is_same<socket_type, asio::ip::tcp::socket>::value ? "http://" : "https://") + host + ':' + std::to_string(port);
+			if (!config.proxy_server.empty())
+				key += " via " + config.proxy_server;
+			return key;
+		}
+
+		/// The requests of async_request() or async_batch(), from resolving the host to the end of the last response.
+		/// Its handlers run on a strand, so that the timeout can close the connection while an operation is in progress.
+		class exchange : public std::enable_shared_from_this<exchange> {
+		public:
+			exchange(ClientBase &client, asio::io_context &io_context, batch_handler handler) : client(client), strand(io_context),
+				timer(io_context), handler(std::move(handler)), pool(client.m_pool), dns(client.m_dns), key(client.pool_key()) {}
+
+			/// Requests written at once
+			size_t depth = 1;
+			/// Receives the body instead of the response, see async_stream()
+			body_sink sink;
+
+			void add(const std::string &method, const std::string &path, const std::string &content, const std::map<std::string, std::string> &header) {
+				queued request;
+				request.data = client.request_head(method, path, header, content.size());
+				request.data += content;
+				request.head_only = method == "HEAD";
+				//A request that fails on a connection closed by the server meanwhile can safely be sent again
+				request.idempotent = method == "GET" || method == "HEAD" || method == "PUT" || method == "DELETE" || method == "OPTIONS";
+				requests.push_back(std::move(request));
+			}
+
+			void start() {
+				auto self = this->shared_from_this();
+				strand.dispatch([self]() {
+					self->arm(self->client.config.timeout_connect ? self->client.config.timeout_connect : self->client.config.timeout);
+					self->pool->acquire(self->key, self->client.config.max_connections, std::chrono::seconds(self->client.config.idle_timeout),
+							[self](std::unique_ptr<socket_type> socket) {
+						//May be called from within acquire() or release(), continue on the strand
+						auto shared = std::make_shared<std::unique_ptr<socket_type>>(std::move(socket));
+						self->strand.dispatch([self, shared]() {
+							self->acquired(std::move(*shared));
+						});
+					});
+				});
+			}
+		private:
+			void acquired(std::unique_ptr<socket_type> pooled) {
+				if (finished) {
+					//Timed out while waiting for the connection
+					pool->release(key, std::move(pooled), true);
+					return;
+				}
+				holds_connection = true;
+				if (!pooled) {
+					resolve();
+					return;
+				}
+				socket = std::move(pooled);
+				reused = true;
+				connection_first = responses.size();
+				arm(client.config.timeout);
+				write();
+			}
+
+			/// Sends the requests without a response again on a new connection when the server closed the connection
+			/// before answering: a reused connection may have been closed while idle, and a server may close a
+			/// pipelined connection after any response.
+			bool retry(const std::error_code &ec) {
+				if (timed_out || (response && response->content_buffer.size() > 0))
+					return false;
+				if (ec != asio::error::eof && ec != asio::error::connection_reset && ec != asio::error::broken_pipe)
+					return false;
+				//A new connection that the server closed without answering would fail again
+				if (!reused && responses.size() == connection_first)
+					return false;
+				for (auto c = responses.size(); c < sent; c++) {
+					if (!requests[c].idempotent)
+						return false;
+				}
+				reconnect();
+				return true;
+			}
+
+			/// Continues on a new connection, one request at a time
+			void reconnect() {
+				depth = 1;
+				reused = false;
+				std::error_code ignored;
+				socket->lowest_layer().close(ignored);
+				socket.reset();
+				carry.consume(carry.size());
+				arm(client.config.timeout_connect ? client.config.timeout_connect : client.config.timeout);
+				resolve();
+			}
+
+			/// Closes the connection after the given number of seconds, 0 for none
+			void arm(size_t seconds) {
+				if (seconds == 0) {
+					timer.cancel();
+					return;
+				}
+				auto self = this->shared_from_this();
+				timer.expires_after(std::chrono::seconds(seconds));
+				timer.async_wait(strand.wrap([self](const std::error_code &ec) {
+					if (ec || self->finished)
+						return;
+					self->timed_out = true;
+					if (self->race)
+						self->race->cancel();
+					else if (self->socket) {
+						std::error_code ignored;
+						self->socket->lowest_layer().close(ignored);
+					}
+					else {
+						//Waiting for a connection from the pool or for the host's addresses
+						self->finish(std::error_code());
+					}
+				}));
+			}
+
+			void resolve() {
+				auto self = this->shared_from_this();
+				auto target = client.connect_target();
+				dns->async_resolve(strand.get_io_context(), target.first, target.second, strand.wrap([self](const std::error_code &ec,
+						std::shared_ptr<const dns_cache::endpoints> endpoints) {
+					if (self->finished)
+						return;
+					if (ec) {
+						self->finish(ec);
+						return;
+					}
+					self->connect(endpoints);
+				}));
+			}
+
+			void connect(const std::shared_ptr<const dns_cache::endpoints> &endpoints) {
+				auto self = this->shared_from_this();
+				socket = client.make_socket(strand.get_io_context());
+				race = connect_race::start(strand.get_io_context(), endpoints, std::chrono::milliseconds(client.config.attempt_delay),
+						strand.wrap([self](const std::error_code &ec, std::shared_ptr<asio::ip::tcp::socket> winner) {
+					self->race = nullptr;
+					if (ec || self->finished) {
+						self->finish(ec);
+						return;
+					}
+					self->socket->lowest_layer() = std::move(*winner);
+					self->connection_first = self->responses.size();
+					std::error_code ignored;
+					self->socket->lowest_layer().set_option(asio::ip::tcp::no_delay(true), ignored);
+					self->client.async_handshake(*self->socket, self->strand, self->strand.wrap([self](const std::error_code &ec) {
+						if (ec) {
+							self->finish(ec);
+							return;
+						}
+						self->arm(self->client.config.timeout);
+						self->write();
+					}));
+				}));
+			}
+
+			/// Writes the next depth requests in one gather write
+			void write() {
+				auto self = this->shared_from_this();
+				sent = std::min(requests.size(), responses.size() + depth);
+				buffers.clear();
+				for (auto c = responses.size(); c < sent; c++)
+					buffers.push_back(asio::buffer(requests[c].data));
+				asio::async_write(*socket, buffers, strand.wrap([self](const std::error_code &ec, size_t /*bytes_transferred*/) {
+					if (ec) {
+						if (!self->retry(ec))
+							self->finish(ec);
+						return;
+					}
+					self->read_head();
+				}));
+			}
+
+			void read_head() {
+				auto self = this->shared_from_this();
+				response.reset(new Response());
+				decoder.reset();
+				if (carry.size() > 0) {
+					//Received with the previous response
+					auto &content = response->content_buffer;
+					content.commit(asio::buffer_copy(content.prepare(carry.size()), carry.data()));
+					carry.consume(carry.size());
+				}
+				asio::async_read_until(*socket, response->content_buffer, head_end_condition(), strand.wrap([self](const std::error_code &ec, size_t /*bytes_transferred*/) {
+					if (ec) {
+						if (!self->retry(ec))
+							self->finish(ec);
+						return;
+					}
+					self->client.parse_response_header(self->response);
+					self->read_body();
+				}));
+			}
+
+			void read_body() {
+				auto &header = response->header;
+				auto &status = response->status_code;
+				auto connection = header.find("Connection");
+				if (response->http_version >= "1.1")
+					keep_alive = connection == header.end() || !iequals(connection->second, "close");
+				else
+					keep_alive = connection != header.end() && iequals(connection->second, "keep-alive");
+				if (!status.empty() && status[0] == '1' && status.compare(0, 3, "101") != 0) {
+					//An interim response such as 100 Continue or 103 Early Hints, the final one follows
+					auto &content = response->content_buffer;
+					carry.commit(asio::buffer_copy(carry.prepare(content.size()), content.data()));
+					content.consume(content.size());
+					read_head();
+					return;
+				}
+				if (requests[responses.size()].head_only || status.compare(0, 3, "204") == 0 || status.compare(0, 3, "304") == 0 ||
+						status.compare(0, 3, "101") == 0) {
+					auto &content = response->content_buffer;
+					carry.commit(asio::buffer_copy(carry.prepare(content.size()), content.data()));
+					content.consume(content.size());
+					response_done();
+					return;
+				}
+				auto field = header.find("Transfer-Encoding");
+				if (field != header.end() && field->second.size() >= 7 &&
+						iequals(string_ref(field->second.data() + field->second.size() - 7, 7), "chunked")) {
+					//What follows the head is still encoded, it is decoded into the content from the side buffer
+					auto &content = response->content_buffer;
+					raw.commit(asio::buffer_copy(raw.prepare(content.size()), content.data()));
+					content.consume(content.size());
+					read_chunked();
+					return;
+				}
+				field = header.find("Content-Length");
+				if (field != header.end()) {
+					unsigned long long length;
+					try {
+						length = std::stoull(field->second);
+					}
+					catch (const std::exception &) {
+						finish(std::make_error_code(std::errc::protocol_error));
+						return;
+					}
+					if (sink) {
+						stream(length);
+						return;
+					}
+					auto &content = response->content_buffer;
+					auto buffered = content.size();
+					if (length <= buffered) {
+						if (length < buffered) {
+							//The rest belongs to the next response
+							carry.commit(asio::buffer_copy(carry.prepare(buffered), content.data()));
+							content.consume(buffered);
+							content.commit(asio::buffer_copy(content.prepare(static_cast<size_t>(length)), carry.data()));
+							carry.consume(static_cast<size_t>(length));
+						}
+						response_done();
+						return;
+					}
+					auto self = this->shared_from_this();
+					asio::async_read(*socket, content, asio::transfer_exactly(static_cast<size_t>(length - buffered)),
+						strand.wrap([self](const std::error_code &ec, size_t /*bytes_transferred*/) {
+						if (ec)
+							self->finish(ec);
+						else
+							self->response_done();
+					}));
+					return;
+				}
+				//The body ends with the connection
+				keep_alive = false;
+				if (sink) {
+					stream(~0ull);
+					return;
+				}
+				auto self = this->shared_from_this();
+				asio::async_read(*socket, response->content_buffer, strand.wrap([self](const std::error_code &ec, size_t /*bytes_transferred*/) {
+					if (ec && ec != asio::error::eof)
+						self->finish(ec);
+					else
+						self->response_done();
+				}));
+			}
+
+			void read_chunked() {
+				while (raw.size() > 0) {
+					size_t consumed = 0;
+					string_ref data;
+					auto result = decoder.decode(asio::buffer_cast<const char*>(raw.data()), raw.size(), consumed, data);
+					if (result == chunked_decoder::result::data && sink) {
+						//The data is in raw, which is consumed once the sink took it
+						auto self = this->shared_from_this();
+						deliver(data, [self, consumed]() {
+							self->raw.consume(consumed);
+							self->read_chunked();
+						});
+						return;
+					}
+					if (result == chunked_decoder::result::data) {
+						auto &content = response->content_buffer;
+						content.commit(asio::buffer_copy(content.prepare(data.size()), asio::buffer(data.data(), data.size())));
+					}
+					raw.consume(consumed);
+					if (result == chunked_decoder::result::done) {
+						carry.commit(asio::buffer_copy(carry.prepare(raw.size()), raw.data()));
+						raw.consume(raw.size());
+						response_done();
+						return;
+					}
+					if (result == chunked_decoder::result::error) {
+						finish(std::make_error_code(std::errc::protocol_error));
+						return;
+					}
+					if (result == chunked_decoder::result::incomplete)
+						break;
+				}
+				auto self = this->shared_from_this();
+				socket->async_read_some(raw.prepare(sink ? client.config.stream_buffer : 65536), strand.wrap([self](const std::error_code &ec, size_t bytes_transferred) {
+					self->raw.commit(bytes_transferred);
+					if (ec) {
+						self->finish(ec);
+						return;
+					}
+					self->read_chunked();
+				}));
+			}
+
+			/// Passes the remaining bytes of a body that is not chunked to the sink, ~0 for one ending with the connection
+			void stream(unsigned long long remaining) {
+				auto &content = response->content_buffer;
+				if (content.size() > 0) {
+					//Received with the head
+					raw.commit(asio::buffer_copy(raw.prepare(content.size()), content.data()));
+					content.consume(content.size());
+				}
+				if (remaining == 0) {
+					carry.commit(asio::buffer_copy(carry.prepare(raw.size()), raw.data()));
+					raw.consume(raw.size());
+					response_done();
+					return;
+				}
+				auto self = this->shared_from_this();
+				if (raw.size() > 0) {
+					auto size = static_cast<size_t>(std::min<unsigned long long>(raw.size(), remaining));
+					deliver(string_ref(asio::buffer_cast<const char*>(raw.data()), size), [self, size, remaining]() {
+						self->raw.consume(size);
+						self->stream(remaining == ~0ull ? remaining : remaining - size);
+					});
+					return;
+				}
+				auto size = static_cast<size_t>(std::min<unsigned long long>(client.config.stream_buffer, remaining));
+				socket->async_read_some(raw.prepare(size), strand.wrap([self, remaining](const std::error_code &ec, size_t bytes_transferred) {
+					self->raw.commit(bytes_transferred);
+					if (ec == asio::error::eof && remaining == ~0ull)
+						self->response_done();
+					else if (ec)
+						self->finish(ec);
+					else
+						self->stream(remaining);
+				}));
+			}
+
+			/// Passes data to the sink and continues with then once it took it. The timeout does not run meanwhile.
+			void deliver(const string_ref &data, std::function<void()> then) {
+				timer.cancel();
+				auto self = this->shared_from_this();
+				sink(response, data, [self, then](const std::error_code &ec) {
+					self->strand.dispatch([self, then, ec]() {
+						if (self->finished)
+							return;
+						if (ec) {
+							self->finish(ec);
+							return;
+						}
+						self->arm(self->client.config.timeout);
+						then();
+					});
+				});
+			}
+
+			/// Moves on to the next response, or the next requests
+			void response_done() {
+				responses.push_back(std::move(response));
+				if (responses.size() == requests.size())
+					finish(std::error_code());
+				else if (!keep_alive || (responses.size() == sent && carry.size() > 0)) {
+					//The server is done with the connection, or sent what was not asked for
+					reconnect();
+				}
+				else if (responses.size() < sent)
+					read_head();
+				else
+					write();
+			}
+
+			/// Calls the handler, once
+			void finish(std::error_code ec) {
+				if (finished)
+					return;
+				finished = true;
+				timer.cancel();
+				if (timed_out)
+					ec = asio::error::timed_out;
+				if (holds_connection) {
+					//Bytes past the last response were not asked for
+					bool reusable = !ec && keep_alive && socket && carry.size() == 0;
+					if (socket && !reusable) {
+						std::error_code ignored;
+						socket->lowest_layer().shutdown(asio::ip::tcp::socket::shutdown_both, ignored);
+						socket->lowest_layer().close(ignored);
+					}
+					pool->release(key, std::move(socket), reusable);
+				}
+				response.reset();
+				handler(ec, std::move(responses));
+			}
+
+			ClientBase &client;
+			asio::io_context::strand strand;
+			asio::steady_timer timer;
+			batch_handler handler;
+			std::shared_ptr<connection_pool<socket_type>> pool;
+			std::shared_ptr<dns_cache> dns;
+			std::string key;
+			/// Set while connecting
+			std::shared_ptr<connect_race> race;
+			std::unique_ptr<socket_type> socket;
+			/// Set once the pool has granted a connection, which is then returned to it
+			bool holds_connection = false;
+			/// The connection came from the pool
+			bool reused = false;
+			bool keep_alive = false;
+			/// Request head and body
+			struct queued {
+				std::string data;
+				bool head_only;
+				bool idempotent;
+			};
+			std::vector<queued> requests;
+			std::vector<asio::const_buffer> buffers;
+			std::vector<std::shared_ptr<Response>> responses;
+			/// Requests written on the connection
+			size_t sent = 0;
+			/// First response read on the connection
+			size_t connection_first = 0;
+			/// Received response being read
+			std::shared_ptr<Response> response;
+			/// Received bytes of the responses that follow
+			asio::streambuf carry;
+			/// Received chunked body that has not been decoded yet
+			asio::streambuf raw;
+			chunked_decoder decoder;
+			bool timed_out = false;
+			bool finished = false;
+		};
+
 		std::shared_ptr<asio::system_timer> get_timeout_timer(size_t timeout=0) {
 			if(timeout==0)
 				timeout=config.timeout;
@@ -232,29 +1045,40 @@ namespace webpp {
 		}
 
 		void parse_response_header(const std::shared_ptr<Response> &response) const {
-			std::string line;
-			getline(response->content, line);
-			size_t version_end=line.find(' ');
-			if(version_end!=std::string::npos) {
-				if(5<line.size())
-					response->http_version=line.substr(5, version_end-5);
-				if((version_end+1)<line.size())
-					response->status_code=line.substr(version_end+1, line.size()-(version_end+1)-1);
-
-				getline(response->content, line);
-				size_t param_end;
-				while((param_end=line.find(':'))!=std::string::npos) {
-					size_t value_start=param_end+1;
-					if((value_start)<line.size()) {
-						if(line[value_start]==' ')
+			//Scan the lines directly on the receive buffer and consume the head when done
+			auto data=asio::buffer_cast<const char*>(response->content_buffer.data());
+			auto end=data+response->content_buffer.size();
+			auto line_end=[](const char *line, const char *eol) {
+				return (eol>line && eol[-1]=='\r') ? eol-1 : eol;
+			};
+
+			auto line=data;
+			auto eol=scan_for(line, end, '\n');
+			auto last=line_end(line, eol);
+			auto version_end=scan_for(line, last, ' ');
+			if(version_end!=last) {
+				if(5<last-line)
+					response->http_version.assign(line+5, version_end);
+				if(version_end+1<last)
+					response->status_code.assign(version_end+1, last);
+
+				while(eol!=end) {
+					line=eol+1;
+					eol=scan_for(line, end, '\n');
+					last=line_end(line, eol);
+					auto param_end=scan_for(line, last, ':');
+					if(param_end==last)
+						break;
+					auto value_start=param_end+1;
+					if(value_start<last) {
+						if(*value_start==' ')
 							value_start++;
-						if(value_start<line.size())
-							response->header.insert(std::make_pair(line.substr(0, param_end), line.substr(value_start, line.size()-value_start-1)));
+						if(value_start<last)
+							response->header.emplace(std::string(line, param_end), std::string(value_start, last));
 					}
-
-					getline(response->content, line);
 				}
 			}
+			response->content_buffer.consume(static_cast<size_t>((eol!=end ? eol+1 : end)-data));
 		}
 
 		std::shared_ptr<Response> request_read() {
@@ -263,7 +1087,7 @@ namespace webpp {
 			asio::streambuf chunked_streambuf;
 
 			auto timer = get_timeout_timer();
-			asio::async_read_until(*socket, response->content_buffer, "\r\n\r\n",
+			asio::async_read_until(*socket, response->content_buffer, head_end_condition(),
 				[this, &response, &chunked_streambuf,timer](const std::error_code& ec, size_t bytes_transferred) {
 				if (timer)
 					timer->cancel();
@@ -401,46 +1225,13 @@ namespace webpp {
 		explicit Client(const std::string& server_port_path) : ClientBase(server_port_path, 80) { }
 
 	protected:
+		std::unique_ptr<HTTP> make_socket(asio::io_context &io_context) override {
+			return std::make_unique<HTTP>(io_context);
+		}
+
 		void connect() override {
 			if(!socket || !socket->is_open()) {
-				std::unique_ptr<asio::ip::tcp::resolver::query> query;
-				if (config.proxy_server.empty())
-					query = std::make_unique<asio::ip::tcp::resolver::query>(host, std::to_string(port));
-				else {
-					auto proxy_host_port = parse_host_port(config.proxy_server, 8080);
-					query = std::make_unique<asio::ip::tcp::resolver::query>(proxy_host_port.first, std::to_string(proxy_host_port.second));
-
-				}
-				resolver.async_resolve(*query, [this](const std::error_code &ec,
-													  asio::ip::tcp::resolver::iterator it){
-					if(!ec) {
-						{
-							std::lock_guard<std::mutex> lock(socket_mutex);
-							socket = std::make_unique<HTTP>(io_context);
-						}
-
-						auto timer = get_timeout_timer(config.timeout_connect);
-						asio::async_connect(*socket, it, [this,timer]
-								(const std::error_code &ec, asio::ip::tcp::resolver::iterator /*it*/){
-							if (timer)
-								timer->cancel();
-							if(!ec) {
-								asio::ip::tcp::no_delay option(true);
-								socket->set_option(option);
-							}
-							else {
-								std::lock_guard<std::mutex> lock(socket_mutex);
-								socket=nullptr;
-								throw std::system_error(ec);
-							}
-						});
-					}
-					else {
-						std::lock_guard<std::mutex> lock(socket_mutex);
-						socket=nullptr;
-						throw std::system_error(ec);
-					}
-				});
+				connect_socket();
 				io_context.reset();
 				io_context.run();
 			}
@@ -38,46 +38,46 @@ namespace webpp {
 	protected:
 		asio::ssl::context m_context;
 
-		void connect() override {
-			if(!socket || !socket->lowest_layer().is_open()) {
-				std::unique_ptr<asio::ip::tcp::resolver::query> query;
-				if (config.proxy_server.empty()) {
-					query = std::make_unique<asio::ip::tcp::resolver::query>(host, std::to_string(port));
-				}
-				else {
-					auto proxy_host_port = parse_host_port(config.proxy_server, 8080);
-					query = std::make_unique<asio::ip::tcp::resolver::query>(proxy_host_port.first, std::to_string(proxy_host_port.second));
-				}
-				resolver.async_resolve(*query, [this]
-							(const std::error_code &ec, asio::ip::tcp::resolver::iterator it) {
-					if (!ec) {
-						{
-							std::lock_guard<std::mutex> lock(socket_mutex);
-							socket = std::make_unique<HTTPS>(io_context, m_context);
-						}
+		std::unique_ptr<HTTPS> make_socket(asio::io_context &io_context) override {
+			return std::make_unique<HTTPS>(io_context, m_context);
+		}
 
-						auto timer = get_timeout_timer(config.timeout_connect);
-						asio::async_connect(socket->lowest_layer(), it, [this, timer]
-								(const std::error_code &ec, asio::ip::tcp::resolver::iterator /*it*/) {
-							if (timer)
-								timer->cancel();
-							if (!ec) {
-								asio::ip::tcp::no_delay option(true);
-								socket->lowest_layer().set_option(option);
-							}
-							else {
-								std::lock_guard<std::mutex> lock(socket_mutex);
-								socket = nullptr;
-								throw std::system_error(ec);
-							}
-						});
+		/// Tunnels through the proxy if one is set, then performs the TLS handshake
+		void async_handshake(HTTPS &socket, asio::io_context::strand &strand, const std::function<void(const std::error_code&)> &handler) override {
+			auto handshake = [&socket, handler]() {
+				socket.async_handshake(asio::ssl::stream_base::client, handler);
+			};
+			if (config.proxy_server.empty()) {
+				handshake();
+				return;
+			}
+			auto host_port = host + ':' + std::to_string(port);
+			auto tunnel = std::make_shared<std::pair<std::string, asio::streambuf>>();
+			tunnel->first = "CONNECT " + host_port + " HTTP/1.1\r\nHost: " + host_port + "\r\n\r\n";
+			asio::async_write(socket.next_layer(), asio::buffer(tunnel->first), strand.wrap([&socket, &strand, tunnel, handler, handshake](const std::error_code &ec, size_t /*bytes_transferred*/) {
+				if (ec) {
+					handler(ec);
+					return;
+				}
+				asio::async_read_until(socket.next_layer(), tunnel->second, head_end_condition(), strand.wrap([tunnel, handler, handshake](const std::error_code &ec, size_t /*bytes_transferred*/) {
+					if (ec) {
+						handler(ec);
+						return;
 					}
-					else {
-						std::lock_guard<std::mutex> lock(socket_mutex);
-						socket = nullptr;
-						throw std::system_error(ec);
+					//"HTTP/1.1 200 ..."
+					auto status = asio::buffer_cast<const char*>(tunnel->second.data());
+					if (tunnel->second.size() < 12 || std::string(status + 9, 3) != "200") {
+						handler(std::make_error_code(std::errc::permission_denied));
+						return;
 					}
-				});
+					handshake();
+				}));
+			}));
+		}
+
+		void connect() override {
+			if(!socket || !socket->lowest_layer().is_open()) {
+				connect_socket();
 				io_context.reset();
 				io_context.run();
 
@@ -102,7 +102,7 @@ namespace webpp {
 
 					std::shared_ptr<Response> response(new Response());
 					timer=get_timeout_timer();
-					asio::async_read_until(socket->next_layer(), response->content_buffer, "\r\n\r\n",
+					asio::async_read_until(socket->next_layer(), response->content_buffer, head_end_condition(),
 												[this, timer](const std::error_code& ec, size_t /*bytes_transferred*/) {
 						if(timer)
 							timer->cancel();
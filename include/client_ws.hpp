@@ -4,6 +4,7 @@
 #define CLIENT_WS_HPP
 
 #include "asio.h"
+#include "dns_cache.hpp"
 
 #include <unordered_map>
 #include <iostream>
@@ -148,9 +149,6 @@ namespace webpp {
 			if(io_context->stopped())
 				io_context->reset();
 
-			if(!resolver)
-				resolver= std::make_unique<asio::ip::tcp::resolver>(*io_context);
-
 			connect();
 
 			if(internal_io_context)
@@ -158,7 +156,8 @@ namespace webpp {
 		}
 
 		void stop() const {
-			resolver->cancel();
+			if(race)
+				race->cancel();
 			if(internal_io_context)
 				io_context->stop();
            
@@ -244,7 +243,10 @@ namespace webpp {
 		const std::string ws_magic_string="258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 
 		bool internal_io_context=false;
-		std::unique_ptr<asio::ip::tcp::resolver> resolver;
+		/// Host names are resolved with dns_cache::shared() unless set to another cache before start()
+		std::shared_ptr<dns_cache> dns=dns_cache::shared();
+		/// Set while connecting
+		std::shared_ptr<connect_race> race;
 
 		std::string host;
 		unsigned short port;
@@ -489,16 +491,16 @@ namespace webpp {
 
 	protected:
 		void connect() override {
-			asio::ip::tcp::resolver::query query(host, std::to_string(port));
-
-			resolver->async_resolve(query, [this]
-					(const std::error_code &ec, asio::ip::tcp::resolver::iterator it){
+			dns->async_resolve(*io_context, host, port, [this]
+					(const std::error_code &ec, std::shared_ptr<const dns_cache::endpoints> endpoints){
 				if(!ec) {
 					connection=std::shared_ptr<Connection>(new Connection(new WS(*io_context)));
 
-					asio::async_connect(*connection->socket, it, [this]
-							(const std::error_code &ec, asio::ip::tcp::resolver::iterator /*it*/){
+					race=connect_race::start(*io_context, endpoints, connect_race::default_attempt_delay(), [this]
+							(const std::error_code &ec, std::shared_ptr<asio::ip::tcp::socket> winner){
+						race=nullptr;
 						if(!ec) {
+							*connection->socket=std::move(*winner);
 							asio::ip::tcp::no_delay option(true);
 							connection->socket->set_option(option);
 
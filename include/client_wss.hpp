@@ -40,16 +40,16 @@ namespace webpp {
 		asio::ssl::context context;
 
 		void connect() override {
-			asio::ip::tcp::resolver::query query(host, std::to_string(port));
-
-			resolver->async_resolve(query, [this]
-					(const std::error_code &ec, asio::ip::tcp::resolver::iterator it){
+			dns->async_resolve(*io_context, host, port, [this]
+					(const std::error_code &ec, std::shared_ptr<const dns_cache::endpoints> endpoints){
 				if(!ec) {
 					connection=std::shared_ptr<Connection>(new Connection(new WSS(*io_context, context)));
 
-					asio::async_connect(connection->socket->lowest_layer(), it, [this]
-							(const std::error_code &ec, asio::ip::tcp::resolver::iterator /*it*/){
+					race=connect_race::start(*io_context, endpoints, connect_race::default_attempt_delay(), [this]
+							(const std::error_code &ec, std::shared_ptr<asio::ip::tcp::socket> winner){
+						race=nullptr;
 						if(!ec) {
+							connection->socket->lowest_layer()=std::move(*winner);
 							asio::ip::tcp::no_delay option(true);
 							connection->socket->lowest_layer().set_option(option);
 
@@ -0,0 +1,171 @@
+// license:MIT
+// copyright-holders:Miodrag Milanovic
+#ifndef COMPRESSION_HPP
+#define COMPRESSION_HPP
+
+#include "http_parser.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(WEBPP_ZLIB)
+#include <zlib.h>
+#endif
+
+namespace webpp {
+	/// Content codings the server applies to response bodies
+	enum class content_coding { identity, gzip, deflate };
+
+	/// Returns the coding for a response to a request with the given Accept-Encoding value, preferring gzip
+	inline content_coding choose_coding(const string_ref &accept_encoding) {
+		if (accepts_coding(accept_encoding, "gzip"))
+			return content_coding::gzip;
+		if (accepts_coding(accept_encoding, "deflate"))
+			return content_coding::deflate;
+		return content_coding::identity;
+	}
+
+	/// Returns the header line announcing coding
+	inline string_ref content_encoding_line(content_coding coding) {
+		switch (coding) {
+		case content_coding::gzip:
+			return string_ref("Content-Encoding: gzip\r\n");
+		case content_coding::deflate:
+			return string_ref("Content-Encoding: deflate\r\n");
+		default:
+			return string_ref();
+		}
+	}
+
+	inline string_ref vary_accept_encoding_line() {
+		return string_ref("Vary: Accept-Encoding\r\n", 23);
+	}
+
+	/// Returns true for media types that are text and thus worth compressing; images, audio, video and archives
+	/// are compressed already.
+	inline bool compressible_type(const string_ref &type) {
+		auto end = type.begin();
+		while (end != type.end() && *end != ';' && *end != ' ')
+			++end;
+		string_ref media(type.data(), static_cast<size_t>(end - type.begin()));
+		auto ends_with = [&media](const char *suffix) {
+			string_ref tail(suffix);
+			return media.size() >= tail.size() && iequals(string_ref(media.data() + media.size() - tail.size(), tail.size()), tail);
+		};
+		if (media.size() >= 5 && iequals(string_ref(media.data(), 5), "text/"))
+			return true;
+		return iequals(media, "application/javascript") || iequals(media, "application/wasm") ||
+			ends_with("/json") || ends_with("+json") || ends_with("/xml") || ends_with("+xml");
+	}
+
+#if defined(WEBPP_ZLIB)
+	/// Incremental compressor producing a gzip or a zlib ("deflate") stream
+	class deflater {
+	public:
+		enum class flush { none, sync, finish };
+		static constexpr bool available = true;
+
+		deflater(content_coding coding, int level) { init(coding, level); }
+		deflater(const deflater&) = delete;
+		deflater &operator=(const deflater&) = delete;
+		~deflater() { deflateEnd(&m_stream); }
+
+		/// Starts a new stream, reusing the memory of the previous one where possible
+		void reset(content_coding coding, int level) {
+			if (coding == m_coding && level == m_level) {
+				deflateReset(&m_stream);
+				return;
+			}
+			deflateEnd(&m_stream);
+			init(coding, level);
+		}
+
+		/// Compresses size bytes of data, appending the output to out. flush::sync makes all input so far decodable
+		/// by the client, flush::finish ends the stream.
+		void compress(const char *data, size_t size, std::string &out, flush mode) {
+			int zlib_flush = mode == flush::finish ? Z_FINISH : mode == flush::sync ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+			do {
+				//avail_in is 32 bits wide
+				auto piece = static_cast<uInt>(std::min<size_t>(size, UINT_MAX));
+				m_stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+				m_stream.avail_in = piece;
+				data += piece;
+				size -= piece;
+				int flush_piece = size > 0 ? Z_NO_FLUSH : zlib_flush;
+				int result;
+				do {
+					auto used = out.size();
+					auto space = std::max<size_t>(m_stream.avail_in / 4, 16384);
+					out.resize(used + space);
+					m_stream.next_out = reinterpret_cast<Bytef*>(&out[used]);
+					m_stream.avail_out = static_cast<uInt>(space);
+					result = deflate(&m_stream, flush_piece);
+					out.resize(used + space - m_stream.avail_out);
+				} while (m_stream.avail_out == 0 || (flush_piece == Z_FINISH && result == Z_OK));
+			} while (size > 0);
+		}
+	private:
+		void init(content_coding coding, int level) {
+			m_coding = coding;
+			m_level = level;
+			m_stream = z_stream();
+			//Adding 16 to the window bits selects the gzip wrapper
+			deflateInit2(&m_stream, level, Z_DEFLATED, coding == content_coding::gzip ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY);
+		}
+
+		z_stream m_stream;
+		content_coding m_coding;
+		int m_level;
+	};
+#else
+	/// Stands in for the zlib based compressor when built without zlib, compression is then never applied
+	class deflater {
+	public:
+		enum class flush { none, sync, finish };
+		static constexpr bool available = false;
+
+		deflater(content_coding, int) {}
+		void reset(content_coding, int) {}
+		void compress(const char*, size_t, std::string&, flush) {}
+	};
+#endif
+
+	/// Deflaters kept for reuse by all threads, since setting one up allocates a few hundred kilobytes.
+	/// Only deflaters that are in use, plus at most max_idle, take up memory.
+	class deflater_cache {
+	public:
+		explicit deflater_cache(size_t max_idle = 16) : m_max_idle(max_idle) {}
+
+		std::unique_ptr<deflater> acquire(content_coding coding, int level) {
+			std::unique_ptr<deflater> result;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (!m_idle.empty()) {
+					result = std::move(m_idle.back());
+					m_idle.pop_back();
+				}
+			}
+			if (result)
+				result->reset(coding, level);
+			else
+				result.reset(new deflater(coding, level));
+			return result;
+		}
+
+		void release(std::unique_ptr<deflater> idle) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_idle.size() < m_max_idle)
+				m_idle.push_back(std::move(idle));
+		}
+	private:
+		std::mutex m_mutex;
+		std::vector<std::unique_ptr<deflater>> m_idle;
+		size_t m_max_idle;
+	};
+}
+
+#endif  /* COMPRESSION_HPP */
@@ -0,0 +1,297 @@
+// license:MIT
+// copyright-holders:Miodrag Milanovic
+#ifndef DNS_CACHE_HPP
+#define DNS_CACHE_HPP
+
+#include "asio.h"
+#include "asio/steady_timer.hpp"
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace webpp {
+	/// Addresses of host names resolved by the clients, shared by all of them (see shared()).
+	///
+	/// A resolved name is kept for Config::ttl seconds and a failure for Config::negative_ttl seconds, so that a
+	/// name that does not resolve is not looked up again on every connect. A lookup within Config::refresh_ahead
+	/// seconds of expiry returns the cached addresses at once and renews them in the background. Lookups of a name
+	/// that is being resolved wait for that resolution instead of starting their own.
+	class dns_cache : public std::enable_shared_from_this<dns_cache> {
+	public:
+		using clock = std::chrono::steady_clock;
+		using endpoints = std::vector<asio::ip::tcp::endpoint>;
+		using resolve_handler = std::function<void(const std::error_code&, std::shared_ptr<const endpoints>)>;
+
+		class Config {
+		public:
+			/// Seconds resolved addresses are used for. Default value: 60.
+			size_t ttl = 60;
+			/// Seconds a failure to resolve is remembered for. Default value: 5.
+			size_t negative_ttl = 5;
+			/// Seconds before expiry in which a lookup renews the addresses in the background. Default value: 10.
+			size_t refresh_ahead = 10;
+			/// Names kept before expired ones are dropped. Default value: 1024.
+			size_t max_entries = 1024;
+		};
+		/// Set before the first lookup
+		Config config;
+
+		/// Returns the cache the clients use unless given another one
+		static const std::shared_ptr<dns_cache> &shared() {
+			static std::shared_ptr<dns_cache> cache = std::make_shared<dns_cache>();
+			return cache;
+		}
+
+		/// Calls handler on io_context with the addresses of host, resolving it on io_context if need be
+		void async_resolve(asio::io_context &io_context, const std::string &host, unsigned short port, resolve_handler handler) {
+			auto key = host + ':' + std::to_string(port);
+			bool refresh = false;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				auto &entry = m_entries[key];
+				auto now = clock::now();
+				if (entry.valid && now < entry.expires) {
+					if (!entry.error && !entry.resolving && entry.expires - now < std::chrono::seconds(config.refresh_ahead))
+						refresh = entry.resolving = true;
+					auto error = entry.error;
+					auto result = entry.result;
+					io_context.post([handler, error, result]() {
+						handler(error, result);
+					});
+				}
+				else {
+					entry.waiting.emplace_back(&io_context, std::move(handler));
+					if (entry.resolving)
+						return;
+					refresh = entry.resolving = true;
+				}
+			}
+			if (refresh)
+				lookup(io_context, host, port, key);
+		}
+
+		/// Forgets all names
+		void clear() {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			for (auto it = m_entries.begin(); it != m_entries.end();) {
+				if (it->second.resolving)
+					(it++)->second.valid = false;
+				else
+					it = m_entries.erase(it);
+			}
+		}
+	private:
+		struct entry {
+			/// Set once resolved or failed
+			bool valid = false;
+			bool resolving = false;
+			std::error_code error;
+			std::shared_ptr<const endpoints> result;
+			clock::time_point expires;
+			std::vector<std::pair<asio::io_context*, resolve_handler>> waiting;
+		};
+
+		/// Completes the lookup of key with an error if its handler is dropped unrun, as when its io_context is
+		/// destroyed, so that the name does not stay resolving for good
+		struct lookup_guard {
+			std::weak_ptr<dns_cache> cache;
+			std::string key;
+			bool completed = false;
+			~lookup_guard() {
+				auto locked = cache.lock();
+				if (!completed && locked)
+					locked->complete(key, asio::error::operation_aborted, nullptr);
+			}
+		};
+
+		void lookup(asio::io_context &io_context, const std::string &host, unsigned short port, const std::string &key) {
+			auto resolver = std::make_shared<asio::ip::tcp::resolver>(io_context);
+			auto guard = std::make_shared<lookup_guard>();
+			guard->cache = shared_from_this();
+			guard->key = key;
+			asio::ip::tcp::resolver::query query(host, std::to_string(port));
+			resolver->async_resolve(query, [resolver, guard](const std::error_code &ec, asio::ip::tcp::resolver::iterator it) {
+				guard->completed = true;
+				auto cache = guard->cache.lock();
+				if (!cache)
+					return;
+				std::shared_ptr<endpoints> result;
+				if (!ec) {
+					result = std::make_shared<endpoints>();
+					for (; it != asio::ip::tcp::resolver::iterator(); ++it)
+						result->push_back(it->endpoint());
+				}
+				cache->complete(guard->key, ec, std::move(result));
+			});
+		}
+
+		void complete(const std::string &key, const std::error_code &ec, std::shared_ptr<const endpoints> result) {
+			std::vector<std::pair<asio::io_context*, resolve_handler>> waiting;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				auto &entry = m_entries[key];
+				entry.resolving = false;
+				auto now = clock::now();
+				if (!ec) {
+					entry.valid = true;
+					entry.error = ec;
+					entry.result = result;
+					entry.expires = now + std::chrono::seconds(config.ttl);
+				}
+				//A failed renewal keeps the addresses until they expire, a cancelled lookup is not remembered
+				else if (ec != asio::error::operation_aborted && !(entry.valid && !entry.error && now < entry.expires)) {
+					entry.valid = true;
+					entry.error = ec;
+					entry.result = nullptr;
+					entry.expires = now + std::chrono::seconds(config.negative_ttl);
+				}
+				waiting.swap(entry.waiting);
+				if (m_entries.size() > config.max_entries)
+					prune(now);
+			}
+			for (auto &waiter : waiting) {
+				auto handler = std::move(waiter.second);
+				waiter.first->post([handler, ec, result]() {
+					handler(ec, result);
+				});
+			}
+		}
+
+		/// Drops expired names, called with the lock held
+		void prune(clock::time_point now) {
+			for (auto it = m_entries.begin(); it != m_entries.end();) {
+				if (!it->second.resolving && it->second.waiting.empty() && now >= it->second.expires)
+					it = m_entries.erase(it);
+				else
+					++it;
+			}
+		}
+
+		std::mutex m_mutex;
+		std::map<std::string, entry> m_entries;
+	};
+
+	/// Connects to the first of several addresses that answers, racing them as RFC 8305 ("Happy Eyeballs")
+	/// describes: the addresses are tried alternating between IPv6 and IPv4, each attempt starting when the
+	/// previous one fails or after attempt_delay, whichever comes first. An unreachable address family thus delays
+	/// the connection by attempt_delay instead of a TCP connect timeout.
+	class connect_race : public std::enable_shared_from_this<connect_race> {
+	public:
+		/// Called with the connected socket, or with the error of the last attempt
+		using connect_handler = std::function<void(const std::error_code&, std::shared_ptr<asio::ip::tcp::socket>)>;
+
+		/// Connection Attempt Delay recommended by RFC 8305
+		static std::chrono::milliseconds default_attempt_delay() { return std::chrono::milliseconds(250); }
+
+		connect_race(asio::io_context &io_context, std::chrono::milliseconds attempt_delay, connect_handler handler) : m_strand(io_context),
+			m_timer(io_context), m_attempt_delay(attempt_delay), m_handler(std::move(handler)) {}
+		connect_race(const connect_race&) = delete;
+		connect_race &operator=(const connect_race&) = delete;
+
+		/// Starts connecting to endpoints and returns the race, which may be cancelled until handler is called
+		static std::shared_ptr<connect_race> start(asio::io_context &io_context, const std::shared_ptr<const dns_cache::endpoints> &endpoints,
+				std::chrono::milliseconds attempt_delay, connect_handler handler) {
+			auto race = std::make_shared<connect_race>(io_context, attempt_delay, std::move(handler));
+			race->m_order = interleave(*endpoints);
+			race->m_strand.dispatch([race]() {
+				if (race->m_order.empty())
+					race->done(asio::error::host_not_found, nullptr);
+				else
+					race->attempt();
+			});
+			return race;
+		}
+
+		/// Stops all attempts, the handler is called with operation_aborted unless a connection won already
+		void cancel() {
+			auto self = shared_from_this();
+			m_strand.dispatch([self]() {
+				self->done(asio::error::operation_aborted, nullptr);
+			});
+		}
+
+		/// Returns the addresses in the order they are tried: alternating families, starting with the family
+		/// of the first address, which the resolver sorted by preference
+		static dns_cache::endpoints interleave(const dns_cache::endpoints &endpoints) {
+			dns_cache::endpoints first, second, result;
+			for (auto &endpoint : endpoints)
+				(endpoint.protocol() == endpoints.front().protocol() ? first : second).push_back(endpoint);
+			for (size_t c = 0; c < first.size() || c < second.size(); c++) {
+				if (c < first.size())
+					result.push_back(first[c]);
+				if (c < second.size())
+					result.push_back(second[c]);
+			}
+			return result;
+		}
+	private:
+		/// Starts connecting to the next address, on the strand
+		void attempt() {
+			auto self = shared_from_this();
+			auto socket = std::make_shared<asio::ip::tcp::socket>(m_strand.get_io_context());
+			m_attempts.push_back(socket);
+			m_pending++;
+			socket->async_connect(m_order[m_next++], m_strand.wrap([self, socket](const std::error_code &ec) {
+				self->m_pending--;
+				if (self->m_finished)
+					return;
+				if (!ec) {
+					self->done(ec, socket);
+					return;
+				}
+				self->m_error = ec;
+				std::error_code ignored;
+				socket->close(ignored);
+				if (self->m_next < self->m_order.size())
+					self->attempt();
+				else if (self->m_pending == 0)
+					self->done(self->m_error, nullptr);
+			}));
+			if (m_next < m_order.size()) {
+				m_timer.expires_after(m_attempt_delay);
+				m_timer.async_wait(m_strand.wrap([self](const std::error_code &ec) {
+					//A wait that expired before attempt() armed the timer again is stale
+					if (ec || self->m_finished || self->m_next >= self->m_order.size() || self->m_timer.expiry() > asio::steady_timer::clock_type::now())
+						return;
+					self->attempt();
+				}));
+			}
+		}
+
+		void done(const std::error_code &ec, std::shared_ptr<asio::ip::tcp::socket> winner) {
+			if (m_finished)
+				return;
+			m_finished = true;
+			m_timer.cancel();
+			for (auto &socket : m_attempts) {
+				if (socket != winner) {
+					std::error_code ignored;
+					socket->close(ignored);
+				}
+			}
+			m_attempts.clear();
+			auto handler = std::move(m_handler);
+			m_handler = nullptr;
+			handler(ec, std::move(winner));
+		}
+
+		asio::io_context::strand m_strand;
+		asio::steady_timer m_timer;
+		std::chrono::milliseconds m_attempt_delay;
+		connect_handler m_handler;
+		dns_cache::endpoints m_order;
+		size_t m_next = 0;
+		size_t m_pending = 0;
+		std::vector<std::shared_ptr<asio::ip::tcp::socket>> m_attempts;
+		std::error_code m_error;
+		bool m_finished = false;
+	};
+}
+
+#endif  /* DNS_CACHE_HPP */
@@ -0,0 +1,168 @@
+// license:MIT
+// copyright-holders:Miodrag Milanovic
+#ifndef FILE_CACHE_HPP
+#define FILE_CACHE_HPP
+
+#include "http_fragments.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace webpp {
+	/// A regular file opened for reading, along with the stat results it was opened with.
+	class open_file {
+		friend class file_cache;
+	public:
+		open_file(const open_file&) = delete;
+		open_file &operator=(const open_file&) = delete;
+		~open_file() {
+			if (m_handle < 0)
+				return;
+#if defined(_WIN32)
+			_close(m_handle);
+#else
+			::close(m_handle);
+#endif
+		}
+
+		/// File descriptor, for instance for sendfile(2)
+		int handle() const { return m_handle; }
+		unsigned long long size() const { return m_size; }
+		std::time_t modified() const { return m_modified; }
+		/// Modification time as an HTTP date
+		const std::string &last_modified() const { return m_last_modified; }
+		/// Strong entity tag derived from size and modification time, including its quotes
+		const std::string &etag() const { return m_etag; }
+
+		/// Reads up to size bytes from offset. Returns the number of bytes read, 0 at the end of the file or -1 on errors.
+		long long read(char *data, size_t size, unsigned long long offset) const {
+#if defined(_WIN32)
+			//No positional read, the file position is shared
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (_lseeki64(m_handle, static_cast<long long>(offset), SEEK_SET) < 0)
+				return -1;
+			return _read(m_handle, data, static_cast<unsigned>(size));
+#else
+			return ::pread(m_handle, data, size, static_cast<off_t>(offset));
+#endif
+		}
+	private:
+		open_file() {}
+
+		int m_handle = -1;
+		unsigned long long m_size = 0;
+		std::time_t m_modified = 0;
+		unsigned long long m_device = 0, m_inode = 0;
+		std::string m_last_modified;
+		std::string m_etag;
+#if defined(_WIN32)
+		mutable std::mutex m_mutex;
+#endif
+	};
+
+	/// Cache of open files by path, shared by all threads.
+	///
+	/// A cached file is checked against the file system at most once per check interval: if its path now refers
+	/// to another file, or the size or modification time changed, the file is opened again. Files that are
+	/// replaced or deleted may thus be served for up to one interval. Files still being sent stay open until the
+	/// last response using them is done, even when they are dropped from the cache.
+	class file_cache {
+	public:
+		using clock = std::chrono::steady_clock;
+
+		explicit file_cache(clock::duration check_interval = std::chrono::seconds(1), size_t max_files = 1024) :
+			m_check_interval(check_interval), m_max_files(max_files) {}
+		file_cache(const file_cache&) = delete;
+		file_cache &operator=(const file_cache&) = delete;
+
+		/// Returns the regular file at path, or null if there is none or it cannot be opened.
+		std::shared_ptr<const open_file> open(const std::string &path) {
+			auto now = clock::now();
+			std::lock_guard<std::mutex> lock(m_mutex);
+			auto it = m_files.find(path);
+			if (it != m_files.end()) {
+				auto &entry = it->second;
+				if (now - entry.checked < m_check_interval)
+					return entry.file;
+				file_status status;
+				if (get_status(path, status) && same_file(*entry.file, status)) {
+					entry.checked = now;
+					return entry.file;
+				}
+				m_files.erase(it);
+			}
+
+			auto file = open_regular(path);
+			if (!file)
+				return nullptr;
+			//A full cache simply starts over, what is in use is reopened on its next request
+			if (m_files.size() >= m_max_files)
+				m_files.clear();
+			m_files.emplace(path, entry{ file, now });
+			return file;
+		}
+	private:
+		struct entry {
+			std::shared_ptr<const open_file> file;
+			clock::time_point checked;
+		};
+
+#if defined(_WIN32)
+		struct file_status : _stat64 {};
+		static bool get_status(const std::string &path, file_status &status) { return _stat64(path.c_str(), &status) == 0; }
+		static bool get_status(int handle, file_status &status) { return _fstat64(handle, &status) == 0; }
+#else
+		struct file_status : stat {};
+		static bool get_status(const std::string &path, file_status &status) { return ::stat(path.c_str(), &status) == 0; }
+		static bool get_status(int handle, file_status &status) { return ::fstat(handle, &status) == 0; }
+#endif
+
+		static bool same_file(const open_file &file, const file_status &status) {
+			return file.m_device == static_cast<unsigned long long>(status.st_dev) && file.m_inode == static_cast<unsigned long long>(status.st_ino) &&
+				file.m_size == static_cast<unsigned long long>(status.st_size) && file.m_modified == status.st_mtime;
+		}
+
+		static std::shared_ptr<const open_file> open_regular(const std::string &path) {
+			std::shared_ptr<open_file> file(new open_file());
+#if defined(_WIN32)
+			file->m_handle = _open(path.c_str(), _O_RDONLY | _O_BINARY);
+#else
+			file->m_handle = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+#endif
+			file_status status;
+			if (file->m_handle < 0 || !get_status(file->m_handle, status) || (status.st_mode & S_IFMT) != S_IFREG)
+				return nullptr;
+			file->m_size = static_cast<unsigned long long>(status.st_size);
+			file->m_modified = status.st_mtime;
+			file->m_device = static_cast<unsigned long long>(status.st_dev);
+			file->m_inode = static_cast<unsigned long long>(status.st_ino);
+
+			char buffer[64];
+			format_http_date(file->m_modified, buffer);
+			file->m_last_modified = buffer;
+			std::snprintf(buffer, sizeof(buffer), "\"%llx-%llx\"", file->m_size, static_cast<unsigned long long>(file->m_modified));
+			file->m_etag = buffer;
+			return file;
+		}
+
+		std::mutex m_mutex;
+		std::unordered_map<std::string, entry> m_files;
+		clock::duration m_check_interval;
+		size_t m_max_files;
+	};
+}
+
+#endif  /* FILE_CACHE_HPP */
@@ -0,0 +1,238 @@
+// license:MIT
+// copyright-holders:Miodrag Milanovic
+#ifndef HTTP_FRAGMENTS_HPP
+#define HTTP_FRAGMENTS_HPP
+
+#include "http_parser.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string>
+
+// Pre-rendered pieces of HTTP responses: status lines, Content-Type lines for common MIME types and the
+// Date line. They are written from static memory instead of being formatted for every response.
+
+namespace webpp {
+	namespace fragment_detail {
+		struct status_entry {
+			int code;
+			const char *http10;
+			const char *http11;
+			size_t size;
+		};
+
+#define WEBPP_STATUS(code, reason) { code, "HTTP/1.0 " #code " " reason "\r\n", "HTTP/1.1 " #code " " reason "\r\n", sizeof("HTTP/1.1 " #code " " reason "\r\n") - 1 }
+		constexpr status_entry status_table[] = {
+			WEBPP_STATUS(100, "Continue"),
+			WEBPP_STATUS(101, "Switching Protocols"),
+			WEBPP_STATUS(102, "Processing"),
+			WEBPP_STATUS(103, "Early Hints"),
+			WEBPP_STATUS(200, "OK"),
+			WEBPP_STATUS(201, "Created"),
+			WEBPP_STATUS(202, "Accepted"),
+			WEBPP_STATUS(203, "Non-Authoritative Information"),
+			WEBPP_STATUS(204, "No Content"),
+			WEBPP_STATUS(205, "Reset Content"),
+			WEBPP_STATUS(206, "Partial Content"),
+			WEBPP_STATUS(207, "Multi-Status"),
+			WEBPP_STATUS(208, "Already Reported"),
+			WEBPP_STATUS(226, "IM Used"),
+			WEBPP_STATUS(300, "Multiple Choices"),
+			WEBPP_STATUS(301, "Moved Permanently"),
+			WEBPP_STATUS(302, "Found"),
+			WEBPP_STATUS(303, "See Other"),
+			WEBPP_STATUS(304, "Not Modified"),
+			WEBPP_STATUS(305, "Use Proxy"),
+			WEBPP_STATUS(307, "Temporary Redirect"),
+			WEBPP_STATUS(308, "Permanent Redirect"),
+			WEBPP_STATUS(400, "Bad Request"),
+			WEBPP_STATUS(401, "Unauthorized"),
+			WEBPP_STATUS(402, "Payment Required"),
+			WEBPP_STATUS(403, "Forbidden"),
+			WEBPP_STATUS(404, "Not Found"),
+			WEBPP_STATUS(405, "Method Not Allowed"),
+			WEBPP_STATUS(406, "Not Acceptable"),
+			WEBPP_STATUS(407, "Proxy Authentication Required"),
+			WEBPP_STATUS(408, "Request Timeout"),
+			WEBPP_STATUS(409, "Conflict"),
+			WEBPP_STATUS(410, "Gone"),
+			WEBPP_STATUS(411, "Length Required"),
+			WEBPP_STATUS(412, "Precondition Failed"),
+			WEBPP_STATUS(413, "Payload Too Large"),
+			WEBPP_STATUS(414, "URI Too Long"),
+			WEBPP_STATUS(415, "Unsupported Media Type"),
+			WEBPP_STATUS(416, "Range Not Satisfiable"),
+			WEBPP_STATUS(417, "Expectation Failed"),
+			WEBPP_STATUS(421, "Misdirected Request"),
+			WEBPP_STATUS(422, "Unprocessable Entity"),
+			WEBPP_STATUS(423, "Locked"),
+			WEBPP_STATUS(424, "Failed Dependency"),
+			WEBPP_STATUS(425, "Too Early"),
+			WEBPP_STATUS(426, "Upgrade Required"),
+			WEBPP_STATUS(428, "Precondition Required"),
+			WEBPP_STATUS(429, "Too Many Requests"),
+			WEBPP_STATUS(431, "Request Header Fields Too Large"),
+			WEBPP_STATUS(451, "Unavailable For Legal Reasons"),
+			WEBPP_STATUS(500, "Internal Server Error"),
+			WEBPP_STATUS(501, "Not Implemented"),
+			WEBPP_STATUS(502, "Bad Gateway"),
+			WEBPP_STATUS(503, "Service Unavailable"),
+			WEBPP_STATUS(504, "Gateway Timeout"),
+			WEBPP_STATUS(505, "HTTP Version Not Supported"),
+			WEBPP_STATUS(506, "Variant Also Negotiates"),
+			WEBPP_STATUS(507, "Insufficient Storage"),
+			WEBPP_STATUS(508, "Loop Detected"),
+			WEBPP_STATUS(510, "Not Extended"),
+			WEBPP_STATUS(511, "Network Authentication Required"),
+		};
+#undef WEBPP_STATUS
+
+		constexpr size_t status_count = sizeof(status_table) / sizeof(status_table[0]);
+
+		/// Maps the codes 100 to 599 to their position in status_table plus one, 0 for unknown codes
+		struct status_index {
+			unsigned char slot[500];
+			constexpr status_index() : slot() {
+				for (size_t c = 0; c < status_count; c++)
+					slot[status_table[c].code - 100] = static_cast<unsigned char>(c + 1);
+			}
+		};
+		constexpr status_index status_lookup{};
+
+		struct mime_entry {
+			const char *type;
+			size_t type_size;
+			const char *line;
+			size_t size;
+		};
+
+#define WEBPP_MIME(type) { type, sizeof(type) - 1, "Content-Type: " type "\r\n", sizeof("Content-Type: " type "\r\n") - 1 }
+		constexpr mime_entry mime_table[] = {
+			WEBPP_MIME("text/html"),
+			WEBPP_MIME("text/html; charset=utf-8"),
+			WEBPP_MIME("text/plain"),
+			WEBPP_MIME("text/plain; charset=utf-8"),
+			WEBPP_MIME("text/css"),
+			WEBPP_MIME("text/csv"),
+			WEBPP_MIME("text/xml"),
+			WEBPP_MIME("text/javascript"),
+			WEBPP_MIME("application/javascript"),
+			WEBPP_MIME("application/json"),
+			WEBPP_MIME("application/xml"),
+			WEBPP_MIME("application/pdf"),
+			WEBPP_MIME("application/wasm"),
+			WEBPP_MIME("application/octet-stream"),
+			WEBPP_MIME("application/x-www-form-urlencoded"),
+			WEBPP_MIME("image/png"),
+			WEBPP_MIME("image/jpeg"),
+			WEBPP_MIME("image/gif"),
+			WEBPP_MIME("image/svg+xml"),
+			WEBPP_MIME("image/webp"),
+			WEBPP_MIME("image/x-icon"),
+			WEBPP_MIME("font/woff"),
+			WEBPP_MIME("font/woff2"),
+		};
+#undef WEBPP_MIME
+	}
+
+	/// Returns the status line, including its CRLF, for a standard status code, or an empty reference for other codes.
+	inline string_ref status_line(int code, bool http11) {
+		if (code < 100 || code > 599)
+			return string_ref();
+		auto slot = fragment_detail::status_lookup.slot[code - 100];
+		if (slot == 0)
+			return string_ref();
+		auto &entry = fragment_detail::status_table[slot - 1];
+		return string_ref(http11 ? entry.http11 : entry.http10, entry.size);
+	}
+
+	/// Returns the "Content-Type: " line, including its CRLF, for a common MIME type, or an empty reference for other types.
+	inline string_ref content_type_line(const string_ref &type) {
+		for (auto &entry : fragment_detail::mime_table) {
+			if (entry.type_size == type.size() && std::memcmp(entry.type, type.data(), type.size()) == 0)
+				return string_ref(entry.line, entry.size);
+		}
+		return string_ref();
+	}
+
+	inline string_ref keep_alive_line() {
+		return string_ref("Connection: keep-alive\r\n", 24);
+	}
+
+	inline string_ref close_line() {
+		return string_ref("Connection: close\r\n", 19);
+	}
+
+	namespace fragment_detail {
+		//Not strftime() and friends, whose day and month names depend on the locale
+		constexpr char day_names[][4] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+		constexpr char month_names[][4] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+		/// Days since 1970-01-01 of a date in the proleptic Gregorian calendar
+		inline long long days_from_civil(long long year, unsigned month, unsigned day) {
+			year -= month <= 2;
+			long long era = (year >= 0 ? year : year - 399) / 400;
+			unsigned year_of_era = static_cast<unsigned>(year - era * 400);
+			unsigned day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+			unsigned day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+			return era * 146097 + static_cast<long long>(day_of_era) - 719468;
+		}
+	}
+
+	/// Formats time as an HTTP date ("Sun, 06 Nov 1994 08:49:37 GMT") into buffer, which must hold 30 characters.
+	inline void format_http_date(std::time_t time, char *buffer) {
+		std::tm tm;
+#if defined(_WIN32)
+		gmtime_s(&tm, &time);
+#else
+		gmtime_r(&time, &tm);
+#endif
+		//A year of four digits keeps the date within the 29 characters of the buffer
+		auto year = std::min(std::max(tm.tm_year + 1900, 0), 9999);
+		std::snprintf(buffer, 30, "%s, %02d %s %04d %02d:%02d:%02d GMT", fragment_detail::day_names[tm.tm_wday], tm.tm_mday,
+			fragment_detail::month_names[tm.tm_mon], year, tm.tm_hour, tm.tm_min, tm.tm_sec);
+	}
+
+	/// Parses an HTTP date in the preferred format of format_http_date(). Returns false for other formats.
+	inline bool parse_http_date(const string_ref &str, std::time_t &time) {
+		char day_name[4], month_name[4], zone[4];
+		int day, year, hour, minute, second;
+		auto text = str.str();
+		if (std::sscanf(text.c_str(), "%3s, %2d %3s %4d %2d:%2d:%2d %3s", day_name, &day, month_name, &year, &hour, &minute, &second, zone) != 8 ||
+			std::strcmp(zone, "GMT") != 0)
+			return false;
+		unsigned month = 0;
+		while (month < 12 && std::strcmp(fragment_detail::month_names[month], month_name) != 0)
+			month++;
+		if (month == 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60)
+			return false;
+		auto days = fragment_detail::days_from_civil(year, month + 1, static_cast<unsigned>(day));
+		time = static_cast<std::time_t>(days * 86400 + hour * 3600 + minute * 60 + second);
+		return true;
+	}
+
+	/// Returns the "Date: " line, including its CRLF, for the current second. The line is rendered at most once
+	/// per second and thread; holding the returned pointer keeps it valid while it is being written.
+	inline const std::shared_ptr<const std::string> &date_line() {
+		struct cache {
+			std::time_t second = 0;
+			std::shared_ptr<const std::string> line;
+		};
+		static thread_local cache current;
+
+		auto now = std::time(nullptr);
+		if (now != current.second || !current.line) {
+			char buffer[40] = "Date: ";
+			format_http_date(now, buffer + 6);
+			std::strcat(buffer, "\r\n");
+			current.line = std::make_shared<const std::string>(buffer);
+			current.second = now;
+		}
+		return current.line;
+	}
+}
+
+#endif  /* HTTP_FRAGMENTS_HPP */
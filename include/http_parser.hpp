@@ -0,0 +1,496 @@
+// license:MIT
+// copyright-holders:Miodrag Milanovic
+#ifndef HTTP_PARSER_HPP
+#define HTTP_PARSER_HPP
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <ostream>
+#include <cstring>
+#include <cctype>
+
+#include "simd_scan.hpp"
+
+#ifndef CASE_INSENSITIVE_EQUALS_AND_HASH
+#define CASE_INSENSITIVE_EQUALS_AND_HASH
+class case_insensitive_equals {
+public:
+	bool operator()(const std::string &key1, const std::string &key2) const {
+		return key1.size() == key2.size()
+			&& equal(key1.cbegin(), key1.cend(), key2.cbegin(),
+				[](std::string::value_type key1v, std::string::value_type key2v)
+		{ return tolower(key1v) == tolower(key2v); });
+	}
+};
+class case_insensitive_hash {
+public:
+	size_t operator()(const std::string &key) const {
+		size_t seed = 0;
+		for (auto &c : key) {
+			std::hash<char> hasher;
+			seed ^= hasher(std::tolower(c)) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+		}
+		return seed;
+	}
+};
+#endif
+
+namespace webpp {
+	/// Non-owning reference to a range of characters, used to refer into a parsed header block.
+	/// A std::string is only created when str() is called or the reference is converted.
+	class string_ref {
+	public:
+		string_ref() : m_data(nullptr), m_size(0) {}
+		string_ref(const char *data, size_t size) : m_data(data), m_size(size) {}
+		string_ref(const char *str) : m_data(str), m_size(std::strlen(str)) {}
+		string_ref(const std::string &str) : m_data(str.data()), m_size(str.size()) {}
+
+		const char *data() const { return m_data; }
+		size_t size() const { return m_size; }
+		bool empty() const { return m_size == 0; }
+		const char *begin() const { return m_data; }
+		const char *end() const { return m_data + m_size; }
+		char operator[](size_t pos) const { return m_data[pos]; }
+
+		std::string str() const { return std::string(m_data, m_size); }
+		operator std::string() const { return str(); }
+
+		bool operator==(const string_ref &rhs) const {
+			return m_size == rhs.m_size && (m_size == 0 || std::memcmp(m_data, rhs.m_data, m_size) == 0);
+		}
+		bool operator!=(const string_ref &rhs) const { return !(*this == rhs); }
+		bool operator==(const char *rhs) const { return *this == string_ref(rhs); }
+		bool operator!=(const char *rhs) const { return !(*this == rhs); }
+		bool operator==(const std::string &rhs) const { return *this == string_ref(rhs); }
+		bool operator!=(const std::string &rhs) const { return !(*this == rhs); }
+	private:
+		const char *m_data;
+		size_t m_size;
+	};
+
+	inline std::ostream& operator<<(std::ostream &os, const string_ref &str) {
+		return os.write(str.data(), static_cast<std::streamsize>(str.size()));
+	}
+
+	/// Case-insensitive comparison, as used for header names and tokens such as "keep-alive".
+	inline bool iequals(const string_ref &str1, const string_ref &str2) {
+		if (str1.size() != str2.size())
+			return false;
+		for (size_t c = 0; c < str1.size(); c++) {
+			if (std::tolower(static_cast<unsigned char>(str1[c])) != std::tolower(static_cast<unsigned char>(str2[c])))
+				return false;
+		}
+		return true;
+	}
+
+	/// Returns true if an Accept-Encoding field value accepts coding, explicitly or through "*", with a quality above 0.
+	inline bool accepts_coding(const string_ref &value, const string_ref &coding) {
+		bool star = false;
+		auto pos = value.begin();
+		auto end = value.end();
+		while (pos != end) {
+			while (pos != end && (*pos == ' ' || *pos == '\t' || *pos == ','))
+				++pos;
+			auto name = pos;
+			while (pos != end && *pos != ',' && *pos != ';' && *pos != ' ' && *pos != '\t')
+				++pos;
+			string_ref token(name, static_cast<size_t>(pos - name));
+			//Without a q parameter the quality is 1, with one it counts if any of its digits is not 0
+			bool accepted = true;
+			while (pos != end && *pos != ',') {
+				if (*pos == '=' && pos != name && (pos[-1] == 'q' || pos[-1] == 'Q')) {
+					accepted = false;
+					for (++pos; pos != end && *pos != ',' && *pos != ';'; ++pos)
+						accepted = accepted || (*pos >= '1' && *pos <= '9');
+					continue;
+				}
+				++pos;
+			}
+			if (iequals(token, coding))
+				return accepted;
+			if (token == "*")
+				star = accepted;
+		}
+		return star;
+	}
+
+	/// One header line, with first being the name and second the value.
+	struct header_field {
+		string_ref first;
+		string_ref second;
+	};
+
+	/// Header fields of a parsed message, referring into the message's header block.
+	/// Lookups are case-insensitive and follow the std::unordered_multimap interface used before,
+	/// use materialize() when an owning copy is needed.
+	class header_fields {
+	public:
+		using container = std::vector<header_field>;
+		using const_iterator = container::const_iterator;
+		using iterator = const_iterator;
+
+		/// Iterates over the fields with a given name only.
+		class name_iterator {
+		public:
+			name_iterator(const_iterator pos, const_iterator end, string_ref name) : m_pos(pos), m_end(end), m_name(name) { skip(); }
+			const header_field &operator*() const { return *m_pos; }
+			const header_field *operator->() const { return &*m_pos; }
+			name_iterator &operator++() { ++m_pos; skip(); return *this; }
+			bool operator==(const name_iterator &rhs) const { return m_pos == rhs.m_pos; }
+			bool operator!=(const name_iterator &rhs) const { return m_pos != rhs.m_pos; }
+		private:
+			void skip() { while (m_pos != m_end && !iequals(m_pos->first, m_name)) ++m_pos; }
+			const_iterator m_pos, m_end;
+			string_ref m_name;
+		};
+
+		const_iterator begin() const { return m_fields.begin(); }
+		const_iterator end() const { return m_fields.end(); }
+		size_t size() const { return m_fields.size(); }
+		bool empty() const { return m_fields.empty(); }
+		void clear() { m_fields.clear(); }
+
+		const_iterator find(const string_ref &name) const {
+			return std::find_if(m_fields.begin(), m_fields.end(), [&name](const header_field &field) { return iequals(field.first, name); });
+		}
+		size_t count(const string_ref &name) const {
+			return static_cast<size_t>(std::count_if(m_fields.begin(), m_fields.end(), [&name](const header_field &field) { return iequals(field.first, name); }));
+		}
+		std::pair<name_iterator, name_iterator> equal_range(const string_ref &name) const {
+			return std::make_pair(name_iterator(m_fields.begin(), m_fields.end(), name), name_iterator(m_fields.end(), m_fields.end(), name));
+		}
+
+		/// Adds a field; name and value must outlive this object.
+		void emplace(const string_ref &name, const string_ref &value) { m_fields.push_back(header_field{name, value}); }
+
+		/// Copies the fields into an owning map.
+		std::unordered_multimap<std::string, std::string, case_insensitive_hash, case_insensitive_equals> materialize() const {
+			std::unordered_multimap<std::string, std::string, case_insensitive_hash, case_insensitive_equals> result;
+			for (auto &field : m_fields)
+				result.emplace(field.first.str(), field.second.str());
+			return result;
+		}
+	private:
+		container m_fields;
+	};
+
+	/// Incremental HTTP/1.x request head parser.
+	///
+	/// The parser works on a contiguous buffer that holds the message from its first byte. It only records
+	/// offsets, so parse() may be called again with the same data plus newly received bytes (even if the
+	/// buffer moved in memory) and resumes where it stopped. Nothing is copied while parsing.
+	class request_parser {
+	public:
+		enum class result { complete, incomplete, error };
+
+		request_parser() { reset(); }
+
+		void reset() {
+			m_state = state::method_start;
+			m_pos = 0;
+			m_token_start = 0;
+			m_method = m_path = m_version = span();
+			m_name = span();
+			m_fields.clear();
+		}
+
+		/// Parses the head in [data, data+size). Returns result::complete once the empty line ending the head is seen.
+		result parse(const char *data, size_t size) {
+			while (m_pos < size) {
+				//Skip over the bulk of tokens and values with the vectorized scanner
+				switch (m_state) {
+				case state::method:
+				case state::path:
+					m_pos = static_cast<size_t>(scan_for_any(data + m_pos, data + size, ' ', '\r', '\n') - data);
+					break;
+				case state::version:
+				case state::header_value:
+					m_pos = static_cast<size_t>(scan_for_any(data + m_pos, data + size, '\r', '\n') - data);
+					break;
+				case state::header_name:
+					m_pos = static_cast<size_t>(scan_for_any(data + m_pos, data + size, ':', '\r', '\n') - data);
+					break;
+				default:
+					break;
+				}
+				if (m_pos == size)
+					break;
+
+				char c = data[m_pos];
+				switch (m_state) {
+				case state::method_start:
+					if (c == ' ' || c == '\r' || c == '\n')
+						return fail();
+					m_token_start = m_pos;
+					m_state = state::method;
+					break;
+				case state::method:
+					if (c == ' ') {
+						m_method = span(m_token_start, m_pos);
+						m_token_start = m_pos + 1;
+						m_state = state::path;
+					}
+					else if (c == '\r' || c == '\n')
+						return fail();
+					break;
+				case state::path:
+					if (c == ' ') {
+						if (m_pos == m_token_start)
+							return fail();
+						m_path = span(m_token_start, m_pos);
+						m_token_start = m_pos + 1;
+						m_state = state::version;
+					}
+					else if (c == '\r' || c == '\n')
+						return fail();
+					break;
+				case state::version:
+					if (c == '\r' || c == '\n') {
+						if (m_pos - m_token_start < 5 || std::memcmp(data + m_token_start, "HTTP/", 5) != 0)
+							return fail();
+						m_version = span(m_token_start + 5, m_pos);
+						m_state = c == '\r' ? state::line_lf : state::header_start;
+					}
+					break;
+				case state::line_lf:
+					if (c != '\n')
+						return fail();
+					m_state = state::header_start;
+					break;
+				case state::header_start:
+					if (c == '\r')
+						m_state = state::head_lf;
+					else if (c == '\n') {
+						++m_pos;
+						m_state = state::done;
+						return result::complete;
+					}
+					else if (c == ':' || c == ' ' || c == '\t')
+						return fail();
+					else {
+						m_token_start = m_pos;
+						m_state = state::header_name;
+					}
+					break;
+				case state::header_name:
+					if (c == ':') {
+						m_name = span(m_token_start, m_pos);
+						m_state = state::header_value_start;
+					}
+					else if (c == '\r' || c == '\n')
+						return fail();
+					break;
+				case state::header_value_start:
+					if (c == ' ' || c == '\t')
+						break;
+					//The value may be empty, so the first character is checked as part of the value
+					m_token_start = m_pos;
+					m_state = state::header_value;
+					// fall through
+				case state::header_value:
+					if (c == '\r' || c == '\n') {
+						size_t value_end = m_pos;
+						while (value_end > m_token_start && (data[value_end - 1] == ' ' || data[value_end - 1] == '\t'))
+							--value_end;
+						m_fields.push_back(std::make_pair(m_name, span(m_token_start, value_end)));
+						m_state = c == '\r' ? state::line_lf : state::header_start;
+					}
+					break;
+				case state::head_lf:
+					if (c != '\n')
+						return fail();
+					++m_pos;
+					m_state = state::done;
+					return result::complete;
+				case state::done:
+					return result::complete;
+				case state::error:
+					return result::error;
+				}
+				++m_pos;
+			}
+			if (m_state == state::done)
+				return result::complete;
+			return m_state == state::error ? result::error : result::incomplete;
+		}
+
+		/// Number of bytes of the head, including the terminating empty line. Valid once parse() returned complete.
+		size_t head_size() const { return m_pos; }
+
+		/// The following accessors resolve the recorded offsets against the buffer the head is now stored in.
+		string_ref method(const char *base) const { return m_method.resolve(base); }
+		string_ref path(const char *base) const { return m_path.resolve(base); }
+		string_ref http_version(const char *base) const { return m_version.resolve(base); }
+		void fields(const char *base, header_fields &header) const {
+			header.clear();
+			for (auto &field : m_fields)
+				header.emplace(field.first.resolve(base), field.second.resolve(base));
+		}
+	private:
+		enum class state {
+			method_start, method, path, version, line_lf,
+			header_start, header_name, header_value_start, header_value, head_lf,
+			done, error
+		};
+
+		struct span {
+			span() : offset(0), length(0) {}
+			span(size_t begin, size_t end) : offset(begin), length(end - begin) {}
+			string_ref resolve(const char *base) const { return string_ref(base + offset, length); }
+			size_t offset;
+			size_t length;
+		};
+
+		result fail() {
+			m_state = state::error;
+			return result::error;
+		}
+
+		state m_state;
+		size_t m_pos;
+		size_t m_token_start;
+		span m_method, m_path, m_version, m_name;
+		std::vector<std::pair<span, span>> m_fields;
+	};
+
+	/// Incremental decoder for the chunked transfer coding.
+	///
+	/// Input may be passed in pieces of any size; the state between chunk size lines, data and trailer is kept
+	/// in the decoder. Chunk data is not copied but returned as references into the input.
+	class chunked_decoder {
+	public:
+		enum class result { data, incomplete, done, error };
+
+		chunked_decoder() { reset(); }
+
+		void reset() {
+			m_state = state::size_start;
+			m_remaining = 0;
+		}
+
+		/// Decodes from [data, data+size) and sets consumed to the number of bytes used. Returns result::data with
+		/// body referring to chunk data within the input, result::incomplete once all input is used, or
+		/// result::done after the last chunk and its trailer.
+		result decode(const char *data, size_t size, size_t &consumed, string_ref &body) {
+			size_t pos = 0;
+			while (pos < size) {
+				char c = data[pos];
+				switch (m_state) {
+				case state::size_start:
+					if (hex_value(c) < 0)
+						return fail(consumed, pos);
+					m_remaining = 0;
+					m_state = state::size;
+					continue;
+				case state::size: {
+					auto digit = hex_value(c);
+					if (digit < 0) {
+						m_state = state::extension;
+						continue;
+					}
+					if (m_remaining > (~0ull >> 4))
+						return fail(consumed, pos);
+					m_remaining = (m_remaining << 4) | static_cast<unsigned long long>(digit);
+					break;
+				}
+				case state::extension:
+					//Chunk extensions are ignored
+					if (c == '\r')
+						m_state = state::size_lf;
+					else if (c == '\n')
+						m_state = m_remaining ? state::data : state::trailer_start;
+					break;
+				case state::size_lf:
+					if (c != '\n')
+						return fail(consumed, pos);
+					m_state = m_remaining ? state::data : state::trailer_start;
+					break;
+				case state::data: {
+					auto length = static_cast<size_t>(std::min<unsigned long long>(m_remaining, size - pos));
+					body = string_ref(data + pos, length);
+					m_remaining -= length;
+					if (m_remaining == 0)
+						m_state = state::data_cr;
+					consumed = pos + length;
+					return result::data;
+				}
+				case state::data_cr:
+					if (c == '\r')
+						m_state = state::data_lf;
+					else if (c == '\n')
+						m_state = state::size_start;
+					else
+						return fail(consumed, pos);
+					break;
+				case state::data_lf:
+					if (c != '\n')
+						return fail(consumed, pos);
+					m_state = state::size_start;
+					break;
+				case state::trailer_start:
+					if (c == '\r')
+						m_state = state::end_lf;
+					else if (c == '\n') {
+						m_state = state::done;
+						consumed = pos + 1;
+						return result::done;
+					}
+					else
+						m_state = state::trailer_field;
+					break;
+				case state::trailer_field:
+					//Trailer fields are ignored
+					if (c == '\n')
+						m_state = state::trailer_start;
+					break;
+				case state::end_lf:
+					if (c != '\n')
+						return fail(consumed, pos);
+					m_state = state::done;
+					consumed = pos + 1;
+					return result::done;
+				case state::done:
+					consumed = pos;
+					return result::done;
+				case state::error:
+					consumed = pos;
+					return result::error;
+				}
+				++pos;
+			}
+			consumed = pos;
+			if (m_state == state::done)
+				return result::done;
+			return m_state == state::error ? result::error : result::incomplete;
+		}
+	private:
+		enum class state {
+			size_start, size, extension, size_lf, data, data_cr, data_lf,
+			trailer_start, trailer_field, end_lf, done, error
+		};
+
+		static int hex_value(char c) {
+			if (c >= '0' && c <= '9')
+				return c - '0';
+			if (c >= 'a' && c <= 'f')
+				return c - 'a' + 10;
+			if (c >= 'A' && c <= 'F')
+				return c - 'A' + 10;
+			return -1;
+		}
+
+		result fail(size_t &consumed, size_t pos) {
+			m_state = state::error;
+			consumed = pos;
+			return result::error;
+		}
+
+		state m_state;
+		/// Size of the chunk while parsing its size line, then the bytes of its data still to come
+		unsigned long long m_remaining;
+	};
+}
+
+#endif  /* HTTP_PARSER_HPP */
@@ -0,0 +1,413 @@
+// license:MIT
+// copyright-holders:Miodrag Milanovic
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace webpp {
+	/// Latency distribution in nanoseconds with log-linear buckets, as HdrHistogram does: every power of two is
+	/// split into 8 buckets, so a recorded value is known to within 12.5%. Values from 2^36 ns (about 69 s) on
+	/// share the last bucket.
+	class latency_histogram {
+	public:
+		static const size_t sub_buckets = 8;
+		static const size_t bucket_count = sub_buckets + 33 * sub_buckets;
+
+		static size_t bucket(std::uint64_t value) {
+			if (value < sub_buckets)
+				return static_cast<size_t>(value);
+			auto e = msb(value);
+			auto index = sub_buckets + (e - 3) * sub_buckets + static_cast<size_t>((value >> (e - 3)) & (sub_buckets - 1));
+			return std::min(index, bucket_count - 1);
+		}
+		/// Smallest value of bucket index
+		static std::uint64_t lower_bound(size_t index) {
+			if (index < sub_buckets)
+				return index;
+			auto e = (index - sub_buckets) / sub_buckets + 3;
+			return static_cast<std::uint64_t>(sub_buckets + (index - sub_buckets) % sub_buckets) << (e - 3);
+		}
+		/// Largest value of bucket index, except for the last bucket which takes all larger values
+		static std::uint64_t upper_bound(size_t index) { return lower_bound(index + 1) - 1; }
+
+		void record(std::uint64_t value) {
+			m_counts[bucket(value)]++;
+			m_sum += value;
+		}
+		void merge(const latency_histogram &other) {
+			for (size_t c = 0; c < bucket_count; c++)
+				m_counts[c] += other.m_counts[c];
+			m_sum += other.m_sum;
+		}
+
+		std::uint64_t count() const {
+			std::uint64_t total = 0;
+			for (auto n : m_counts)
+				total += n;
+			return total;
+		}
+		/// Sum of the recorded values
+		std::uint64_t sum() const { return m_sum; }
+		std::uint64_t bucket_value(size_t index) const { return m_counts[index]; }
+
+		/// Returns the upper bound of the bucket holding the value below which the fraction q of the values lie
+		std::uint64_t quantile(double q) const {
+			auto total = count();
+			if (total == 0)
+				return 0;
+			auto rank = static_cast<std::uint64_t>(q * static_cast<double>(total) + 0.5);
+			rank = std::max<std::uint64_t>(1, std::min(rank, total));
+			std::uint64_t seen = 0;
+			for (size_t c = 0; c < bucket_count; c++) {
+				seen += m_counts[c];
+				if (seen >= rank)
+					return upper_bound(c);
+			}
+			return upper_bound(bucket_count - 1);
+		}
+	private:
+		static size_t msb(std::uint64_t value) {
+#if defined(__GNUC__)
+			return 63 - static_cast<size_t>(__builtin_clzll(value));
+#else
+			size_t e = 0;
+			while (value >>= 1)
+				e++;
+			return e;
+#endif
+		}
+
+		friend class server_metrics;
+		std::uint64_t m_counts[bucket_count] = {};
+		std::uint64_t m_sum = 0;
+	};
+
+	/// Failures counted by server_metrics
+	enum class server_error : size_t {
+		/// A connection could not be accepted
+		accept,
+		/// Malformed request head or body framing
+		bad_request,
+		/// No handler for the method and path
+		not_found,
+		/// A handler threw
+		handler,
+		/// Reading from the client failed, other than by the client closing the connection
+		read,
+		/// Writing the response failed
+		write,
+		/// The connection was closed by a request, content or send timeout
+		timeout,
+		/// A request was answered with 503 because of Config::shed_queue_delay
+		shed,
+		count
+	};
+
+	inline const char *error_name(server_error error) {
+		static const char *names[] = { "accept", "bad_request", "not_found", "handler", "read", "write", "timeout", "shed" };
+		return names[static_cast<size_t>(error)];
+	}
+
+	/// Phases of a request that are timed per route
+	enum class request_phase : size_t {
+		/// From the complete head having been received to the route having been found
+		parse,
+		/// From calling the handler to the handler, and whoever it passed the response to, releasing the response
+		handler,
+		/// From then to the response having been written
+		write,
+		count
+	};
+
+	inline const char *phase_name(request_phase phase) {
+		static const char *names[] = { "parse", "handler", "write" };
+		return names[static_cast<size_t>(phase)];
+	}
+
+	/// Metrics of a server merged over all threads, see server_metrics::snapshot()
+	struct metrics_snapshot {
+		std::uint64_t connections_accepted = 0;
+		std::uint64_t connections_closed = 0;
+		std::uint64_t requests = 0;
+		std::uint64_t bytes_received = 0;
+		std::uint64_t bytes_sent = 0;
+		std::uint64_t errors[static_cast<size_t>(server_error::count)] = {};
+
+		struct route {
+			std::string method;
+			/// Path pattern as registered, empty for the default resource of the method
+			std::string path;
+			latency_histogram phases[static_cast<size_t>(request_phase::count)];
+
+			const latency_histogram &phase(request_phase p) const { return phases[static_cast<size_t>(p)]; }
+		};
+		/// Routes that received requests
+		std::vector<route> routes;
+
+		std::uint64_t connections_active() const { return connections_accepted - connections_closed; }
+		std::uint64_t error(server_error e) const { return errors[static_cast<size_t>(e)]; }
+
+		/// Returns the metrics in the Prometheus text exposition format
+		std::string prometheus() const {
+			std::string out;
+			counter(out, "webpp_connections_accepted_total", "Connections accepted.", connections_accepted);
+			out += "# HELP webpp_connections_active Connections open.\n# TYPE webpp_connections_active gauge\n";
+			out += "webpp_connections_active " + std::to_string(connections_active()) + "\n";
+			counter(out, "webpp_requests_total", "Requests received.", requests);
+			counter(out, "webpp_received_bytes_total", "Bytes received from clients.", bytes_received);
+			counter(out, "webpp_sent_bytes_total", "Bytes sent to clients.", bytes_sent);
+
+			out += "# HELP webpp_errors_total Failed connections and requests by kind.\n# TYPE webpp_errors_total counter\n";
+			for (size_t c = 0; c < static_cast<size_t>(server_error::count); c++)
+				out += std::string("webpp_errors_total{kind=\"") + error_name(static_cast<server_error>(c)) + "\"} " + std::to_string(errors[c]) + "\n";
+
+			//Prometheus buckets are coarser than the histogram's, a value counts towards the first le above its bucket
+			static const std::pair<const char*, std::uint64_t> limits[] = {
+				{ "1e-05", 10000 }, { "2.5e-05", 25000 }, { "5e-05", 50000 }, { "0.0001", 100000 }, { "0.00025", 250000 },
+				{ "0.0005", 500000 }, { "0.001", 1000000 }, { "0.0025", 2500000 }, { "0.005", 5000000 }, { "0.01", 10000000 },
+				{ "0.025", 25000000 }, { "0.05", 50000000 }, { "0.1", 100000000 }, { "0.25", 250000000 }, { "0.5", 500000000 },
+				{ "1", 1000000000 }, { "2.5", 2500000000ull }, { "5", 5000000000ull }, { "10", 10000000000ull } };
+			out += "# HELP webpp_request_duration_seconds Duration of the phases of requests by route.\n"
+				"# TYPE webpp_request_duration_seconds histogram\n";
+			for (auto &r : routes) {
+				for (size_t p = 0; p < static_cast<size_t>(request_phase::count); p++) {
+					auto &histogram = r.phases[p];
+					auto labels = "webpp_request_duration_seconds_bucket{method=\"" + escape(r.method) + "\",route=\"" +
+						(r.path.empty() ? std::string("default") : escape(r.path)) + "\",phase=\"" + phase_name(static_cast<request_phase>(p)) + "\"";
+					std::uint64_t cumulative = 0;
+					size_t bucket = 0;
+					for (auto &limit : limits) {
+						for (; bucket < latency_histogram::bucket_count - 1 && latency_histogram::upper_bound(bucket) < limit.second; bucket++)
+							cumulative += histogram.bucket_value(bucket);
+						out += labels + ",le=\"" + limit.first + "\"} " + std::to_string(cumulative) + "\n";
+					}
+					auto total = histogram.count();
+					out += labels + ",le=\"+Inf\"} " + std::to_string(total) + "\n";
+					//The series of _sum and _count have the labels without le, and their own names
+					auto series = labels.substr(std::string("webpp_request_duration_seconds_bucket").size());
+					char sum[32];
+					std::snprintf(sum, sizeof(sum), "%.9g", static_cast<double>(histogram.sum()) / 1e9);
+					out += "webpp_request_duration_seconds_sum" + series + "} " + sum + "\n";
+					out += "webpp_request_duration_seconds_count" + series + "} " + std::to_string(total) + "\n";
+				}
+			}
+			return out;
+		}
+	private:
+		static void counter(std::string &out, const char *name, const char *help, std::uint64_t value) {
+			out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " counter\n" + name + " " + std::to_string(value) + "\n";
+		}
+
+		static std::string escape(const std::string &value) {
+			std::string result;
+			for (auto c : value) {
+				if (c == '\\' || c == '"')
+					result += '\\';
+				if (c == '\n')
+					result += "\\n";
+				else
+					result += c;
+			}
+			return result;
+		}
+	};
+
+	/// Counters and per route latency histograms of a server.
+	///
+	/// Each thread records into a shard of its own without locking or atomic read-modify-write operations;
+	/// snapshot() merges the shards. Memory is taken on first use only, for a thread's shard and for each route
+	/// that thread serves, so recording allocates nothing once the server is warm.
+	class server_metrics {
+	public:
+		using clock = std::chrono::steady_clock;
+		/// Routes beyond this number share the last identifier
+		static const size_t max_routes = 1024;
+
+		server_metrics() : m_serial(next_serial()) {}
+		server_metrics(const server_metrics&) = delete;
+		server_metrics &operator=(const server_metrics&) = delete;
+
+		/// Returns the identifier of the route of method and path pattern, an empty path standing for the default
+		/// resource of the method. Identifiers stay the same when a route is registered again.
+		size_t route_id(const std::string &method, const std::string &path) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			auto key = std::make_pair(method, path);
+			auto found = m_route_ids.find(key);
+			if (found != m_route_ids.end())
+				return found->second;
+			if (m_routes.size() == max_routes)
+				return max_routes - 1;
+			m_routes.push_back(key);
+			return m_route_ids[key] = m_routes.size() - 1;
+		}
+
+		void connection_accepted() { add(local().connections_accepted, 1); }
+		void connection_closed() { add(local().connections_closed, 1); }
+		void received(size_t bytes) { add(local().bytes_received, bytes); }
+		void sent(size_t bytes) { add(local().bytes_sent, bytes); }
+		void error(server_error e) { add(local().errors[static_cast<size_t>(e)], 1); }
+
+		/// Counts a request of route with the duration of each phase
+		void request(size_t route, clock::duration parse, clock::duration handler, clock::duration write) {
+			auto &shard = local();
+			add(shard.requests, 1);
+			auto &slot = shard.routes[route];
+			auto stats = slot.load(std::memory_order_relaxed);
+			if (!stats) {
+				stats = new route_stats();
+				slot.store(stats, std::memory_order_release);
+			}
+			stats->phases[static_cast<size_t>(request_phase::parse)].record(parse);
+			stats->phases[static_cast<size_t>(request_phase::handler)].record(handler);
+			stats->phases[static_cast<size_t>(request_phase::write)].record(write);
+		}
+
+		/// Returns the metrics merged over all threads. Recording goes on meanwhile, so the counters of a
+		/// snapshot need not match each other exactly.
+		metrics_snapshot snapshot() const {
+			metrics_snapshot result;
+			std::lock_guard<std::mutex> lock(m_mutex);
+			std::vector<latency_histogram> merged(m_routes.size() * static_cast<size_t>(request_phase::count));
+			for (auto &shard : m_shards) {
+				result.connections_accepted += shard->connections_accepted.load(std::memory_order_relaxed);
+				result.connections_closed += shard->connections_closed.load(std::memory_order_relaxed);
+				result.requests += shard->requests.load(std::memory_order_relaxed);
+				result.bytes_received += shard->bytes_received.load(std::memory_order_relaxed);
+				result.bytes_sent += shard->bytes_sent.load(std::memory_order_relaxed);
+				for (size_t c = 0; c < static_cast<size_t>(server_error::count); c++)
+					result.errors[c] += shard->errors[c].load(std::memory_order_relaxed);
+				for (size_t r = 0; r < m_routes.size(); r++) {
+					auto stats = shard->routes[r].load(std::memory_order_acquire);
+					if (!stats)
+						continue;
+					for (size_t p = 0; p < static_cast<size_t>(request_phase::count); p++)
+						stats->phases[p].read_into(merged[r * static_cast<size_t>(request_phase::count) + p]);
+				}
+			}
+			for (size_t r = 0; r < m_routes.size(); r++) {
+				auto phases = &merged[r * static_cast<size_t>(request_phase::count)];
+				if (phases[0].count() == 0)
+					continue;
+				metrics_snapshot::route route;
+				route.method = m_routes[r].first;
+				route.path = m_routes[r].second;
+				std::copy(phases, phases + static_cast<size_t>(request_phase::count), route.phases);
+				result.routes.push_back(std::move(route));
+			}
+			return result;
+		}
+	private:
+		/// Only the owning thread writes, so plain loads and stores suffice; they are atomic for snapshot()
+		using counter = std::atomic<std::uint64_t>;
+		static void add(counter &c, std::uint64_t n) {
+			c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+		}
+
+		struct shared_histogram {
+			shared_histogram() {
+				for (auto &count : counts)
+					count.store(0, std::memory_order_relaxed);
+				sum.store(0, std::memory_order_relaxed);
+			}
+			void record(clock::duration duration) {
+				auto ns = static_cast<std::uint64_t>(std::max<clock::rep>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count()));
+				add(counts[latency_histogram::bucket(ns)], 1);
+				add(sum, ns);
+			}
+			void read_into(latency_histogram &histogram) const {
+				for (size_t c = 0; c < latency_histogram::bucket_count; c++)
+					histogram.m_counts[c] += counts[c].load(std::memory_order_relaxed);
+				histogram.m_sum += sum.load(std::memory_order_relaxed);
+			}
+			counter counts[latency_histogram::bucket_count];
+			counter sum;
+		};
+
+		struct route_stats {
+			shared_histogram phases[static_cast<size_t>(request_phase::count)];
+		};
+
+		/// Counters of one thread, allocated separately from those of other threads
+		struct shard {
+			shard() {
+				for (auto c : { &connections_accepted, &connections_closed, &requests, &bytes_received, &bytes_sent })
+					c->store(0, std::memory_order_relaxed);
+				for (auto &e : errors)
+					e.store(0, std::memory_order_relaxed);
+				for (auto &route : routes)
+					route.store(nullptr, std::memory_order_relaxed);
+			}
+			~shard() {
+				for (auto &route : routes)
+					delete route.load(std::memory_order_relaxed);
+			}
+			counter connections_accepted;
+			counter connections_closed;
+			counter requests;
+			counter bytes_received;
+			counter bytes_sent;
+			counter errors[static_cast<size_t>(server_error::count)];
+			std::atomic<route_stats*> routes[max_routes];
+			/// The thread recording into the shard
+			std::thread::id thread;
+		};
+
+		static std::uint64_t next_serial() {
+			static std::atomic<std::uint64_t> serial{0};
+			return ++serial;
+		}
+
+		/// Returns the calling thread's shard. Threads remember the shards of the last few instances they recorded
+		/// into, by serial number so that a new instance at the address of a destroyed one is not mistaken for it.
+		/// A thread that recorded into more instances than that finds its shard again by thread id, so that each
+		/// thread has one shard per instance however many instances it records into.
+		shard &local() {
+			struct entry { std::uint64_t serial; shard *local; };
+			static thread_local entry cache[4] = {};
+			static thread_local size_t next = 0;
+			for (auto &e : cache) {
+				if (e.serial == m_serial)
+					return *e.local;
+			}
+			shard *found = nullptr;
+			{
+				auto id = std::this_thread::get_id();
+				std::lock_guard<std::mutex> lock(m_mutex);
+				for (auto &s : m_shards) {
+					if (s->thread == id) {
+						found = s.get();
+						break;
+					}
+				}
+				if (!found) {
+					found = new shard();
+					found->thread = id;
+					m_shards.emplace_back(found);
+				}
+			}
+			cache[next] = { m_serial, found };
+			next = (next + 1) % 4;
+			return *found;
+		}
+
+		const std::uint64_t m_serial;
+		mutable std::mutex m_mutex;
+		std::vector<std::unique_ptr<shard>> m_shards;
+		std::vector<std::pair<std::string, std::string>> m_routes;
+		std::map<std::pair<std::string, std::string>, size_t> m_route_ids;
+	};
+}
+
+#endif  /* METRICS_HPP */
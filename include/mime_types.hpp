@@ -0,0 +1,133 @@
+// license:MIT
+// copyright-holders:Miodrag Milanovic
+#ifndef MIME_TYPES_HPP
+#define MIME_TYPES_HPP
+
+#include "http_parser.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <iterator>
+
+namespace webpp {
+	namespace mime_detail {
+		struct mapping {
+			const char *extension;
+			const char *mime_type;
+		};
+
+		/// Sorted by extension for binary search
+		constexpr mapping mappings[] = {
+			{ "aac",     "audio/aac" },
+			{ "aat",     "application/font-sfnt" },
+			{ "aif",     "audio/x-aif" },
+			{ "arj",     "application/x-arj-compressed" },
+			{ "asf",     "video/x-ms-asf" },
+			{ "avi",     "video/x-msvideo" },
+			{ "bmp",     "image/bmp" },
+			{ "cff",     "application/font-sfnt" },
+			{ "css",     "text/css" },
+			{ "csv",     "text/csv" },
+			{ "doc",     "application/msword" },
+			{ "eps",     "application/postscript" },
+			{ "exe",     "application/octet-stream" },
+			{ "gif",     "image/gif" },
+			{ "gz",      "application/x-gunzip" },
+			{ "htm",     "text/html" },
+			{ "html",    "text/html" },
+			{ "ico",     "image/x-icon" },
+			{ "ief",     "image/ief" },
+			{ "jpeg",    "image/jpeg" },
+			{ "jpg",     "image/jpeg" },
+			{ "jpm",     "image/jpm" },
+			{ "jpx",     "image/jpx" },
+			{ "js",      "application/javascript" },
+			{ "json",    "application/json" },
+			{ "m3u",     "audio/x-mpegurl" },
+			{ "m4v",     "video/x-m4v" },
+			{ "mid",     "audio/x-midi" },
+			{ "mjs",     "application/javascript" },
+			{ "mov",     "video/quicktime" },
+			{ "mp3",     "audio/mpeg" },
+			{ "mp4",     "video/mp4" },
+			{ "mpeg",    "video/mpeg" },
+			{ "mpg",     "video/mpeg" },
+			{ "oga",     "audio/ogg" },
+			{ "ogg",     "audio/ogg" },
+			{ "ogv",     "video/ogg" },
+			{ "otf",     "application/font-sfnt" },
+			{ "pct",     "image/x-pct" },
+			{ "pdf",     "application/pdf" },
+			{ "pfr",     "application/font-tdpfr" },
+			{ "pict",    "image/pict" },
+			{ "png",     "image/png" },
+			{ "ppt",     "application/x-mspowerpoint" },
+			{ "ps",      "application/postscript" },
+			{ "qt",      "video/quicktime" },
+			{ "ra",      "audio/x-pn-realaudio" },
+			{ "ram",     "audio/x-pn-realaudio" },
+			{ "rar",     "application/x-arj-compressed" },
+			{ "rgb",     "image/x-rgb" },
+			{ "rtf",     "application/rtf" },
+			{ "sgm",     "text/sgml" },
+			{ "shtm",    "text/html" },
+			{ "shtml",   "text/html" },
+			{ "sil",     "application/font-sfnt" },
+			{ "svg",     "image/svg+xml" },
+			{ "swf",     "application/x-shockwave-flash" },
+			{ "tar",     "application/x-tar" },
+			{ "tgz",     "application/x-tar-gz" },
+			{ "tif",     "image/tiff" },
+			{ "tiff",    "image/tiff" },
+			{ "torrent", "application/x-bittorrent" },
+			{ "ttf",     "application/font-sfnt" },
+			{ "txt",     "text/plain" },
+			{ "wasm",    "application/wasm" },
+			{ "wav",     "audio/x-wav" },
+			{ "webm",    "video/webm" },
+			{ "webp",    "image/webp" },
+			{ "woff",    "application/font-woff" },
+			{ "woff2",   "font/woff2" },
+			{ "wrl",     "model/vrml" },
+			{ "xhtml",   "application/xhtml+xml" },
+			{ "xls",     "application/x-msexcel" },
+			{ "xml",     "text/xml" },
+			{ "xsl",     "application/xml" },
+			{ "xslt",    "application/xml" },
+			{ "zip",     "application/x-zip-compressed" }
+		};
+	}
+
+	/// Returns the MIME type for a file extension (without the dot, in any case), or "text/plain" for unknown ones.
+	inline const char *extension_to_type(const string_ref &extension) {
+		char lower[8];
+		if (extension.empty() || extension.size() >= sizeof(lower))
+			return "text/plain";
+		for (size_t c = 0; c < extension.size(); c++)
+			lower[c] = static_cast<char>(std::tolower(static_cast<unsigned char>(extension[c])));
+		lower[extension.size()] = '\0';
+
+		auto first = std::begin(mime_detail::mappings);
+		auto last = std::end(mime_detail::mappings);
+		auto it = std::lower_bound(first, last, lower, [](const mime_detail::mapping &m, const char *key) {
+			return std::strcmp(m.extension, key) < 0;
+		});
+		if (it != last && std::strcmp(it->extension, lower) == 0)
+			return it->mime_type;
+		return "text/plain";
+	}
+
+	/// Returns the MIME type for the extension of a file path.
+	inline const char *path_to_type(const string_ref &path) {
+		auto end = path.end();
+		auto pos = end;
+		while (pos != path.begin() && pos[-1] != '.' && pos[-1] != '/')
+			--pos;
+		if (pos == path.begin() || pos[-1] != '.')
+			return "text/plain";
+		return extension_to_type(string_ref(pos, static_cast<size_t>(end - pos)));
+	}
+}
+
+#endif  /* MIME_TYPES_HPP */
@@ -0,0 +1,107 @@
+// license:MIT
+// copyright-holders:Miodrag Milanovic
+#ifndef QUEUE_MONITOR_HPP
+#define QUEUE_MONITOR_HPP
+
+#include "asio.h"
+#include "asio/steady_timer.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+
+namespace webpp {
+	/// Measures how long handlers that are ready to run wait for a thread of an io_context, one per io_context
+	/// (see get()).
+	///
+	/// While in use, a probe timer expires every probe_interval(); the time its handler waits after expiring is the
+	/// time any other handler waits, such as the one completing the read of a request. delay() is the smallest wait
+	/// over the last window() so that a short burst does not count, only a standing queue does.
+	class queue_monitor : public std::enable_shared_from_this<queue_monitor> {
+	public:
+		using clock = std::chrono::steady_clock;
+
+		explicit queue_monitor(asio::io_context &io_context) : m_timer(new asio::steady_timer(io_context)) {}
+		queue_monitor(const queue_monitor&) = delete;
+		queue_monitor &operator=(const queue_monitor&) = delete;
+
+		/// Returns the monitor of io_context, creating it on first use.
+		static std::shared_ptr<queue_monitor> get(asio::io_context &io_context) {
+			return asio::use_service<service>(io_context).monitor();
+		}
+
+		static clock::duration probe_interval() { return std::chrono::milliseconds(10); }
+		static clock::duration window() { return std::chrono::milliseconds(100); }
+
+		/// Starts probing, for each user until it calls release()
+		void acquire() {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_users++ == 0 && !m_waiting && m_timer) {
+				m_window_end = clock::now() + window();
+				m_window_min = clock::duration::max();
+				schedule();
+			}
+		}
+
+		void release() {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_users > 0 && --m_users == 0)
+				m_delay = 0;
+		}
+
+		/// Queueing delay of the last completed window, zero while not in use
+		clock::duration delay() const { return clock::duration(m_delay.load(std::memory_order_relaxed)); }
+	private:
+		/// Owns the monitor on behalf of the io_context and stops it when the io_context shuts down
+		class service : public asio::detail::service_base<service> {
+		public:
+			explicit service(asio::io_context &io_context) : asio::detail::service_base<service>(io_context),
+				m_monitor(std::make_shared<queue_monitor>(io_context)) {}
+			const std::shared_ptr<queue_monitor> &monitor() const { return m_monitor; }
+		private:
+			void shutdown() override {
+				std::lock_guard<std::mutex> lock(m_monitor->m_mutex);
+				m_monitor->m_timer.reset();
+			}
+			std::shared_ptr<queue_monitor> m_monitor;
+		};
+
+		/// Called with the lock held
+		void schedule() {
+			m_waiting = true;
+			auto self = shared_from_this();
+			m_timer->expires_after(probe_interval());
+			m_timer->async_wait([self](const std::error_code &ec) {
+				self->on_probe(ec);
+			});
+		}
+
+		void on_probe(const std::error_code &ec) {
+			auto now = clock::now();
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_waiting = false;
+			if (ec || !m_timer || m_users == 0)
+				return;
+			m_window_min = std::min(m_window_min, std::max(now - m_timer->expiry(), clock::duration(0)));
+			if (now >= m_window_end) {
+				m_delay = m_window_min.count();
+				m_window_min = clock::duration::max();
+				m_window_end = now + window();
+			}
+			schedule();
+		}
+
+		std::mutex m_mutex;
+		/// Reset when the io_context shuts down, after which the monitor no longer probes
+		std::unique_ptr<asio::steady_timer> m_timer;
+		size_t m_users = 0;
+		bool m_waiting = false;
+		clock::time_point m_window_end;
+		clock::duration m_window_min;
+		std::atomic<clock::rep> m_delay{0};
+	};
+}
+
+#endif  /* QUEUE_MONITOR_HPP */
@@ -0,0 +1,383 @@
+// license:MIT
+// copyright-holders:Miodrag Milanovic
+#ifndef ROUTE_TREE_HPP
+#define ROUTE_TREE_HPP
+
+#include "path_to_regex.hpp"
+#include "http_parser.hpp"
+#include "simd_scan.hpp"
+
+#include <map>
+#include <memory>
+#include <regex>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cctype>
+
+namespace webpp {
+	/// Routes compiled from path2regex patterns into a radix tree.
+	///
+	/// Static text, ":param" segments, ":param(pattern)" segments whose pattern cannot match '/' and a trailing
+	/// "*" are matched structurally while walking the path once. Only patterns that cannot be expressed this way
+	/// (optional or repeated parameters, parameters not followed by '/', static text with regex characters, ...)
+	/// fall back to std::regex. Matching follows path_to_regex() with its default options (case-insensitive,
+	/// optional trailing slash), and when several routes match, the route whose pattern string sorts first wins,
+	/// as it did when the routes were tried in std::map order.
+	template <class Value>
+	class route_tree {
+		struct element {
+			enum kind_type { text, segment, wildcard };
+			kind_type kind;
+			/// Lower-cased static text, or the custom pattern of a segment (empty for the default [^/]+?)
+			std::string str;
+			std::shared_ptr<const std::regex> regex;
+		};
+
+	public:
+		class route {
+			friend class route_tree<Value>;
+		public:
+			const std::string &pattern() const { return m_pattern; }
+			Value value;
+		private:
+			std::string m_pattern;
+			std::vector<element> m_program;
+			/// Set for routes that are not matched structurally
+			std::shared_ptr<const std::regex> m_regex;
+		};
+
+		route_tree() {}
+		route_tree(const route_tree &other) : m_routes(other.m_routes) { rebuild(); }
+		route_tree &operator=(const route_tree &other) {
+			if (this != &other) {
+				m_routes = other.m_routes;
+				rebuild();
+			}
+			return *this;
+		}
+
+		/// Returns the value of the route for pattern, adding the route if needed.
+		Value &operator[](const std::string &pattern) {
+			auto it = m_routes.find(pattern);
+			if (it == m_routes.end()) {
+				it = m_routes.emplace(pattern, route()).first;
+				compile(pattern, it->second);
+				insert(it->second);
+			}
+			return it->second.value;
+		}
+
+		/// Removes the route for pattern. Returns false if there was none.
+		bool erase(const std::string &pattern) {
+			if (m_routes.erase(pattern) == 0)
+				return false;
+			rebuild();
+			return true;
+		}
+
+		size_t size() const { return m_routes.size(); }
+		bool empty() const { return m_routes.empty(); }
+
+		/// Finds the first route, in pattern order, matching path and whose value satisfies accept.
+		/// On success, captures holds one reference into path per parameter of the route.
+		template <class Accept>
+		const route *match(const std::string &path, std::vector<string_ref> &captures, Accept &&accept) const {
+			match_state<Accept> state{path.data() + path.size(), accept, nullptr, captures, {}, 0};
+			visit(m_root, path.data(), state);
+
+			//Routes that could not be compiled only need to be tried while they sort before the best match so far
+			for (auto route : m_regex_routes) {
+				if (state.best && !(route->m_pattern < state.best->m_pattern))
+					break;
+				if (!accept(route->value))
+					continue;
+				std::smatch sm_res;
+				if (std::regex_match(path, sm_res, *route->m_regex)) {
+					state.best = route;
+					captures.clear();
+					for (size_t c = 1; c < sm_res.size(); c++)
+						captures.emplace_back(path.data() + sm_res.position(c), static_cast<size_t>(sm_res.length(c)));
+					break;
+				}
+			}
+			return state.best;
+		}
+
+	private:
+		/// Routes with more parameters are matched with std::regex
+		static const size_t max_params = 16;
+
+		struct node;
+
+		struct param_edge {
+			std::string pattern;
+			std::shared_ptr<const std::regex> regex;
+			std::unique_ptr<node> child;
+		};
+
+		struct node {
+			/// Lower-cased static text consumed when entering the node
+			std::string label;
+			/// At most one child per first character
+			std::vector<std::unique_ptr<node>> statics;
+			std::vector<param_edge> params;
+			/// Routes ending with a wildcard at this node
+			std::vector<const route*> wildcards;
+			/// Routes ending at this node
+			std::vector<const route*> routes;
+		};
+
+		template <class Accept>
+		struct match_state {
+			const char *end;
+			Accept &accept;
+			const route *best;
+			std::vector<string_ref> &captures;
+			string_ref stack[max_params];
+			size_t depth;
+
+			void consider(const route *candidate) {
+				if ((!best || candidate->m_pattern < best->m_pattern) && accept(candidate->value)) {
+					best = candidate;
+					captures.assign(stack, stack + depth);
+				}
+			}
+		};
+
+		std::map<std::string, route> m_routes;
+		node m_root;
+		/// Routes matched with std::regex, in pattern order
+		std::vector<const route*> m_regex_routes;
+
+		static char lower(char c) {
+			return static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+		}
+
+		template <class State>
+		static void visit(const node &current, const char *pos, State &state) {
+			auto end = state.end;
+			//A trailing slash is optional
+			if (pos == end || (pos + 1 == end && *pos == '/')) {
+				for (auto route : current.routes)
+					state.consider(route);
+			}
+
+			if (pos != end) {
+				auto first = lower(*pos);
+				for (auto &child : current.statics) {
+					if (child->label[0] != first)
+						continue;
+					auto &label = child->label;
+					if (static_cast<size_t>(end - pos) >= label.size()) {
+						size_t c = 1;
+						while (c < label.size() && lower(pos[c]) == label[c])
+							c++;
+						if (c == label.size())
+							visit(*child, pos + label.size(), state);
+					}
+					break;
+				}
+			}
+
+			if (!current.params.empty()) {
+				auto segment_end = scan_for(pos, end, '/');
+				for (auto &edge : current.params) {
+					if (edge.regex ? std::regex_match(pos, segment_end, *edge.regex) : segment_end != pos) {
+						state.stack[state.depth++] = string_ref(pos, static_cast<size_t>(segment_end - pos));
+						visit(*edge.child, segment_end, state);
+						state.depth--;
+					}
+				}
+			}
+
+			if (!current.wildcards.empty() && scan_for_any(pos, end, '\r', '\n') == end) {
+				state.stack[state.depth++] = string_ref(pos, static_cast<size_t>(end - pos));
+				for (auto route : current.wildcards)
+					state.consider(route);
+				state.depth--;
+			}
+		}
+
+		static bool is_plain_text(const std::string &str) {
+			return str.find_first_of(".^$|?*+()[]{}\\") == std::string::npos;
+		}
+
+		/// Returns true if pattern can only match characters other than '/' and has no capturing groups
+		static bool is_segment_pattern(const std::string &pattern) {
+			auto escape_ok = [](char c) {
+				return c == 'd' || c == 'w' || c == 's' || (std::ispunct(static_cast<unsigned char>(c)) && c != '/');
+			};
+			bool in_class = false;
+			for (size_t c = 0; c < pattern.size(); c++) {
+				char ch = pattern[c];
+				if (!std::isprint(static_cast<unsigned char>(ch)) || ch == '/')
+					return false;
+				if (ch == '\\') {
+					if (++c == pattern.size() || !escape_ok(pattern[c]))
+						return false;
+				}
+				else if (in_class) {
+					if (ch == ']')
+						in_class = false;
+					else if (ch == '-' && pattern[c - 1] != '[' && c + 1 < pattern.size() && pattern[c + 1] != ']') {
+						//Only ranges such as a-z or 0-9, which cannot include '/'
+						if (!std::isalnum(static_cast<unsigned char>(pattern[c - 1])) || !std::isalnum(static_cast<unsigned char>(pattern[c + 1])))
+							return false;
+					}
+				}
+				else if (ch == '[') {
+					if (c + 1 < pattern.size() && pattern[c + 1] == '^')
+						return false;
+					in_class = true;
+				}
+				else if (ch == '(') {
+					if (pattern.compare(c, 3, "(?:") != 0)
+						return false;
+					c += 2;
+				}
+				else if (ch == '.' || ch == '^' || ch == '$')
+					return false;
+			}
+			return !in_class;
+		}
+
+		static void add_text(std::vector<element> &program, const std::string &str) {
+			if (str.empty())
+				return;
+			std::string text;
+			for (auto c : str)
+				text += lower(c);
+			if (!program.empty() && program.back().kind == element::text)
+				program.back().str += text;
+			else
+				program.push_back(element{element::text, text, nullptr});
+		}
+
+		/// Compiles pattern into a program of elements, or into a regex if it cannot be matched structurally
+		static void compile(const std::string &pattern, route &result) {
+			result.m_pattern = pattern;
+			result.m_program.clear();
+			result.m_regex = nullptr;
+
+			auto tokens = path2regex::parse(pattern);
+			//Non-strict mode ignores a trailing slash of the pattern
+			if (!tokens.empty() && tokens.back().is_string && !tokens.back().name.empty() && tokens.back().name.back() == '/')
+				tokens.back().name.pop_back();
+
+			bool structural = !tokens.empty() && std::count_if(tokens.begin(), tokens.end(), [](const path2regex::Token &token) { return !token.is_string; }) <= static_cast<std::ptrdiff_t>(max_params);
+			for (size_t c = 0; c < tokens.size() && structural; c++) {
+				auto &token = tokens[c];
+				if (token.is_string) {
+					structural = is_plain_text(token.name);
+					add_text(result.m_program, token.name);
+					continue;
+				}
+
+				structural = !token.optional && !token.repeat && !token.partial && (token.prefix.empty() || token.prefix == "/");
+				if (!structural)
+					break;
+				add_text(result.m_program, token.prefix);
+
+				if (token.asterisk) {
+					//Only a trailing wildcard is unambiguous
+					structural = c + 1 == tokens.size();
+					result.m_program.push_back(element{element::wildcard, std::string(), nullptr});
+					continue;
+				}
+
+				//The segment must be followed by '/' or the end of the path, so that it ends at the next '/'
+				if (c + 1 < tokens.size()) {
+					auto &next = tokens[c + 1];
+					if (next.is_string ? (!next.name.empty() && next.name[0] != '/') : next.prefix != "/") {
+						structural = false;
+						break;
+					}
+				}
+				if (token.pattern == "[^/]+?")
+					result.m_program.push_back(element{element::segment, std::string(), nullptr});
+				else if (is_segment_pattern(token.pattern)) {
+					auto regex = std::make_shared<const std::regex>(token.pattern, std::regex_constants::ECMAScript | std::regex_constants::icase);
+					result.m_program.push_back(element{element::segment, token.pattern, regex});
+				}
+				else
+					structural = false;
+			}
+
+			if (!structural) {
+				result.m_program.clear();
+				result.m_regex = std::make_shared<const std::regex>(path2regex::path_to_regex(pattern));
+			}
+		}
+
+		static node *insert_text(node *current, const std::string &text) {
+			size_t pos = 0;
+			while (pos < text.size()) {
+				auto it = current->statics.begin();
+				while (it != current->statics.end() && (*it)->label[0] != text[pos])
+					++it;
+				if (it == current->statics.end()) {
+					current->statics.emplace_back(new node());
+					current->statics.back()->label = text.substr(pos);
+					return current->statics.back().get();
+				}
+
+				auto &label = (*it)->label;
+				size_t common = 0;
+				while (common < label.size() && pos + common < text.size() && label[common] == text[pos + common])
+					common++;
+				if (common < label.size()) {
+					//Split the edge at the end of the common prefix
+					std::unique_ptr<node> middle(new node());
+					middle->label = label.substr(0, common);
+					label.erase(0, common);
+					middle->statics.emplace_back(std::move(*it));
+					*it = std::move(middle);
+				}
+				current = it->get();
+				pos += common;
+			}
+			return current;
+		}
+
+		void insert(const route &new_route) {
+			if (new_route.m_regex) {
+				auto it = m_regex_routes.begin();
+				while (it != m_regex_routes.end() && (*it)->m_pattern < new_route.m_pattern)
+					++it;
+				m_regex_routes.insert(it, &new_route);
+				return;
+			}
+
+			node *current = &m_root;
+			for (auto &element : new_route.m_program) {
+				if (element.kind == element::text)
+					current = insert_text(current, element.str);
+				else if (element.kind == element::wildcard) {
+					current->wildcards.push_back(&new_route);
+					return;
+				}
+				else {
+					auto it = current->params.begin();
+					while (it != current->params.end() && it->pattern != element.str)
+						++it;
+					if (it == current->params.end()) {
+						current->params.push_back(param_edge{element.str, element.regex, std::unique_ptr<node>(new node())});
+						it = current->params.end() - 1;
+					}
+					current = it->child.get();
+				}
+			}
+			current->routes.push_back(&new_route);
+		}
+
+		void rebuild() {
+			m_root = node();
+			m_regex_routes.clear();
+			for (auto &pair : m_routes)
+				insert(pair.second);
+		}
+	};
+}
+
+#endif  /* ROUTE_TREE_HPP */
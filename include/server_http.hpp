@@ -8,16 +8,36 @@
 #endif
 
 #include "asio.h"
-#include "asio/system_timer.hpp"
 #include "path_to_regex.hpp"
+#include "http_parser.hpp"
+#include "http_fragments.hpp"
+#include "route_tree.hpp"
+#include "arena.hpp"
+#include "timer_wheel.hpp"
+#include "file_cache.hpp"
+#include "compression.hpp"
+#include "queue_monitor.hpp"
+#include "metrics.hpp"
 
+#include <cstdlib>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
 #include <unordered_map>
 #include <thread>
 #include <functional>
 #include <iostream>
 #include <sstream>
 #include <regex>
+#include <type_traits>
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
 
 #ifndef CASE_INSENSITIVE_EQUALS_AND_HASH
 #define CASE_INSENSITIVE_EQUALS_AND_HASH
@@ -43,11 +63,28 @@ public:
 };
 #endif
 namespace webpp {
+	/// Returns the listening socket passed by systemd socket activation (LISTEN_FDS and LISTEN_PID), or -1 if there is
+	/// none, for Config::listen_fd. A parent process handing its socket over to a new binary can pass it the same way,
+	/// as file descriptor 3 with LISTEN_FDS=1 and LISTEN_PID set to the pid of the new process.
+	inline int inherited_listen_fd() {
+#if defined(_WIN32)
+		return -1;
+#else
+		auto pid = std::getenv("LISTEN_PID");
+		auto fds = std::getenv("LISTEN_FDS");
+		if (!pid || !fds || std::strtol(pid, nullptr, 10) != static_cast<long>(::getpid()) || std::strtol(fds, nullptr, 10) < 1)
+			return -1;
+		return 3;
+#endif
+	}
+
 	template <class socket_type>
 	class Server;
 
 	template <class socket_type>
 	class ServerBase {
+	protected:
+		class Connection;
 	public:
 		virtual ~ServerBase() {}
 
@@ -57,37 +94,476 @@ namespace webpp {
 			asio::streambuf m_streambuf;
 
 			std::shared_ptr<socket_type> m_socket;
+			asio::io_context::strand &m_strand;
+			/// The connection the response belongs to, for the timeouts of long writes
+			std::weak_ptr<Connection> m_connection;
 			std::ostream m_ostream;
-			std::stringstream m_header;
-			explicit Response(const std::shared_ptr<socket_type> &socket) : m_socket(socket), m_ostream(&m_streambuf) {}
+			std::string m_header;
+			/// Pre-rendered header lines added by type() and for compression
+			std::vector<string_ref> m_header_lines;
+			/// Answer with HTTP/1.1 status lines, set from the request
+			bool m_http11 = true;
+			/// Add "Connection: keep-alive", for HTTP/1.0 requests asking for it
+			bool m_keep_alive = false;
+			/// Add "Connection: close", for responses to requests received while the server drains
+			bool m_close = false;
+			/// Set by begin_chunked() until end_chunked()
+			bool m_chunked = false;
 
-			static std::string statusToString(int status)
-			{
-				switch (status) {
-					default:
-					case 200: return "HTTP/1.0 200 OK\r\n";
-					case 201: return "HTTP/1.0 201 Created\r\n";
-					case 202: return "HTTP/1.0 202 Accepted\r\n";
-					case 204: return "HTTP/1.0 204 No Content\r\n";
-					case 300: return "HTTP/1.0 300 Multiple Choices\r\n";
-					case 301: return "HTTP/1.0 301 Moved Permanently\r\n";
-					case 302: return "HTTP/1.0 302 Moved Temporarily\r\n";
-					case 304: return "HTTP/1.0 304 Not Modified\r\n";
-					case 400: return "HTTP/1.0 400 Bad Request\r\n";
-					case 401: return "HTTP/1.0 401 Unauthorized\r\n";
-					case 403: return "HTTP/1.0 403 Forbidden\r\n";
-					case 404: return "HTTP/1.0 404 Not Found\r\n";
-					case 500: return "HTTP/1.0 500 Internal Server Error\r\n";
-					case 501: return "HTTP/1.0 501 Not Implemented\r\n";
-					case 502: return "HTTP/1.0 502 Bad Gateway\r\n";
-					case 504: return "HTTP/1.0 503 Service Unavailable\r\n";
+			/// A body buffer, written after the first position bytes of m_streambuf
+			struct body_buffer {
+				size_t position;
+				asio::const_buffer buffer;
+			};
+			std::vector<body_buffer> m_body;
+			/// Keep the memory of the body buffers alive until they have been written
+			std::vector<std::shared_ptr<const void>> m_owners;
+			/// Storage for a body moved into the response
+			std::string m_body_string;
+			bool m_body_string_used = false;
+
+			/// Buffer sequence referring into m_buffers, which asio copies cheaply into its write operation
+			class buffer_range {
+			public:
+				using value_type = asio::const_buffer;
+				using const_iterator = const asio::const_buffer*;
+				buffer_range(const_iterator first, const_iterator last) : m_first(first), m_last(last) {}
+				const_iterator begin() const { return m_first; }
+				const_iterator end() const { return m_last; }
+			private:
+				const_iterator m_first, m_last;
+			};
+			std::vector<asio::const_buffer> m_buffers;
+			size_t m_gathered = 0;
+			/// Blocks of a file read by send_file() when it cannot use sendfile(2)
+			std::unique_ptr<char[]> m_file_buffer;
+
+			/// Compression of the body, set up by write_response() from the configuration and Accept-Encoding.
+			/// A body to be compressed is kept as input, and compressed by compress() when the response is sent.
+			struct compression_state {
+				/// Set if the server compresses responses, cleared by status() for statuses whose body is sent as it is
+				bool enabled = false;
+				/// The coding the client accepts, identity if none
+				content_coding coding = content_coding::identity;
+				/// Smallest body to compress
+				size_t min_size = 0;
+				int level = 0;
+				/// Set by type() or a Content-Type header() for text types, a body of unknown type is sent as it is
+				bool compressible = false;
+				/// Set by header() when the handler chose a Content-Encoding itself, or a Vary field
+				bool encoded = false;
+				bool varied = false;
+				/// Set by send() for a body that is to be compressed as a whole
+				bool whole = false;
+				/// Set by begin_chunked() when the chunks are compressed as one stream, and finish by end_chunked()
+				bool stream = false;
+				bool finish = false;
+
+				/// Part of the input, either referring to memory kept by m_owners or m_body_string, or, if data is
+				/// null, the next size bytes of copied, which holds copies of chunks
+				struct piece {
+					const char *data;
+					size_t size;
+				};
+				std::vector<piece> input;
+				size_t input_size = 0;
+				std::string copied;
+			};
+			compression_state m_compression;
+			std::unique_ptr<deflater> m_deflater;
+			/// Output of compress(), referred to by the body buffers until it has been written
+			std::string m_compressed;
+
+			/// Bodies up to this size are copied after the head rather than written as a buffer of their own
+			static const size_t small_body = 256;
+
+			Response(const std::shared_ptr<socket_type> &socket, asio::io_context::strand &strand) : m_socket(socket), m_strand(strand), m_ostream(&m_streambuf) {}
+
+			/// Prepares a response object for the next request of the connection
+			void reset() {
+				m_streambuf.consume(m_streambuf.size());
+				m_ostream.clear();
+				m_header.clear();
+				m_header_lines.clear();
+				m_body.clear();
+				m_owners.clear();
+				m_body_string_used = false;
+				m_http11 = true;
+				m_keep_alive = false;
+				m_close = false;
+				m_chunked = false;
+				m_compression.enabled = false;
+				m_compression.coding = content_coding::identity;
+				m_compression.compressible = false;
+				m_compression.encoded = false;
+				m_compression.varied = false;
+				m_compression.whole = false;
+				m_compression.stream = false;
+				m_compression.finish = false;
+				m_compression.input.clear();
+				m_compression.input_size = 0;
+				m_compression.copied.clear();
+				//A deflater is only left over if a compressed body was not sent to its end
+				m_deflater.reset();
+				close_connection_after_response = false;
+			}
+
+			/// Writes the header lines following the status line, except for the length of the body
+			void write_fields() {
+				auto &date = date_line();
+				add_buffer(asio::buffer(*date));
+				m_owners.push_back(date);
+				if (m_keep_alive)
+					add_static(keep_alive_line());
+				if (m_close)
+					add_static(close_line());
+				for (auto &line : m_header_lines)
+					add_static(line);
+				m_ostream << m_header;
+			}
+
+			void write_head(size_t content_length) {
+				write_fields();
+				m_ostream << "Content-Length: " << content_length << "\r\n\r\n";
+			}
+
+			void write_body(const std::string &str) { m_ostream << str; }
+			void write_body(std::string &&str) {
+				if (str.size() <= small_body || m_body_string_used) {
+					m_ostream << str;
+					return;
+				}
+				m_body_string = std::move(str);
+				m_body_string_used = true;
+				add_buffer(asio::buffer(m_body_string));
+			}
+			void write_body(const std::shared_ptr<const std::string> &str) {
+				add_buffer(asio::buffer(*str));
+				m_owners.push_back(str);
+			}
+			void write_body(const std::vector<asio::const_buffer> &buffers, std::shared_ptr<const void> owner) {
+				for (auto &buffer : buffers)
+					add_buffer(buffer);
+				if (owner)
+					m_owners.push_back(std::move(owner));
+			}
+
+			/// Writes the line preceding a chunk of size bytes. Returns false if nothing is to be written.
+			bool write_chunk_size(size_t size) {
+				if (!m_chunked || size == 0)
+					return false;
+				//An HTTP/1.0 body is delimited by closing the connection instead
+				if (m_http11)
+					m_ostream << std::hex << size << std::dec << "\r\n";
+				return true;
+			}
+
+			void write_chunk_end() {
+				if (m_http11)
+					add_static(string_ref("\r\n", 2));
+			}
+
+			void add_static(const string_ref &str) {
+				add_buffer(asio::buffer(str.data(), str.size()));
+			}
+
+			void add_buffer(const asio::const_buffer &buffer) {
+				if (asio::buffer_size(buffer) > 0)
+					m_body.push_back(body_buffer{ m_streambuf.size(), buffer });
+			}
+
+			/// Returns true if a body of size bytes gets a Vary field, because it is compressed for some clients.
+			/// Adds the field to the head.
+			bool negotiated(size_t size) {
+				auto &compression = m_compression;
+				if (!compression.enabled || !compression.compressible || compression.encoded || size < compression.min_size)
+					return false;
+				if (!compression.varied)
+					m_header_lines.push_back(vary_accept_encoding_line());
+				compression.varied = true;
+				return true;
+			}
+
+			/// Returns true if a body of size bytes is to be compressed. The head then has to wait for compress().
+			bool compress_body(size_t size) {
+				return negotiated(size) && m_compression.coding != content_coding::identity;
+			}
+
+			void add_input(const char *data, size_t size) {
+				if (size > 0) {
+					m_compression.input.push_back(typename compression_state::piece{ data, size });
+					m_compression.input_size += size;
+				}
+			}
+			void add_input(const std::vector<asio::const_buffer> &buffers, std::shared_ptr<const void> owner) {
+				for (auto &buffer : buffers)
+					add_input(asio::buffer_cast<const char*>(buffer), asio::buffer_size(buffer));
+				if (owner)
+					m_owners.push_back(std::move(owner));
+			}
+			void copy_input(const std::string &str) {
+				if (str.empty())
+					return;
+				m_compression.copied.append(str);
+				m_compression.input.push_back(typename compression_state::piece{ nullptr, str.size() });
+				m_compression.input_size += str.size();
+			}
+
+			void send_compressed(const asio::const_buffer &buffer) {
+				add_input(asio::buffer_cast<const char*>(buffer), asio::buffer_size(buffer));
+				m_compression.whole = true;
+			}
+
+			/// Returns true if there is input for compress()
+			bool compression_pending() const {
+				auto &compression = m_compression;
+				return compression.whole || (compression.stream && (compression.input_size > 0 || compression.finish));
+			}
+
+			/// Compresses the input, then writes the head for a whole body, or a chunk for a compressed stream.
+			/// Runs on a thread of the compression pool for large inputs, see ServerBase::async_send().
+			void compress(deflater_cache &deflaters) {
+				auto &compression = m_compression;
+				if (!m_deflater)
+					m_deflater = deflaters.acquire(compression.coding, compression.level);
+				bool finish = compression.whole || compression.finish;
+				m_compressed.clear();
+				const char *copied = compression.copied.data();
+				for (auto &piece : compression.input) {
+					auto data = piece.data ? piece.data : copied;
+					if (!piece.data)
+						copied += piece.size;
+					m_deflater->compress(data, piece.size, m_compressed, deflater::flush::none);
+				}
+				m_deflater->compress(nullptr, 0, m_compressed, finish ? deflater::flush::finish : deflater::flush::sync);
+				if (finish)
+					deflaters.release(std::move(m_deflater));
+
+				if (compression.whole) {
+					if (m_compressed.size() < compression.input_size) {
+						m_header_lines.push_back(content_encoding_line(compression.coding));
+						write_head(m_compressed.size());
+						add_buffer(asio::buffer(m_compressed));
+					}
+					else {
+						//Incompressible, the body goes out as it is
+						write_head(compression.input_size);
+						for (auto &piece : compression.input)
+							add_buffer(asio::buffer(piece.data, piece.size));
+					}
+					compression.whole = false;
+				}
+				else {
+					if (write_chunk_size(m_compressed.size())) {
+						add_buffer(asio::buffer(m_compressed));
+						write_chunk_end();
+					}
+					if (finish) {
+						compression.stream = false;
+						compression.finish = false;
+						end_chunked();
+					}
+				}
+				compression.input.clear();
+				compression.input_size = 0;
+				compression.copied.clear();
+			}
+
+			/// Returns what has been written to the response so far as one buffer sequence
+			buffer_range gather() {
+				m_buffers.clear();
+				auto head = asio::buffer_cast<const char*>(m_streambuf.data());
+				size_t position = 0;
+				for (auto &body : m_body) {
+					if (body.position > position)
+						m_buffers.push_back(asio::buffer(head + position, body.position - position));
+					m_buffers.push_back(body.buffer);
+					position = body.position;
 				}
+				m_gathered = m_streambuf.size();
+				if (m_gathered > position)
+					m_buffers.push_back(asio::buffer(head + position, m_gathered - position));
+				return buffer_range(m_buffers.data(), m_buffers.data() + m_buffers.size());
+			}
+
+			/// Releases what gather() returned once it has been written
+			void written() {
+				m_streambuf.consume(m_gathered);
+				m_body.clear();
+				m_owners.clear();
+				m_body_string_used = false;
 			}
+
 		public:
-			Response& status(int number) { m_ostream << statusToString(number); return *this; }
-			void type(std::string str) { m_header << "Content-Type: "<< str << "\r\n"; }
-			void send(std::string str) { m_ostream << m_header.str() << "Content-Length: " << str.length() << "\r\n\r\n" << str; }
-			size_t size() const { return m_streambuf.size(); }
+			Response& status(int number) {
+				//Partial content has to be a range of the representation, which a coding would change
+				if (number == 204 || number == 206 || number == 304)
+					m_compression.enabled = false;
+				auto line = status_line(number, m_http11);
+				if (!line.empty())
+					add_static(line);
+				else
+					m_ostream << (m_http11 ? "HTTP/1.1 " : "HTTP/1.0 ") << number << " \r\n";
+				return *this;
+			}
+			void type(const string_ref &str) {
+				m_compression.compressible = compressible_type(str);
+				auto line = content_type_line(str);
+				if (!line.empty())
+					m_header_lines.push_back(line);
+				else
+					m_header.append("Content-Type: ").append(str.data(), str.size()).append("\r\n");
+			}
+			/// Adds a header line. Status, Date, Content-Length and the framing of the body are added by the server.
+			void header(const string_ref &name, const string_ref &value) {
+				if (iequals(name, "Content-Type"))
+					m_compression.compressible = compressible_type(value);
+				else if (iequals(name, "Content-Encoding"))
+					m_compression.encoded = true;
+				else if (iequals(name, "Vary"))
+					m_compression.varied = true;
+				m_header.append(name.data(), name.size()).append(": ").append(value.data(), value.size()).append("\r\n");
+			}
+			/// Ends the head, announcing a body of content_length bytes that is either sent separately, as with
+			/// ServerBase::send_file(), or not at all, as for HEAD requests and 304 responses.
+			void send_head(unsigned long long content_length) {
+				write_fields();
+				m_ostream << "Content-Length: " << content_length << "\r\n\r\n";
+			}
+			/// Sends str as the body. With compression enabled in the Config, the server compresses bodies of text
+			/// types for clients accepting it when the response is sent; all send() overloads do so.
+			void send(const std::string &str) {
+				if (compress_body(str.size())) {
+					m_body_string = str;
+					m_body_string_used = true;
+					send_compressed(asio::buffer(m_body_string));
+					return;
+				}
+				write_head(str.length());
+				write_body(str);
+			}
+			/// Sends str as the body, taking over its memory instead of copying it.
+			void send(std::string &&str) {
+				if (compress_body(str.size())) {
+					m_body_string = std::move(str);
+					m_body_string_used = true;
+					send_compressed(asio::buffer(m_body_string));
+					return;
+				}
+				write_head(str.length());
+				write_body(std::move(str));
+			}
+			/// Sends the shared string as the body without copying it. It must not be modified until it has been sent.
+			void send(const std::shared_ptr<const std::string> &str) {
+				if (compress_body(str->size())) {
+					m_owners.push_back(str);
+					send_compressed(asio::buffer(*str));
+					return;
+				}
+				write_head(str->length());
+				write_body(str);
+			}
+			/// Sends the buffers as the body without copying them. owner is kept until they have been sent,
+			/// and may be null for memory that outlives the response.
+			void send(const std::vector<asio::const_buffer> &buffers, std::shared_ptr<const void> owner) {
+				if (compress_body(asio::buffer_size(buffers))) {
+					add_input(buffers, std::move(owner));
+					m_compression.whole = true;
+					return;
+				}
+				write_head(asio::buffer_size(buffers));
+				write_body(buffers, std::move(owner));
+			}
+			/// Sends a single buffer as the body without copying it, as above.
+			void send(const asio::const_buffer &buffer, std::shared_ptr<const void> owner) {
+				if (owner)
+					m_owners.push_back(std::move(owner));
+				if (compress_body(asio::buffer_size(buffer))) {
+					send_compressed(buffer);
+					return;
+				}
+				write_head(asio::buffer_size(buffer));
+				add_buffer(buffer);
+			}
+
+			/// Starts a body of unknown length, sent as chunks with send_chunk() and ended by end_chunked().
+			/// Uses "Transfer-Encoding: chunked", or closes the connection after the body for HTTP/1.0 requests.
+			///
+			/// To stream a large body, pass each chunk to ServerBase::send() and produce the next one from its
+			/// callback, so that only one chunk at a time is buffered. A response that is released without
+			/// end_chunked() having been called is ended when it is sent.
+			///
+			/// With compression enabled in the Config, the chunks of a text type are compressed as one stream for
+			/// clients accepting it. Each ServerBase::send() flushes the stream, so that the client can decode all
+			/// chunks sent so far.
+			void begin_chunked() {
+				//The length is unknown, so the body counts as large enough to compress
+				if (compress_body(~size_t(0))) {
+					m_compression.stream = true;
+					m_header_lines.push_back(content_encoding_line(m_compression.coding));
+				}
+				write_fields();
+				if (m_http11)
+					m_ostream << "Transfer-Encoding: chunked\r\n\r\n";
+				else {
+					m_ostream << "\r\n";
+					close_connection_after_response = true;
+				}
+				m_chunked = true;
+			}
+			void send_chunk(const std::string &str) {
+				if (m_compression.stream)
+					copy_input(str);
+				else if (write_chunk_size(str.size())) {
+					write_body(str);
+					write_chunk_end();
+				}
+			}
+			void send_chunk(std::string &&str) {
+				if (m_compression.stream)
+					copy_input(str);
+				else if (write_chunk_size(str.size())) {
+					write_body(std::move(str));
+					write_chunk_end();
+				}
+			}
+			void send_chunk(const std::shared_ptr<const std::string> &str) {
+				if (m_compression.stream) {
+					add_input(str->data(), str->size());
+					m_owners.push_back(str);
+				}
+				else if (write_chunk_size(str->size())) {
+					write_body(str);
+					write_chunk_end();
+				}
+			}
+			void send_chunk(const std::vector<asio::const_buffer> &buffers, std::shared_ptr<const void> owner) {
+				if (m_compression.stream)
+					add_input(buffers, std::move(owner));
+				else if (write_chunk_size(asio::buffer_size(buffers))) {
+					write_body(buffers, std::move(owner));
+					write_chunk_end();
+				}
+			}
+			/// Ends a body started with begin_chunked(). Does nothing if there is none.
+			void end_chunked() {
+				if (!m_chunked)
+					return;
+				//The end of a compressed stream follows its last chunk, see compress()
+				if (m_compression.stream) {
+					m_compression.finish = true;
+					return;
+				}
+				if (m_http11)
+					add_static(string_ref("0\r\n\r\n", 5));
+				m_chunked = false;
+			}
+			size_t size() const {
+				size_t result = m_streambuf.size();
+				for (auto &body : m_body)
+					result += asio::buffer_size(body.buffer);
+				return result;
+			}
 			std::shared_ptr<socket_type> socket() { return m_socket; }
 			
 			/// If true, force server to close the connection after the response have been sent.
@@ -121,7 +597,8 @@ namespace webpp {
 
 			Content content;
 
-			std::unordered_multimap<std::string, std::string, case_insensitive_hash, case_insensitive_equals> header;
+			/// Header fields referring into the request head, use header.materialize() for an owning copy.
+			header_fields header;
 
 			path2regex::Keys keys;
 			std::map<std::string, std::string> params;
@@ -166,7 +643,64 @@ namespace webpp {
 				}
 				catch(...) {}
 			}
-			asio::streambuf streambuf;
+			/// Prepares a request object for the next request of the connection.
+			/// Containers are cleared rather than replaced so that their storage is reused.
+			void reset() {
+				streambuf.consume(streambuf.size());
+				content.clear();
+				method.clear();
+				path.clear();
+				http_version.clear();
+				header.clear();
+				keys.clear();
+				m_body = body_state();
+				m_decoded.clear();
+			}
+
+			/// Receive buffer that can hand back bytes read past the end of the message
+			class receive_buffer : public asio::streambuf {
+			public:
+				/// Removes the last size bytes of the data
+				void truncate(size_t size) {
+					pbump(-static_cast<int>(size));
+					setg(eback(), gptr(), pptr());
+				}
+			};
+
+			receive_buffer streambuf;
+			/// The buffer as asio::streambuf, which asio's read functions only accept as such
+			asio::streambuf &read_buffer() { return streambuf; }
+			/// Copy of the request line and header lines, header refers into it
+			std::string m_head;
+			request_parser m_parser;
+			/// Route parameters found by find_route()
+			std::vector<string_ref> m_captures;
+
+			/// Framing of the body, and how far it has been received
+			struct body_state {
+				bool chunked = false;
+				/// Set once the whole body has been received, or receiving it failed
+				bool done = true;
+				/// Bytes of a body with Content-Length that are still to be received
+				unsigned long long remaining = 0;
+				std::error_code error;
+				chunked_decoder decoder;
+			};
+			body_state m_body;
+			/// Chunked body of a buffered route, decoded before it replaces the buffer content
+			std::string m_decoded;
+			/// The connection stays alive as long as the request is referenced, see make_request()
+			std::weak_ptr<Connection> m_connection;
+
+			/// Route and the start of each phase of the request, for Config::metrics
+			struct timing {
+				size_t route = 0;
+				server_metrics::clock::time_point received;
+				server_metrics::clock::time_point routed;
+				server_metrics::clock::time_point called;
+				server_metrics::clock::time_point released;
+			};
+			timing m_timing;
 		};
 
 		class Config {
@@ -180,61 +714,121 @@ namespace webpp {
 			size_t thread_pool_size=1;
 			/// Timeout on request handling. Defaults to 5 seconds.
 			size_t timeout_request=5;
-			/// Timeout on content handling. Defaults to 300 seconds.
+			/// Timeout on content handling. Defaults to 300 seconds. Applies to each read of a streamed request body
+			/// and each write of a response sent in parts, not to the time the handler takes between them.
 			size_t timeout_content=300;
 			/// IPv4 address in dotted decimal form or IPv6 address in hexadecimal notation.
 			/// If empty, the address will be any address.
 			std::string address;
 			/// Set to false to avoid binding the socket to an address that is already in use. Defaults to true.
 			bool reuse_address=true;
+			/// Set to true to give each of the thread_pool_size threads its own io_context and acceptor bound with
+			/// SO_REUSEPORT, so the kernel balances accepts and connections never migrate between threads.
+			/// Ignored when an external io_context is used or SO_REUSEPORT is unavailable. Defaults to false.
+			bool sharded=false;
+			/// Set to true to compress bodies of text types with gzip or deflate for clients that accept it.
+			/// Requires building with zlib and WEBPP_ZLIB defined, and is ignored otherwise. Defaults to false.
+			bool compression=false;
+			/// Smallest body to compress, smaller ones gain little. Defaults to 1024 bytes.
+			size_t compression_min_size=1024;
+			/// zlib compression level from 1 (fastest) to 9 (smallest). Defaults to 6.
+			int compression_level=6;
+			/// Number of threads compressing bodies of at least compression_offload_size bytes, so that the threads
+			/// serving connections are not held up by them. With 0, bodies are compressed by the thread that sends
+			/// them. Defaults to 1 thread.
+			size_t compression_threads=1;
+			/// Smallest body, or part of a chunked body, to compress on the compression threads. Defaults to 64 KiB.
+			size_t compression_offload_size=65536;
+			/// Maximum number of connections served at a time, 0 for no limit. Once reached, the server stops
+			/// accepting until a connection closes, further clients wait in the listen backlog. Defaults to 0.
+			size_t max_connections=0;
+			/// Length of the queue of connections waiting to be accepted. Defaults to the system's maximum.
+			int backlog=asio::socket_base::max_listen_connections;
+			/// Count connections, requests, bytes and errors, and time the phases of requests per route, see metrics().
+			/// Defaults to false.
+			bool metrics=false;
+			/// An already listening socket to accept connections on instead of binding to address and port, passed by a
+			/// parent process or by systemd socket activation, see inherited_listen_fd(). The server owns it from then on.
+			/// Not supported on Windows. -1 to bind a socket of its own. Defaults to -1.
+			int listen_fd=-1;
+			/// Target for the time, in milliseconds, that requests wait for a thread once received. While the
+			/// queue_monitor of an io_context reports a longer delay, its requests are answered with 503 Service
+			/// Unavailable instead of calling their handler, and their connection is closed, so that the server
+			/// sheds what it cannot serve in time. 0 disables shedding. Defaults to 0.
+			size_t shed_queue_delay=0;
 		};
 		///Set before calling start().
 		Config m_config;
 		private:
-		  class regex_orderable : public std::regex {
-			  std::string str;
-		  public:
-			  regex_orderable(std::regex reg, const std::string &regex_str) : std::regex(reg), str(regex_str) {}
-			  bool operator<(const regex_orderable &rhs) const {
-				  return str<rhs.str;
-			  }
-			  std::string getstr() const { return str; }
-		  };
 		using http_handler = std::function<void(std::shared_ptr<Response>, std::shared_ptr<Request>)>;
 
 	public:
-		template<class T> void on_get(std::string regex, T&& func) { std::lock_guard<std::mutex> lock(m_resource_mutex); path2regex::Keys keys; auto reg = path2regex::path_to_regex(regex, keys); m_resource[regex_orderable(reg,regex)]["GET"] = std::make_tuple(std::move(keys), func); }
-		template<class T> void on_get(T&& func) { std::lock_guard<std::mutex> lock(m_resource_mutex); m_default_resource["GET"] = func; }
-		template<class T> void on_post(std::string regex, T&& func) { std::lock_guard<std::mutex> lock(m_resource_mutex); path2regex::Keys keys; auto reg = path2regex::path_to_regex(regex, keys); m_resource[regex_orderable(reg, regex)]["POST"] = std::make_tuple(std::move(keys), func); }
-		template<class T> void on_post(T&& func) { std::lock_guard<std::mutex> lock(m_resource_mutex); m_default_resource["POST"] = func; }
-		template<class T> void on_put(std::string regex, T&& func) { std::lock_guard<std::mutex> lock(m_resource_mutex);  path2regex::Keys keys; auto reg = path2regex::path_to_regex(regex, keys); m_resource[regex_orderable(reg, regex)]["PUT"] = std::make_tuple(std::move(keys), func); }
-		template<class T> void on_put(T&& func) { std::lock_guard<std::mutex> lock(m_resource_mutex);  m_default_resource["PUT"] = func; }
-		template<class T> void on_patch(std::string regex, T&& func) { std::lock_guard<std::mutex> lock(m_resource_mutex); path2regex::Keys keys; auto reg = path2regex::path_to_regex(regex, keys); m_resource[regex_orderable(reg, regex)]["PATCH"] = std::make_tuple(std::move(keys), func); }
-		template<class T> void on_patch(T&& func) { std::lock_guard<std::mutex> lock(m_resource_mutex); m_default_resource["PATCH"] = func; }
-		template<class T> void on_delete(std::string regex, T&& func) { std::lock_guard<std::mutex> lock(m_resource_mutex); path2regex::Keys keys; auto reg = path2regex::path_to_regex(regex, keys); m_resource[regex_orderable(reg, regex)]["DELETE"] = std::make_tuple(std::move(keys), func); }
-		template<class T> void on_delete(T&& func) { std::lock_guard<std::mutex> lock(m_resource_mutex); m_default_resource["DELETE"] = func; }
+		/// How a route receives the body of its requests
+		enum class request_body {
+			/// The handler is called once the whole body is in request->content (the default)
+			buffered,
+			/// The handler is called once the head has been received, and pulls the body with read_body()
+			streamed
+		};
+
+		template<class T> void on_get(std::string regex, T&& func) { add_resource(regex, "GET", std::forward<T>(func)); }
+		template<class T> void on_get(T&& func) { add_default_resource("GET", std::forward<T>(func)); }
+		template<class T> void on_post(std::string regex, T&& func) { add_resource(regex, "POST", std::forward<T>(func)); }
+		template<class T> void on_post(T&& func) { add_default_resource("POST", std::forward<T>(func)); }
+		template<class T> void on_post(std::string regex, T&& func, request_body body) { add_resource(regex, "POST", std::forward<T>(func), body); }
+		template<class T> void on_put(std::string regex, T&& func) { add_resource(regex, "PUT", std::forward<T>(func)); }
+		template<class T> void on_put(T&& func) { add_default_resource("PUT", std::forward<T>(func)); }
+		template<class T> void on_put(std::string regex, T&& func, request_body body) { add_resource(regex, "PUT", std::forward<T>(func), body); }
+		template<class T> void on_patch(std::string regex, T&& func) { add_resource(regex, "PATCH", std::forward<T>(func)); }
+		template<class T> void on_patch(T&& func) { add_default_resource("PATCH", std::forward<T>(func)); }
+		template<class T> void on_patch(std::string regex, T&& func, request_body body) { add_resource(regex, "PATCH", std::forward<T>(func), body); }
+		template<class T> void on_delete(std::string regex, T&& func) { add_resource(regex, "DELETE", std::forward<T>(func)); }
+		template<class T> void on_delete(T&& func) { add_default_resource("DELETE", std::forward<T>(func)); }
+		template<class T> void on_head(std::string regex, T&& func) { add_resource(regex, "HEAD", std::forward<T>(func)); }
+		template<class T> void on_head(T&& func) { add_default_resource("HEAD", std::forward<T>(func)); }
 
 		void remove_handler(std::string regex)
 		{
-			std::lock_guard<std::mutex> lock(m_resource_mutex);
-			for (auto it = m_resource.begin(); it != m_resource.end(); ++it)
-			{
-				if (it->first.getstr() == regex)
-				{
-					m_resource.erase(it);
-					break;
-				}
-			}
+			update_resources([&regex](resource_table &table) { table.resource.erase(regex); });
 		}
 
 		std::function<void(std::shared_ptr<typename ServerBase<socket_type>::Request>, const std::error_code&)> on_error;
 
 		std::function<void(std::shared_ptr<socket_type> socket, std::shared_ptr<typename ServerBase<socket_type>::Request>)> on_upgrade;
 	private:
-		/// Warning: do not add or remove resources after start() is called
-		std::map<regex_orderable, std::map<std::string, std::tuple<path2regex::Keys, http_handler>>>  m_resource;
+		/// Keys, handler, body mode and metrics route identifier by method
+		using resource_methods = std::map<std::string, std::tuple<path2regex::Keys, http_handler, request_body, size_t>>;
+
+		/// Routes and default resources. A table is never modified once published, adding or removing a
+		/// resource publishes an updated copy, so requests can be dispatched while resources change.
+		struct resource_table {
+			route_tree<resource_methods> resource;
+			/// Handler and metrics route identifier by method
+			std::map<std::string, std::pair<http_handler, size_t>> default_resource;
+		};
+
+		template<class T> void add_resource(const std::string &regex, const std::string &method, T&& func, request_body body=request_body::buffered) {
+			path2regex::Keys keys;
+			path2regex::tokens_to_keys(path2regex::parse(regex), keys);
+			auto resource = std::make_tuple(std::move(keys), http_handler(std::forward<T>(func)), body, m_metrics.route_id(method, regex));
+			update_resources([&](resource_table &table) { table.resource[regex][method] = std::move(resource); });
+		}
+
+		template<class T> void add_default_resource(const std::string &method, T&& func) {
+			auto resource = std::make_pair(http_handler(std::forward<T>(func)), m_metrics.route_id(method, std::string()));
+			update_resources([&](resource_table &table) { table.default_resource[method] = std::move(resource); });
+		}
+
+		template<class Update> void update_resources(Update &&update) {
+			//Writers are serialized, readers only ever see complete tables
+			std::lock_guard<std::mutex> lock(m_resource_mutex);
+			auto table = std::make_shared<resource_table>(*std::atomic_load(&m_resources));
+			update(*table);
+			std::atomic_store(&m_resources, std::shared_ptr<const resource_table>(std::move(table)));
+		}
 
-		std::map<std::string, http_handler> m_default_resource;
+		/// Current resource table, only accessed through std::atomic_load() and std::atomic_store()
+		std::shared_ptr<const resource_table> m_resources = std::make_shared<resource_table>();
 
 		std::mutex m_resource_mutex;
 	public:
@@ -242,242 +836,1066 @@ namespace webpp {
 			if(!m_io_context)
 				m_io_context=std::make_shared<asio::io_context>();
 
-			if(m_io_context->stopped())
-				m_io_context.reset();
-
 			asio::ip::tcp::endpoint endpoint;
 			if(m_config.address.size()>0)
 				endpoint=asio::ip::tcp::endpoint(asio::ip::make_address(m_config.address), m_config.port);
 			else
 				endpoint=asio::ip::tcp::endpoint(asio::ip::tcp::v4(), m_config.port);
 
-			if(!acceptor)
-				acceptor= std::make_unique<asio::ip::tcp::acceptor>(*m_io_context);
-			acceptor->open(endpoint.protocol());
-			acceptor->set_option(asio::socket_base::reuse_address(m_config.reuse_address));
-			acceptor->bind(endpoint);
-			acceptor->listen();
+			//In sharded mode every thread gets its own io_context, m_io_context being the first one
+			size_t num_shards=1;
+#ifdef SO_REUSEPORT
+			if(m_config.sharded && !m_external_context && m_config.thread_pool_size>1 && m_config.listen_fd<0)
+				num_shards=m_config.thread_pool_size;
+#endif
+			if(m_config.compression && deflater::available && m_config.compression_threads>0 && !m_compression_pool)
+				m_compression_pool=std::make_unique<worker_pool>(m_config.compression_threads);
 
-			accept();
+			m_io_contexts.resize(num_shards);
+			m_io_contexts[0]=m_io_context;
+			acceptors.clear();
+			for(size_t c=0; c<num_shards; c++) {
+				if(!m_io_contexts[c])
+					m_io_contexts[c]=std::make_shared<asio::io_context>();
+				if(m_io_contexts[c]->stopped())
+					m_io_contexts[c]->reset();
 
-			if (!m_external_context)
-				m_io_context->run();
+				auto acceptor=std::make_shared<asio::ip::tcp::acceptor>(*m_io_contexts[c]);
+				if(m_config.listen_fd>=0) {
+					adopt_listener(*acceptor);
+					acceptors.emplace_back(std::move(acceptor));
+					continue;
+				}
+				acceptor->open(endpoint.protocol());
+				acceptor->set_option(asio::socket_base::reuse_address(m_config.reuse_address));
+#ifdef SO_REUSEPORT
+				if(num_shards>1)
+					acceptor->set_option(reuse_port(true));
+#endif
+				acceptor->bind(endpoint);
+				acceptor->listen(m_config.backlog);
+				acceptors.emplace_back(std::move(acceptor));
+			}
+			{
+				std::lock_guard<std::mutex> lock(m_accept_mutex);
+				m_paused_acceptors.clear();
+			}
+			{
+				std::lock_guard<std::mutex> lock(m_connections_mutex);
+				m_draining=false;
+				m_drained=false;
+			}
+			if(m_config.shed_queue_delay>0) {
+				std::lock_guard<std::mutex> lock(m_queue_monitors_mutex);
+				if(m_queue_monitors.empty()) {
+					for(auto& io_context: m_io_contexts) {
+						m_queue_monitors.emplace_back(queue_monitor::get(*io_context));
+						m_queue_monitors.back()->acquire();
+					}
+				}
+			}
+
+			for(auto& acceptor: acceptors)
+				accept_next(*acceptor, std::error_code());
+
+			if (!m_external_context) {
+				//Run the io_contexts on thread_pool_size threads, the calling thread being one of them
+				threads.clear();
+				for(size_t c=1; c<m_config.thread_pool_size; c++) {
+					auto io_context=m_io_contexts[num_shards>1 ? c : 0];
+					threads.emplace_back([io_context]() {
+						io_context->run();
+					});
+				}
+
+				if(m_config.thread_pool_size>0)
+					m_io_context->run();
+
+				//Wait for the rest of the threads, if any, to finish as well
+				for(auto& t: threads)
+					t.join();
+				threads.clear();
+				//No thread runs the io_contexts any more, so the closes stop() left pending can be done here
+				for(auto& acceptor: acceptors) {
+					std::error_code ec;
+					acceptor->close(ec);
+				}
+			}
 		}
 
+		/// Stops accepting and, unless an external io_context is used, stops the io_context.
+		/// start() returns once all worker threads have been joined.
 		void stop() const
 		{
-			acceptor->close();
-			if (!m_external_context)
-				m_io_context->stop();
+			close_acceptors();
+			std::vector<std::shared_ptr<queue_monitor>> monitors;
+			{
+				std::lock_guard<std::mutex> lock(m_queue_monitors_mutex);
+				monitors.swap(m_queue_monitors);
+			}
+			for(auto& monitor: monitors)
+				monitor->release();
+			if (!m_external_context) {
+				for(auto& io_context: m_io_contexts)
+					io_context->stop();
+			}
+		}
+
+		/// Stops accepting and lets the requests in progress finish, then stops like stop() and calls drained.
+		/// Connections waiting for a request are closed right away, the others once their current response has
+		/// been sent; requests already pipelined behind it are answered with "Connection: close". Connections
+		/// still open after timeout seconds are closed regardless.
+		///
+		/// For a restart without downtime, a new process takes over the listening socket (see listener_handle()
+		/// and Config::listen_fd) before the old one drains.
+		void drain(long timeout, std::function<void()> drained=nullptr) {
+			close_acceptors();
+			//Armed before draining begins, so that finish_drain() cannot cancel it before it has been set
+			auto timer=std::make_shared<asio::steady_timer>(*m_io_context, std::chrono::seconds(timeout));
+			timer->async_wait([this, timer](const std::error_code& ec) {
+				if(ec)
+					return;
+				{
+					std::lock_guard<std::mutex> lock(m_connections_mutex);
+					for(auto connection=m_open_connections; connection; connection=connection->next_open)
+						connection->close();
+				}
+				//Handlers may still hold on to connections, they are not waited for
+				finish_drain();
+			});
+			bool done;
+			{
+				std::lock_guard<std::mutex> lock(m_connections_mutex);
+				m_drain_timer=timer;
+				m_on_drained=std::move(drained);
+				m_draining=true;
+				for(auto connection=m_open_connections; connection; connection=connection->next_open) {
+					if(connection->idle)
+						connection->close();
+				}
+				done=!m_open_connections;
+			}
+			if(done)
+				finish_drain();
+		}
+
+		/// Returns the native handle of the listening socket, -1 if there is none, to be passed to a process taking
+		/// over. It has to be inherited by that process, which is up to the caller (for instance clearing FD_CLOEXEC).
+		int listener_handle() const {
+			if(acceptors.empty() || !acceptors[0]->is_open())
+				return -1;
+			return static_cast<int>(const_cast<asio::ip::tcp::acceptor&>(*acceptors[0]).native_handle());
+		}
+
+		/// Returns the metrics recorded since the server was created, see Config::metrics
+		metrics_snapshot metrics() const {
+			return m_metrics.snapshot();
+		}
+
+		/// Serves the metrics in the Prometheus text format at path, and enables Config::metrics
+		void serve_metrics(const std::string &path="/metrics") {
+			m_config.metrics=true;
+			on_get(path, [this](std::shared_ptr<Response> response, std::shared_ptr<Request> /*request*/) {
+				response->status(200);
+				response->type("text/plain; version=0.0.4");
+				response->send(metrics().prometheus());
+			});
 		}
 
 		///Use this function if you need to recursively send parts of a longer message
 		void send(const std::shared_ptr<Response> &response, const std::function<void(const std::error_code&)>& callback=nullptr) const {
-			asio::async_write(*response->socket(), response->m_streambuf, [this, response, callback](const std::error_code& ec, size_t /*bytes_transferred*/) {
+			async_send(response, [this, response, callback](const std::error_code& ec) {
+				pause_timeout(*response);
 				if(callback)
 					callback(ec);
 			});
 		}
 
+		/// Reads the next fragment of the body of a request whose route streams it (request_body::streamed).
+		/// handler(ec, fragment) is called with an empty fragment once the whole body has been received; fragment is
+		/// valid until the handler returns. Nothing is read from the client until read_body() is called again, so a
+		/// consumer that is slow to ask for more holds back the upload instead of having it pile up in memory.
+		/// A response sent before the body has been read completely closes the connection.
+		void read_body(const std::shared_ptr<Request> &request, const std::function<void(const std::error_code&, string_ref)> &handler) {
+			async_read_body(request, handler);
+		}
+
+		/// Sends what has been written to the response, then length bytes of file from offset, and calls callback(ec).
+		/// The head must announce the length, see Response::send_head(). Plain HTTP connections on Linux use
+		/// sendfile(2), so the file does not pass through user space; otherwise it is read in large blocks.
+		void send_file(const std::shared_ptr<Response> &response, const std::shared_ptr<const open_file> &file, unsigned long long offset,
+			unsigned long long length, const std::function<void(const std::error_code&)>& callback=nullptr) {
+			async_send(response, [this, response, file, offset, length, callback](const std::error_code &ec) {
+				auto done = [this, response, callback](const std::error_code &ec) {
+					pause_timeout(*response);
+					if (callback)
+						callback(ec);
+				};
+				if (ec || length == 0)
+					done(ec);
+				else
+					write_file(response, file, offset, length, done, use_sendfile());
+			});
+		}
+
 		void set_io_context(std::shared_ptr<asio::io_context> new_io_context)
 		{
 			m_io_context = new_io_context;
 			m_external_context = true;
 		}
 	protected:
+		/// Writes the response and calls handler(ec), avoiding the std::function of send()
+		template<class Handler>
+		void async_send(const std::shared_ptr<Response> &response, Handler &&handler) const {
+			//The response may be sent from any thread, writes are serialized on the connection strand
+			response->m_strand.dispatch(make_recycling_handler([this, response, handler]() {
+				if (!response->compression_pending()) {
+					async_write_response(response, handler);
+					return;
+				}
+				if (!m_compression_pool || response->m_compression.input_size < m_config.compression_offload_size) {
+					response->compress(m_deflaters);
+					async_write_response(response, handler);
+					return;
+				}
+				//A large body is compressed on the pool, meanwhile the strand serves other connections
+				m_compression_pool->context.post(make_recycling_handler([this, response, handler]() {
+					response->compress(m_deflaters);
+					response->m_strand.post(make_recycling_handler([this, response, handler]() {
+						async_write_response(response, handler);
+					}));
+				}));
+			}));
+		}
+
+		/// Writes what has been written to the response, on its strand
+		template<class Handler>
+		void async_write_response(const std::shared_ptr<Response> &response, const Handler &handler) const {
+			refresh_timeout(*response);
+			//Head and body buffers go out with one gathered write
+			asio::async_write(*response->socket(), response->gather(), response->m_strand.wrap(make_recycling_handler([this, response, handler](const std::error_code& ec, size_t bytes_transferred) {
+				if (m_config.metrics)
+					m_metrics.sent(bytes_transferred);
+				response->written();
+				handler(ec);
+			})));
+		}
+
+		/// Calls handler(ec, fragment) with the next fragment of the request body, see read_body()
+		template<class Handler>
+		void async_read_body(const std::shared_ptr<Request> &request, Handler &&handler) {
+			auto connection = request->m_connection.lock();
+			//Posted rather than dispatched, so that a handler asking for more from within does not recurse
+			connection->strand.post(make_recycling_handler([this, connection, request, handler]() mutable {
+				next_body_fragment(connection, request, handler);
+			}));
+		}
+
+		/// Size of the reads of a streamed body
+		static const size_t body_read_size = 65536;
+
+		/// Delivers the next fragment of the body from the receive buffer, reading from the socket when it holds none
+		template<class Handler>
+		void next_body_fragment(const std::shared_ptr<Connection> &connection, const std::shared_ptr<Request> &request, Handler &handler) {
+			auto &body = request->m_body;
+			auto &streambuf = request->streambuf;
+			if (body.done) {
+				handler(body.error, string_ref());
+				return;
+			}
+			if (streambuf.size() > 0) {
+				//Fragments refer into the buffer, consuming only moves its read position
+				auto data = asio::buffer_cast<const char*>(streambuf.data());
+				if (!body.chunked) {
+					auto size = static_cast<size_t>(std::min<unsigned long long>(body.remaining, streambuf.size()));
+					streambuf.consume(size);
+					body.remaining -= size;
+					body.done = body.remaining == 0;
+					handler(std::error_code(), string_ref(data, size));
+					return;
+				}
+				size_t consumed;
+				string_ref fragment;
+				auto result = body.decoder.decode(data, streambuf.size(), consumed, fragment);
+				streambuf.consume(consumed);
+				switch (result) {
+				case chunked_decoder::result::data:
+					handler(std::error_code(), fragment);
+					return;
+				case chunked_decoder::result::done:
+					body.done = true;
+					keep_pipelined(*connection, *request, 0);
+					handler(std::error_code(), string_ref());
+					return;
+				case chunked_decoder::result::error:
+					body.done = true;
+					body.error = std::error_code(EPROTO, std::generic_category());
+					handler(body.error, string_ref());
+					return;
+				case chunked_decoder::result::incomplete:
+					break;
+				}
+			}
+
+			//A body with Content-Length is read up to its end only, anything after it belongs to the next request
+			auto size = body.chunked ? body_read_size : static_cast<size_t>(std::min<unsigned long long>(body.remaining, body_read_size));
+			//Refreshes the content timeout that write_response() set for the whole request
+			set_timeout(connection, m_config.timeout_content);
+			connection->socket->async_read_some(streambuf.prepare(size), connection->strand.wrap(make_recycling_handler(
+					[this, connection, request, handler](const std::error_code &ec, size_t bytes_transferred) mutable {
+				request->streambuf.commit(bytes_transferred);
+				if (m_config.metrics)
+					m_metrics.received(bytes_transferred);
+				if (ec) {
+					auto &body = request->m_body;
+					body.done = true;
+					body.error = ec;
+					handler(ec, string_ref());
+					return;
+				}
+				next_body_fragment(connection, request, handler);
+			})));
+		}
+
+		/// Refreshes the content timeout that write_response() set for the whole response before each write, so
+		/// that a long transfer or a response sent in parts is only cut off when the client stops taking data
+		void refresh_timeout(const Response &response) const {
+			if (auto connection = response.m_connection.lock())
+				set_timeout(connection, m_config.timeout_content);
+		}
+
+		/// Stops the content timeout once a part of a response has been written, while the handler prepares the next
+		void pause_timeout(const Response &response) const {
+			if (auto connection = response.m_connection.lock())
+				cancel_timeout(connection);
+		}
+
+		/// Size of the blocks send_file() reads when it cannot use sendfile(2)
+		static const size_t file_block_size = 262144;
+
+#if defined(__linux__)
+		using use_sendfile = std::integral_constant<bool, std::is_same<socket_type, asio::ip::tcp::socket>::value>;
+#else
+		using use_sendfile = std::false_type;
+#endif
+
+		/// Writes the file range with sendfile(2), waiting for the socket to become writable when its buffer is full
+		template<class Handler>
+		void write_file(const std::shared_ptr<Response> &response, const std::shared_ptr<const open_file> &file, unsigned long long offset,
+			unsigned long long length, const Handler &handler, std::true_type) {
+#if defined(__linux__)
+			auto &socket = *response->m_socket;
+			std::error_code ec;
+			if (!socket.native_non_blocking())
+				socket.native_non_blocking(true, ec);
+			//Give other connections a turn after a few blocks even if the socket keeps up
+			size_t sent = 0;
+			while (!ec && length > 0 && sent < 16 * file_block_size) {
+				auto position = static_cast<off_t>(offset);
+				auto result = ::sendfile(socket.native_handle(), file->handle(), &position, static_cast<size_t>(std::min<unsigned long long>(length, file_block_size)));
+				if (result > 0) {
+					if (m_config.metrics)
+						m_metrics.sent(static_cast<size_t>(result));
+					offset += static_cast<unsigned long long>(result);
+					length -= static_cast<unsigned long long>(result);
+					sent += static_cast<size_t>(result);
+				}
+				else if (result == 0)
+					ec = std::error_code(EIO, std::generic_category()); //The file shrank
+				else if (errno == EAGAIN || errno == EWOULDBLOCK)
+					break;
+				else if (errno != EINTR)
+					ec = std::error_code(errno, std::generic_category());
+			}
+			if (ec || length == 0) {
+				handler(ec);
+				return;
+			}
+			refresh_timeout(*response);
+			socket.async_wait(asio::ip::tcp::socket::wait_write, response->m_strand.wrap(make_recycling_handler(
+					[this, response, file, offset, length, handler](const std::error_code &ec) {
+				if (ec)
+					handler(ec);
+				else
+					write_file(response, file, offset, length, handler, std::true_type());
+			})));
+#endif
+		}
+
+		/// Writes the file range in blocks read into the response's file buffer
+		template<class Handler>
+		void write_file(const std::shared_ptr<Response> &response, const std::shared_ptr<const open_file> &file, unsigned long long offset,
+			unsigned long long length, const Handler &handler, std::false_type) {
+			if (!response->m_file_buffer)
+				response->m_file_buffer.reset(new char[file_block_size]);
+			auto data = response->m_file_buffer.get();
+			auto size = file->read(data, static_cast<size_t>(std::min<unsigned long long>(length, file_block_size)), offset);
+			if (size <= 0) {
+				handler(std::error_code(size < 0 ? errno : EIO, std::generic_category()));
+				return;
+			}
+			refresh_timeout(*response);
+			asio::async_write(*response->m_socket, asio::buffer(data, static_cast<size_t>(size)), response->m_strand.wrap(make_recycling_handler(
+					[this, response, file, offset, length, handler](const std::error_code &ec, size_t bytes_transferred) {
+				if (m_config.metrics)
+					m_metrics.sent(bytes_transferred);
+				if (ec || bytes_transferred == length)
+					handler(ec);
+				else
+					write_file(response, file, offset + bytes_transferred, length - bytes_transferred, handler, std::false_type());
+			})));
+		}
+
 		std::shared_ptr<asio::io_context> m_io_context;
 		bool m_external_context;
-		std::unique_ptr<asio::ip::tcp::acceptor> acceptor;
+		/// One io_context per shard, the first one being m_io_context
+		std::vector<std::shared_ptr<asio::io_context>> m_io_contexts;
+		/// One acceptor per shard, each bound to its shard's io_context
+		std::vector<std::shared_ptr<asio::ip::tcp::acceptor>> acceptors;
 		std::vector<std::thread> threads;
 
+		/// Open connections, see Config::max_connections
+		std::atomic<size_t> m_connections{0};
+		/// Acceptors waiting for a connection to close before accepting again
+		std::vector<asio::ip::tcp::acceptor*> m_paused_acceptors;
+		std::mutex m_accept_mutex;
+		/// Connections that have not been destroyed yet, linked through Connection::next_open, for drain()
+		Connection *m_open_connections=nullptr;
+		/// Read without the lock on every request
+		std::atomic<bool> m_draining{false};
+		bool m_drained=false;
+		std::function<void()> m_on_drained;
+		std::shared_ptr<asio::steady_timer> m_drain_timer;
+		std::mutex m_connections_mutex;
+		/// Queue monitors of the io_contexts while shedding is enabled, see Config::shed_queue_delay
+		mutable std::vector<std::shared_ptr<queue_monitor>> m_queue_monitors;
+		mutable std::mutex m_queue_monitors_mutex;
+
+		/// Threads running jobs posted to their io_context. Unlike asio::thread_pool, the io_context allocates
+		/// posted handlers through asio_handler_allocate(), so recycling handlers make jobs free of allocations.
+		class worker_pool {
+		public:
+			explicit worker_pool(size_t num_threads) : work(asio::make_work_guard(context)) {
+				for(size_t c=0; c<num_threads; c++)
+					threads.emplace_back([this]() {
+						context.run();
+					});
+			}
+			~worker_pool() {
+				context.stop();
+				for(auto& t: threads)
+					t.join();
+			}
+
+			asio::io_context context;
+		private:
+			asio::executor_work_guard<asio::io_context::executor_type> work;
+			std::vector<std::thread> threads;
+		};
+
+		/// Recorded into when Config::metrics is set; route identifiers are assigned regardless
+		mutable server_metrics m_metrics;
+
+		/// Deflaters shared by all connections, and the threads compressing large bodies
+		mutable deflater_cache m_deflaters;
+		std::unique_ptr<worker_pool> m_compression_pool;
+
+#ifdef SO_REUSEPORT
+		using reuse_port = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#endif
+
+		/// An object reused for consecutive messages of a connection. When the previous one is still referenced,
+		/// for instance because a handler kept the request, a new object is created instead.
+		template<class T>
+		class recyclable {
+		public:
+			recyclable() : m_in_use(false) {}
+
+			template<class Create>
+			T *acquire(Create &&create) {
+				if(!m_object) {
+					m_object.reset(create());
+					m_in_use=true;
+					return m_object.get();
+				}
+				if(!m_in_use.exchange(true)) {
+					m_object->reset();
+					return m_object.get();
+				}
+				return create();
+			}
+
+			void release(T *object) {
+				if(object==m_object.get())
+					m_in_use=false;
+				else
+					delete object;
+			}
+		private:
+			std::unique_ptr<T> m_object;
+			std::atomic<bool> m_in_use;
+		};
+
+		/// One accepted connection. All handlers of a connection run through its strand,
+		/// so a keep-alive connection is served sequentially even with several threads.
+		class Connection {
+		public:
+			Connection(ServerBase &server, const std::shared_ptr<socket_type> &socket) : socket(socket), strand(socket->get_io_service()),
+				timeout(timer_wheel::get(socket->get_io_service()), [this]() { expired(); }), memory(std::make_shared<webpp::arena>(512)),
+				queue(server.m_config.shed_queue_delay>0 ? queue_monitor::get(socket->get_io_service()) : nullptr), server(server) {
+				server.connection_opened(*this);
+			}
+			~Connection() {
+				server.connection_closed(*this);
+			}
+
+			std::shared_ptr<socket_type> socket;
+			asio::io_context::strand strand;
+			/// Request, content and send timeout; at most one of them is pending at any time
+			deadline timeout;
+
+			recyclable<Request> request;
+			recyclable<Response> response;
+			/// Holds the shared_ptr control blocks of the request and response, reset between requests
+			std::shared_ptr<webpp::arena> memory;
+			/// Bytes of pipelined requests that were received along with the current one
+			std::string pipelined;
+			/// Monitor of the io_context when shedding is enabled
+			std::shared_ptr<queue_monitor> queue;
+			/// Set while waiting for the next request of a keep-alive connection, which drain() may close
+			std::atomic<bool> idle{false};
+			/// List of open connections, guarded by m_connections_mutex
+			Connection *prev_open=nullptr;
+			Connection *next_open=nullptr;
+
+			/// Shuts the socket down on the connection's strand, from any thread
+			void close() {
+				auto socket = this->socket;
+				strand.post(make_recycling_handler([socket]() {
+					std::error_code ec;
+					socket->lowest_layer().shutdown(asio::ip::tcp::socket::shutdown_both, ec);
+					socket->lowest_layer().close(ec);
+				}));
+			}
+
+		private:
+			void expired() {
+				if (server.m_config.metrics)
+					server.m_metrics.error(server_error::timeout);
+				close();
+			}
+
+			ServerBase &server;
+		};
+
+		std::shared_ptr<Request> make_request(const std::shared_ptr<Connection> &connection) {
+			auto request=connection->request.acquire([&connection]() { return new Request(*connection->socket); });
+			request->m_connection=connection;
+			return std::shared_ptr<Request>(request, [connection](Request *request) {
+				connection->request.release(request);
+			}, arena_allocator<Request>(connection->memory));
+		}
+
 		ServerBase(unsigned short port) : m_config(port), m_external_context(false) {}
 
-		virtual void accept()=0;
+		/// Accepts connections on the given acceptor; the connection lives on the acceptor's io_context.
+		virtual void accept(asio::ip::tcp::acceptor &acceptor)=0;
 
-		std::shared_ptr<asio::system_timer> get_timeout_timer(const std::shared_ptr<socket_type> &socket, long seconds) {
-			if(seconds==0)
-				return nullptr;
-			auto timer = std::make_shared<asio::system_timer>(*m_io_context);
-			timer->expires_at(std::chrono::system_clock::now() + std::chrono::seconds(seconds));
-			timer->async_wait([socket](const std::error_code& ec){
-				if(!ec) {
-					std::error_code newec = ec;
-					socket->lowest_layer().shutdown(asio::ip::tcp::socket::shutdown_both, newec);
-					socket->lowest_layer().close();
+		/// Accepts the next connection after an accept completed with ec, unless the acceptor has been closed.
+		/// Waits while max_connections are open, and for a moment when the process runs out of file descriptors
+		/// or memory, rather than failing right away on the connections waiting in the backlog.
+		void accept_next(asio::ip::tcp::acceptor &acceptor, const std::error_code &ec) {
+			if(ec==asio::error::operation_aborted || !acceptor.is_open())
+				return;
+			if(ec==std::errc::too_many_files_open || ec==std::errc::too_many_files_open_in_system ||
+					ec==std::errc::no_buffer_space || ec==std::errc::not_enough_memory) {
+				auto timer=std::make_shared<asio::steady_timer>(acceptor.get_io_context(), std::chrono::milliseconds(100));
+				timer->async_wait([this, &acceptor, timer](const std::error_code& ec) {
+					if(!ec)
+						accept_next(acceptor, ec);
+				});
+				return;
+			}
+			{
+				//The connection to be accepted takes its place now, so that acceptors of other shards see it
+				std::lock_guard<std::mutex> lock(m_accept_mutex);
+				if(m_config.max_connections>0 && m_connections>=m_config.max_connections) {
+					m_paused_acceptors.push_back(&acceptor);
+					return;
 				}
-			});
-			return timer;
+				m_connections++;
+			}
+			accept(acceptor);
+		}
+
+		/// Gives up the place taken by accept_next() when the accept failed or the connection closed, resuming the
+		/// acceptors paused by max_connections
+		void release_connection() {
+			std::lock_guard<std::mutex> lock(m_accept_mutex);
+			auto open=--m_connections;
+			if(m_config.max_connections==0 || open>=m_config.max_connections)
+				return;
+			for(auto acceptor: m_paused_acceptors) {
+				acceptor->get_io_context().post([this, acceptor]() {
+					accept_next(*acceptor, std::error_code());
+				});
+			}
+			m_paused_acceptors.clear();
+		}
+
+		/// Called when a Connection is created, its place towards max_connections was taken by accept_next()
+		void connection_opened(Connection &connection) {
+			if(m_config.metrics)
+				m_metrics.connection_accepted();
+			std::lock_guard<std::mutex> lock(m_connections_mutex);
+			connection.next_open=m_open_connections;
+			if(m_open_connections)
+				m_open_connections->prev_open=&connection;
+			m_open_connections=&connection;
 		}
 
-		void read_request_and_content(const std::shared_ptr<socket_type> &socket) {
-			//Create new streambuf (Request::streambuf) for async_read_until()
+		/// Called when a Connection is destroyed, finishes drain() with the last one and otherwise resumes the
+		/// acceptors paused by max_connections
+		void connection_closed(Connection &connection) {
+			if(m_config.metrics)
+				m_metrics.connection_closed();
+			bool drained;
+			{
+				std::lock_guard<std::mutex> lock(m_connections_mutex);
+				if(connection.prev_open)
+					connection.prev_open->next_open=connection.next_open;
+				else
+					m_open_connections=connection.next_open;
+				if(connection.next_open)
+					connection.next_open->prev_open=connection.prev_open;
+				drained=m_draining && !m_open_connections;
+			}
+			if(drained)
+				finish_drain();
+			release_connection();
+		}
+
+		/// Stops accepting. Acceptors are not thread-safe, so each is closed on its own io_context, where its
+		/// accept is pending; the posted close keeps the acceptor alive until it has run.
+		void close_acceptors() const {
+			for(auto& acceptor: acceptors) {
+				auto listener=acceptor;
+				listener->get_io_context().post([listener]() {
+					std::error_code ec;
+					listener->close(ec);
+				});
+			}
+		}
+
+		/// Ends drain(), once
+		void finish_drain() {
+			std::function<void()> drained;
+			std::shared_ptr<asio::steady_timer> timer;
+			{
+				std::lock_guard<std::mutex> lock(m_connections_mutex);
+				if(!m_draining || m_drained)
+					return;
+				m_drained=true;
+				drained=std::move(m_on_drained);
+				timer=std::move(m_drain_timer);
+			}
+			//Timers are not thread safe, the timer is cancelled on its own io_context
+			if(timer)
+				timer->get_io_context().post([timer]() { timer->cancel(); });
+			if(drained)
+				drained();
+			stop();
+		}
+
+		bool draining() const {
+			return m_draining;
+		}
+
+		/// Assigns the socket of Config::listen_fd to acceptor
+		void adopt_listener(asio::ip::tcp::acceptor &acceptor) {
+			asio::ip::tcp::endpoint endpoint;
+			std::size_t size=endpoint.capacity();
+			std::error_code ec;
+			asio::detail::socket_ops::getsockname(m_config.listen_fd, endpoint.data(), &size, ec);
+			asio::detail::throw_error(ec, "getsockname");
+			endpoint.resize(size);
+			acceptor.assign(endpoint.protocol(), m_config.listen_fd);
+			acceptor.listen(m_config.backlog);
+		}
+
+		/// Returns true if requests of the connection are to be shed, see Config::shed_queue_delay
+		bool overloaded(const Connection &connection) const {
+			return connection.queue && connection.queue->delay() > std::chrono::milliseconds(m_config.shed_queue_delay);
+		}
+
+		/// Answers the request just received with 503 without calling its handler, then closes the connection
+		void shed(const std::shared_ptr<Connection> &connection) {
+			static const char response[] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+			if (m_config.metrics)
+				m_metrics.error(server_error::shed);
+			set_timeout(connection, m_config.timeout_content);
+			asio::async_write(*connection->socket, asio::buffer(response, sizeof(response) - 1), connection->strand.wrap(make_recycling_handler(
+					[this, connection](const std::error_code& /*ec*/, size_t bytes_transferred) {
+				cancel_timeout(connection);
+				if (m_config.metrics)
+					m_metrics.sent(bytes_transferred);
+			})));
+		}
+
+		/// Closes the connection unless cancel_timeout() is called within the given number of seconds (0 for no timeout).
+		/// Timeouts are rounded up to the 100 ms ticks of the io_context's timer wheel.
+		void set_timeout(const std::shared_ptr<Connection> &connection, long seconds) const {
+			if(seconds==0)
+				connection->timeout.cancel();
+			else
+				connection->timeout.expires_after(connection, std::chrono::seconds(seconds));
+		}
+
+		void cancel_timeout(const std::shared_ptr<Connection> &connection) const {
+			connection->timeout.cancel();
+		}
+
+		void read_request_and_content(const std::shared_ptr<Connection> &connection) {
+			auto &socket = connection->socket;
+			//The connection's request object, with its streambuf, is reused unless the previous request is still referenced
 			//shared_ptr is used to pass temporary objects to the asynchronous functions
-			std::shared_ptr<Request> request(new Request(*socket));
+			auto request = make_request(connection);
+			//A pipelined request may already be complete, async_read_until() then finishes without reading
+			size_t carried = connection->pipelined.size();
+			if (carried > 0) {
+				auto &pipelined = connection->pipelined;
+				request->streambuf.commit(asio::buffer_copy(request->streambuf.prepare(pipelined.size()), asio::buffer(pipelined)));
+				pipelined.clear();
+			}
+			else {
+				//Waiting for a new request, which drain() does not wait for
+				connection->idle = true;
+				if (draining())
+					return;
+			}
 
 			//Set timeout on the following asio::async-read or write function
-			auto timer = get_timeout_timer(socket, m_config.timeout_request);
+			set_timeout(connection, m_config.timeout_request);
 
-			asio::async_read_until(*socket, request->streambuf, "\r\n\r\n",
-					[this, socket, request, timer](const std::error_code& ec, size_t bytes_transferred) {
-				if(timer)
-					timer->cancel();
+			asio::async_read_until(*socket, request->read_buffer(), head_end_condition(), connection->strand.wrap(make_recycling_handler(
+					[this, connection, request, carried](const std::error_code& ec, size_t bytes_transferred) {
+				connection->idle = false;
+				cancel_timeout(connection);
+				if (m_config.metrics) {
+					request->m_timing.received = server_metrics::clock::now();
+					m_metrics.received(request->streambuf.size() - carried);
+				}
 				if(!ec) {
 					//request->streambuf.size() is not necessarily the same as bytes_transferred, from Boost-docs:
 					//"After a successful async_read_until operation, the streambuf may contain additional data beyond the delimiter"
-					//The chosen solution is to extract lines from the stream directly when parsing the header. What is left of the
-					//streambuf (maybe some bytes of the content) is appended to in the async_read-function below (for retrieving content).
-					size_t num_additional_bytes=request->streambuf.size()-bytes_transferred;
+					//The head is consumed from the streambuf when parsing it. What is left of the streambuf
+					//(maybe some bytes of the content) is appended to in the async_read-function below (for retrieving content).
+					if (!parse_request(request, bytes_transferred)) {
+						if (m_config.metrics)
+							m_metrics.error(server_error::bad_request);
+						return;
+					}
 
-					if (!parse_request(request))
+					//Upgrade connection
+					if (is_upgrade(*request)) {
+						on_upgrade(connection->socket, request);
 						return;
+					}
+					if (overloaded(*connection)) {
+						shed(connection);
+						return;
+					}
+					if (!parse_body_framing(*request)) {
+						if (m_config.metrics)
+							m_metrics.error(server_error::bad_request);
+						if (on_error)
+							on_error(request, std::error_code(EPROTO, std::generic_category()));
+						return;
+					}
 
-					//If content, read that as well
-					auto it = request->header.find("Content-Length");
-					if (it != request->header.end()) {
-						unsigned long long content_length;
-						try {
-							content_length = stoull(it->second);
-						}
-						catch (const std::exception &) {
-							if (on_error)
-								on_error(request, std::error_code(EPROTO, std::generic_category()));
-							return;
-						}
-						if (content_length > num_additional_bytes) {
-							//Set timeout on the following asio::async-read or write function
-							auto timer2 = get_timeout_timer(socket, m_config.timeout_content);
-							asio::async_read(*socket, request->streambuf,
-								asio::transfer_exactly(size_t(content_length) - num_additional_bytes),
-								[this, socket, request, timer2]
-							(const std::error_code& ec, size_t /*bytes_transferred*/) {
-								if (timer2)
-									timer2->cancel();
-								if (!ec)
-									find_resource(socket, request);
-								else if (on_error)
-									on_error(request, ec);
-							});
-						}
-						else {
-							find_resource(socket, request);
-						}
+					//The route decides whether the body is read before its handler is called
+					auto route = find_route(*request);
+					if (m_config.metrics) {
+						request->m_timing.route = route.route;
+						request->m_timing.routed = server_metrics::clock::now();
 					}
-					else {
-						find_resource(socket, request);
+					auto &body = request->m_body;
+					if (!body.chunked)
+						keep_pipelined(*connection, *request, static_cast<size_t>(std::min<unsigned long long>(body.remaining, request->streambuf.size())));
+					if (route.body == request_body::streamed || body.done) {
+						dispatch(connection, request, route);
+						return;
 					}
+					if (body.chunked) {
+						read_chunked_content(request, std::move(route));
+						return;
+					}
+
+					size_t num_additional_bytes=request->streambuf.size();
+					if (body.remaining > num_additional_bytes) {
+						//Set timeout on the following asio::async-read or write function
+						set_timeout(connection, m_config.timeout_content);
+						asio::async_read(*connection->socket, request->read_buffer(),
+							asio::transfer_exactly(size_t(body.remaining) - num_additional_bytes),
+							connection->strand.wrap(make_recycling_handler([this, connection, request, route]
+						(const std::error_code& ec, size_t bytes_transferred) {
+							cancel_timeout(connection);
+							if (m_config.metrics)
+								m_metrics.received(bytes_transferred);
+							if (!ec) {
+								request->m_body.remaining = 0;
+								request->m_body.done = true;
+								dispatch(connection, request, route);
+							}
+							else if (on_error)
+								on_error(request, ec);
+						})));
+						return;
+					}
+					body.remaining = 0;
+					body.done = true;
+					dispatch(connection, request, route);
 				}
-				else if (on_error)
-					on_error(request, ec);
-			});
+				else {
+					if (m_config.metrics && ec != asio::error::eof && ec != asio::error::operation_aborted)
+						m_metrics.error(server_error::read);
+					if (on_error)
+						on_error(request, ec);
+				}
+			})));
 		}
 
-		bool parse_request(const std::shared_ptr<Request> &request) const {
-			std::string line;
-			getline(request->content, line);
-			size_t method_end;
-			if((method_end=line.find(' '))!=std::string::npos) {
-				size_t path_end;
-				if((path_end=line.find(' ', method_end+1))!=std::string::npos) {
-					request->method=line.substr(0, method_end);
-					request->path=line.substr(method_end+1, path_end-method_end-1);
-
-					size_t protocol_end;
-					if((protocol_end=line.find('/', path_end+1))!=std::string::npos) {
-						if(line.compare(path_end+1, protocol_end-path_end-1, "HTTP")!=0)
-							return false;
-						request->http_version=line.substr(protocol_end+1, line.size()-protocol_end-2);
-					}
-					else
-						return false;
-
-					getline(request->content, line);
-					size_t param_end;
-					while((param_end=line.find(':'))!=std::string::npos) {
-						size_t value_start=param_end+1;
-						if((value_start)<line.size()) {
-							if(line[value_start]==' ')
-								value_start++;
-							if(value_start<line.size())
-								request->header.emplace(line.substr(0, param_end), line.substr(value_start, line.size() - value_start - 1));
-						}
+		/// Reads the next request of a keep-alive connection. This is posted, so that the handler that sent the
+		/// response has returned and released the previous request and response objects before they are reused.
+		void read_next_request(const std::shared_ptr<Connection> &connection) {
+			connection->strand.post(make_recycling_handler([this, connection]() {
+				read_request_and_content(connection);
+			}));
+		}
 
-						getline(request->content, line);
-					}
+		/// Moves what follows the content of request, the start of pipelined requests, to the connection.
+		/// For upgrades, the data is left to the new protocol.
+		void keep_pipelined(Connection &connection, Request &request, size_t content_length) {
+			auto size = request.streambuf.size();
+			if (size <= content_length || is_upgrade(request))
+				return;
+			auto data = asio::buffer_cast<const char*>(request.streambuf.data());
+			connection.pipelined.assign(data + content_length, size - content_length);
+			request.streambuf.truncate(size - content_length);
+		}
+
+		bool is_upgrade(const Request &request) const {
+			return on_upgrade && request.header.find("Upgrade") != request.header.end();
+		}
+
+		bool parse_request(const std::shared_ptr<Request> &request, size_t head_size) const {
+			//Parse in place on the receive buffer, the head is then copied once so that header can refer into it
+			auto data=asio::buffer_cast<const char*>(request->streambuf.data());
+			auto &parser=request->m_parser;
+			parser.reset();
+			if(parser.parse(data, head_size)!=request_parser::result::complete)
+				return false;
+
+			request->m_head.assign(data, parser.head_size());
+			request->streambuf.consume(parser.head_size());
+
+			auto head=request->m_head.data();
+			auto method=parser.method(head);
+			auto path=parser.path(head);
+			auto http_version=parser.http_version(head);
+			request->method.assign(method.data(), method.size());
+			request->path.assign(path.data(), path.size());
+			request->http_version.assign(http_version.data(), http_version.size());
+			parser.fields(head, request->header);
+			return true;
+		}
+
+		/// Sets request.m_body from the Transfer-Encoding or Content-Length field. Returns false if they are invalid.
+		static bool parse_body_framing(Request &request) {
+			auto &body = request.m_body;
+			auto encoding = request.header.find("Transfer-Encoding");
+			if (encoding != request.header.end()) {
+				//chunked must be the last coding, other codings are left to the handler
+				auto &value = encoding->second;
+				body.chunked = value.size() >= 7 && iequals(string_ref(value.data() + value.size() - 7, 7), "chunked");
+				body.done = false;
+				return body.chunked;
+			}
+			auto length = request.header.find("Content-Length");
+			if (length != request.header.end()) {
+				try {
+					body.remaining = std::stoull(length->second);
 				}
-				else
+				catch (const std::exception &) {
 					return false;
+				}
+				body.done = body.remaining == 0;
 			}
-			else
-				return false;
 			return true;
 		}
 
-		void find_resource(const std::shared_ptr<socket_type> &socket, const std::shared_ptr<Request> &request) {
-			std::lock_guard<std::mutex> lock(m_resource_mutex);
-			//Upgrade connection
-			if(on_upgrade) {
-				auto it=request->header.find("Upgrade");
-				if(it!=request->header.end()) {
-					on_upgrade(socket, request);
+		/// Handler found for a request, with the resource table that keeps it alive
+		struct route_match {
+			std::shared_ptr<const resource_table> resources;
+			const http_handler *handler = nullptr;
+			request_body body = request_body::buffered;
+			/// Identifier of the route for server_metrics
+			size_t route = 0;
+		};
+
+		/// Finds the resource for the path and method of request, and sets its keys and params
+		route_match find_route(Request &request) {
+			route_match result;
+			//The snapshot keeps the handler alive while it runs, even if the resource is removed meanwhile
+			result.resources = std::atomic_load(&m_resources);
+			//Find path- and method-match
+			auto &captures = request.m_captures;
+			auto route = result.resources->resource.match(request.path, captures, [&request](const resource_methods &methods) {
+				return methods.find(request.method) != methods.end();
+			});
+			if (route) {
+				auto &resource = route->value.find(request.method)->second;
+				request.keys = std::get<0>(resource);
+				set_params(request);
+				result.handler = &std::get<1>(resource);
+				result.body = std::get<2>(resource);
+				result.route = std::get<3>(resource);
+				return result;
+			}
+			request.params.clear();
+			auto it=result.resources->default_resource.find(request.method);
+			if(it!=result.resources->default_resource.end()) {
+				result.handler = &it->second.first;
+				result.route = it->second.second;
+			}
+			return result;
+		}
+
+		void dispatch(const std::shared_ptr<Connection> &connection, const std::shared_ptr<Request> &request, const route_match &route) {
+			if (route.handler)
+				write_response(connection, request, *route.handler);
+			else if (m_config.metrics)
+				m_metrics.error(server_error::not_found);
+		}
+
+		/// Collects a chunked body for a buffered route, then calls its handler with the decoded body as content
+		void read_chunked_content(const std::shared_ptr<Request> &request, route_match route) {
+			async_read_body(request, [this, request, route](const std::error_code &ec, string_ref fragment) {
+				if (ec) {
+					if (on_error)
+						on_error(request, ec);
 					return;
 				}
-			}
-			//Find path- and method-match, and call write_response
-			for(auto& regex_method : m_resource) {
-				auto it = regex_method.second.find(request->method);
-				if (it != regex_method.second.end()) {
-						std::smatch sm_res;
-						if (std::regex_match(request->path, sm_res, regex_method.first)) {
-							request->keys = std::get<0>(it->second);
-							for (size_t i = 0; i < request->keys.size(); i++) {
-								request->params.insert(std::pair<std::string, std::string>(request->keys[i].name, sm_res[i + 1]));
-							}
-							write_response(socket, request, std::get<1>(it->second));
-							return;
-						}
+				if (!fragment.empty()) {
+					request->m_decoded.append(fragment.data(), fragment.size());
+					read_chunked_content(request, route);
+					return;
 				}
+				auto &streambuf = request->streambuf;
+				streambuf.commit(asio::buffer_copy(streambuf.prepare(request->m_decoded.size()), asio::buffer(request->m_decoded)));
+				request->m_decoded.clear();
+				dispatch(request->m_connection.lock(), request, route);
+			});
+		}
+
+		/// Fills request.params from request.keys and the captured values
+		static void set_params(Request &request) {
+			auto &params = request.params;
+			auto &keys = request.keys;
+			auto &captures = request.m_captures;
+			size_t count = std::min(keys.size(), captures.size());
+			//A recycled request usually comes with the parameters of the same route, assign to them to reuse their storage
+			bool same_names = params.size() == count;
+			for (size_t i = 0; i < count && same_names; i++)
+				same_names = params.count(keys[i].name) != 0;
+			if (!same_names) {
+				params.clear();
+				for (size_t i = 0; i < count; i++)
+					params.insert(std::pair<std::string, std::string>(keys[i].name, captures[i].str()));
+				return;
 			}
-			auto it=m_default_resource.find(request->method);
-			if(it!=m_default_resource.end()) {
-				write_response(socket, request, it->second);
-			}
+			//In reverse, so that the first of repeated names wins as with insert()
+			for (size_t i = count; i-- > 0;)
+				params[keys[i].name].assign(captures[i].data(), captures[i].size());
 		}
 
-		void write_response(const std::shared_ptr<socket_type> &socket, const std::shared_ptr<Request> &request, http_handler& resource_function) {
+		void write_response(const std::shared_ptr<Connection> &connection, const std::shared_ptr<Request> &request, const http_handler& resource_function) {
 			//Set timeout on the following asio::async-read or write function
-			auto timer = get_timeout_timer(socket, m_config.timeout_content);
+			set_timeout(connection, m_config.timeout_content);
 
-			auto response=std::shared_ptr<Response>(new Response(socket), [this, request, timer](Response *response_ptr) {
-				auto response=std::shared_ptr<Response>(response_ptr);
-				send(response, [this, response, request, timer](const std::error_code& ec) {
-					if (timer)
-						timer->cancel();
+			//The response is sent once the handler, and whoever it passed the response to, is done with it
+			//The connection's response object is recycled once it has been written
+			auto create = [&connection]() {
+				auto response = new Response(connection->socket, connection->strand);
+				response->m_connection = connection;
+				return response;
+			};
+			auto response=std::shared_ptr<Response>(connection->response.acquire(create), [this, connection, request](Response *response_ptr) {
+				auto response=std::shared_ptr<Response>(response_ptr, [connection](Response *response) {
+					connection->response.release(response);
+				}, arena_allocator<Response>(connection->memory));
+				if (m_config.metrics)
+					request->m_timing.released = server_metrics::clock::now();
+				response->end_chunked();
+				async_send(response, [this, connection, response, request](const std::error_code& ec) {
+					cancel_timeout(connection);
+					if (m_config.metrics) {
+						auto &timing = request->m_timing;
+						m_metrics.request(timing.route, timing.routed - timing.received, timing.released - timing.called,
+							server_metrics::clock::now() - timing.released);
+						if (ec)
+							m_metrics.error(server_error::write);
+					}
 					if (!ec) {
 						if (response->close_connection_after_response)
                             return;
+						//What the handler left of a streamed body cannot be told apart from the next request
+						if (!request->m_body.done || request->m_body.error)
+							return;
+						if (response->m_close)
+							return;
 
 						auto range = request->header.equal_range("Connection");
-						case_insensitive_equals check;
 						for (auto it = range.first; it != range.second; ++it) {
-							if (check(it->second, "close")) {
+							if (iequals(it->second, "close")) {
 								return;
-							 } else if (check(it->second, "keep-alive")) {
-                                this->read_request_and_content(response->socket());
+							 } else if (iequals(it->second, "keep-alive")) {
+                                this->read_next_request(connection);
                                 return;
                             }
 						}
 						if(request->http_version >= "1.1")
-							read_request_and_content(response->socket());
+							read_next_request(connection);
 					}
 					else if (on_error)
 						on_error(request, ec);
 				});
-			});
+			}, arena_allocator<Response>(connection->memory));
+			response->m_http11 = request->http_version >= "1.1";
+			response->m_close = draining();
+			if (!response->m_http11) {
+				auto range = request->header.equal_range("Connection");
+				for (auto it = range.first; it != range.second; ++it)
+					response->m_keep_alive = response->m_keep_alive || iequals(it->second, "keep-alive");
+			}
+			if (m_config.compression && deflater::available) {
+				auto &compression = response->m_compression;
+				compression.enabled = true;
+				auto accept = request->header.find("Accept-Encoding");
+				if (accept != request->header.end())
+					compression.coding = choose_coding(accept->second);
+				compression.min_size = m_config.compression_min_size;
+				compression.level = m_config.compression_level;
+			}
 
+			if (m_config.metrics)
+				request->m_timing.called = server_metrics::clock::now();
 			try {
 				resource_function(response, request);
 			}
 			catch(const std::exception &) {
+				if (m_config.metrics)
+					m_metrics.error(server_error::handler);
 				if (on_error)
 					on_error(request, std::error_code(EPROTO, std::generic_category()));
 			}
@@ -500,23 +1918,32 @@ namespace webpp {
 	public:
 		Server() : ServerBase<HTTP>::ServerBase(80) {}
 	protected:
-		void accept() override {
+		void accept(asio::ip::tcp::acceptor &acceptor) override {
 			//Create new socket for this connection
 			//Shared_ptr is used to pass temporary objects to the asynchronous functions
-			auto socket = std::make_shared<HTTP>(*m_io_context);
+			auto socket = std::make_shared<HTTP>(acceptor.get_io_context());
 
-			acceptor->async_accept(*socket, [this, socket](const std::error_code& ec){
+			acceptor.async_accept(*socket, [this, &acceptor, socket](const std::error_code& ec){
+				//The connection counts towards max_connections before accepting the next one
+				std::shared_ptr<Connection> connection;
+				if(!ec)
+					connection=std::make_shared<Connection>(*this, socket);
+				else
+					release_connection();
 				//Immediately start accepting a new connection (if io_context hasn't been stopped)
-				if (ec != asio::error::operation_aborted)
-					accept();
+				accept_next(acceptor, ec);
 
 				if(!ec) {
 					asio::ip::tcp::no_delay option(true);
 					socket->set_option(option);
 
-					read_request_and_content(socket);
-				} else if (on_error)
-					on_error(std::shared_ptr<Request>(new Request(*socket)), ec);
+					read_request_and_content(connection);
+				} else {
+					if (m_config.metrics && ec != asio::error::operation_aborted)
+						m_metrics.error(server_error::accept);
+					if (on_error)
+						on_error(std::shared_ptr<Request>(new Request(*socket)), ec);
+				}
 			});
 		}
 	};
@@ -54,35 +54,46 @@ namespace webpp {
 	protected:
 		asio::ssl::context context;
 
-		void accept() override {
+		void accept(asio::ip::tcp::acceptor &acceptor) override {
 			//Create new socket for this connection
 			//Shared_ptr is used to pass temporary objects to the asynchronous functions
-			auto socket = std::make_shared<HTTPS>(*m_io_context, context);
-
-			acceptor->async_accept((*socket).lowest_layer(), [this, socket](const std::error_code& ec) {
+			auto socket = std::make_shared<HTTPS>(acceptor.get_io_context(), context);
+
+			acceptor.async_accept((*socket).lowest_layer(), [this, &acceptor, socket](const std::error_code& ec) {
+				//The connection counts towards max_connections before accepting the next one
+				std::shared_ptr<Connection> connection;
+				if(!ec)
+					connection = std::make_shared<Connection>(*this, socket);
+				else
+					release_connection();
 				//Immediately start accepting a new connection (if io_context hasn't been stopped)
-				if (ec != asio::error::operation_aborted)
-					accept();
-
+				accept_next(acceptor, ec);
 
 				if(!ec) {
 					asio::ip::tcp::no_delay option(true);
 					socket->lowest_layer().set_option(option);
 
 					//Set timeout on the following asio::ssl::stream::async_handshake
-					auto timer = get_timeout_timer(socket, m_config.timeout_request);
-					socket->async_handshake(asio::ssl::stream_base::server, [this, socket, timer]
+					set_timeout(connection, m_config.timeout_request);
+					socket->async_handshake(asio::ssl::stream_base::server, connection->strand.wrap([this, connection]
 							(const std::error_code& ec) {
-						if(timer)
-							timer->cancel();
+						cancel_timeout(connection);
 						if(!ec)
-							read_request_and_content(socket);
-						else if(on_error)
-							on_error(std::shared_ptr<Request>(new Request(*socket)), ec);
-					});
+							read_request_and_content(connection);
+						else {
+							if(m_config.metrics)
+								m_metrics.error(server_error::accept);
+							if(on_error)
+								on_error(std::shared_ptr<Request>(new Request(*connection->socket)), ec);
+						}
+					}));
+				}
+				else {
+					if(m_config.metrics && ec!=asio::error::operation_aborted)
+						m_metrics.error(server_error::accept);
+					if(on_error)
+						on_error(std::shared_ptr<Request>(new Request(*socket)), ec);
 				}
-				else if(on_error)
-					on_error(std::shared_ptr<Request>(new Request(*socket)), ec);
 			});
 		}
 	};
@@ -4,9 +4,10 @@
 #define SERVER_WS_HPP
 #include "path_to_regex.hpp"
 #include "crypto.hpp"
+#include "http_parser.hpp"
 
 #include "asio.h"
-#include "asio/system_timer.hpp"
+#include "timer_wheel.hpp"
 
 #include <unordered_map>
 #include <thread>
@@ -70,7 +71,8 @@ namespace webpp {
 			friend class SocketServer<socket_type>;
 
 		public:
-			explicit Connection(const std::shared_ptr<socket_type> &socket) : remote_endpoint_port(0), socket(socket), strand(socket->get_io_service()), closed(false) { }
+			explicit Connection(const std::shared_ptr<socket_type> &socket) : remote_endpoint_port(0), socket(socket), strand(socket->get_io_service()),
+				timeout(timer_wheel::get(socket->get_io_service()), [this]() { close(); }), closed(false), timer_idle(timer_wheel::get(socket->get_io_service())) { }
 
 			std::string method, path, http_version;
 
@@ -82,7 +84,8 @@ namespace webpp {
 			unsigned short remote_endpoint_port;
 
 		private:
-			explicit Connection(socket_type *socket): remote_endpoint_port(0), socket(socket), strand(socket->get_io_service()), closed(false) { }
+			explicit Connection(socket_type *socket): remote_endpoint_port(0), socket(socket), strand(socket->get_io_service()),
+				timeout(timer_wheel::get(socket->get_io_service()), [this]() { close(); }), closed(false), timer_idle(timer_wheel::get(socket->get_io_service())) { }
 
 			class SendData {
 			public:
@@ -97,6 +100,8 @@ namespace webpp {
 			std::shared_ptr<socket_type> socket;
 
 			asio::io_context::strand strand;
+			/// Handshake timeout
+			deadline timeout;
 
 			std::list<SendData> send_queue;
 
@@ -132,7 +137,17 @@ namespace webpp {
 
 			std::atomic<bool> closed;
 
-			std::unique_ptr<asio::system_timer> timer_idle;
+			deadline timer_idle;
+
+			/// Called by the timer wheel, which keeps the connection alive until then
+			void close() {
+				auto socket = this->socket;
+				strand.post([socket]() {
+					std::error_code ec;
+					socket->lowest_layer().shutdown(asio::ip::tcp::socket::shutdown_both, ec);
+					socket->lowest_layer().close(ec);
+				});
+			}
 
 			void read_remote_endpoint_data() {
 				try {
@@ -199,6 +214,10 @@ namespace webpp {
 			std::string address;
 			/// Set to false to avoid binding the socket to an address that is already in use. Defaults to true.
 			bool reuse_address=true;
+			/// Set to true to give each of the thread_pool_size threads its own io_context and acceptor bound with
+			/// SO_REUSEPORT, so the kernel balances accepts and connections never migrate between threads.
+			/// Ignored when SO_REUSEPORT is unavailable. Defaults to false.
+			bool sharded=false;
 		};
 		///Set before calling start().
 		Config config;
@@ -222,30 +241,67 @@ namespace webpp {
 			if(!io_context)
 				io_context=std::make_shared<asio::io_context>();
 
-			if(io_context->stopped())
-				io_context->reset();
-
 			asio::ip::tcp::endpoint endpoint;
 			if(config.address.size()>0)
 				endpoint=asio::ip::tcp::endpoint(asio::ip::address::from_string(config.address), config.port);
 			else
 				endpoint=asio::ip::tcp::endpoint(asio::ip::tcp::v4(), config.port);
 
-			if(!acceptor)
-				acceptor= std::make_unique<asio::ip::tcp::acceptor>(*io_context);
-			acceptor->open(endpoint.protocol());
-			acceptor->set_option(asio::socket_base::reuse_address(config.reuse_address));
-			acceptor->bind(endpoint);
-			acceptor->listen();
+			//In sharded mode every thread gets its own io_context, io_context being the first one
+			size_t num_shards=1;
+#ifdef SO_REUSEPORT
+			if(config.sharded && config.thread_pool_size>1)
+				num_shards=config.thread_pool_size;
+#endif
+			io_contexts.resize(num_shards);
+			io_contexts[0]=io_context;
+			acceptors.clear();
+			for(size_t c=0; c<num_shards; c++) {
+				if(!io_contexts[c])
+					io_contexts[c]=std::make_shared<asio::io_context>();
+				if(io_contexts[c]->stopped())
+					io_contexts[c]->reset();
+
+				auto acceptor=std::make_unique<asio::ip::tcp::acceptor>(*io_contexts[c]);
+				acceptor->open(endpoint.protocol());
+				acceptor->set_option(asio::socket_base::reuse_address(config.reuse_address));
+#ifdef SO_REUSEPORT
+				if(num_shards>1)
+					acceptor->set_option(reuse_port(true));
+#endif
+				acceptor->bind(endpoint);
+				acceptor->listen();
+				acceptors.emplace_back(std::move(acceptor));
+			}
+
+			for(auto& acceptor: acceptors)
+				accept(*acceptor);
+
+			//Run the io_contexts on thread_pool_size threads, the calling thread being one of them
+			threads.clear();
+			for(size_t c=1; c<config.thread_pool_size; c++) {
+				auto shard_io_context=io_contexts[num_shards>1 ? c : 0];
+				threads.emplace_back([shard_io_context]() {
+					shard_io_context->run();
+				});
+			}
 
-			accept();
+			if(config.thread_pool_size>0)
+				io_context->run();
 
-			io_context->run();
+			//Wait for the rest of the threads, if any, to finish as well
+			for(auto& t: threads)
+				t.join();
+			threads.clear();
 		}
 
+		/// Stops accepting, stops the io_context and closes all connections.
+		/// start() returns once all worker threads have been joined.
 		void stop() {
-			acceptor->close();
-			io_context->stop();
+			for(auto& acceptor: acceptors)
+				acceptor->close();
+			for(auto& shard_io_context: io_contexts)
+				shard_io_context->stop();
 
             for(auto &pair: endpoint) {
                 std::lock_guard<std::mutex> lock(pair.second.connections_mutex);
@@ -335,7 +391,7 @@ namespace webpp {
 		*   connection->method=std::move(request->method);
 		*   connection->path=std::move(request->path);
 		*   connection->http_version=std::move(request->http_version);
-		*   connection->header=std::move(request->header);
+		*   connection->header=request->header.materialize();
 		*   connection->remote_endpoint_address=std::move(request->remote_endpoint_address);
 		*   connection->remote_endpoint_port=request->remote_endpoint_port;
 		*   socket_server.upgrade(connection);
@@ -352,27 +408,34 @@ namespace webpp {
 	protected:
 		const std::string ws_magic_string="258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 
-		std::unique_ptr<asio::ip::tcp::acceptor> acceptor;
+		/// One io_context per shard, the first one being io_context
+		std::vector<std::shared_ptr<asio::io_context>> io_contexts;
+		/// One acceptor per shard, each bound to its shard's io_context
+		std::vector<std::unique_ptr<asio::ip::tcp::acceptor>> acceptors;
 
 		std::vector<std::thread> threads;
 
+#ifdef SO_REUSEPORT
+		using reuse_port = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+#endif
+
 		SocketServerBase(unsigned short port) :
 				config(port) {}
 
-		virtual void accept()=0;
+		/// Accepts connections on the given acceptor; the connection lives on the acceptor's io_context.
+		virtual void accept(asio::ip::tcp::acceptor &acceptor)=0;
 
-		std::shared_ptr<asio::system_timer> get_timeout_timer(const std::shared_ptr<Connection> &connection, size_t seconds) {
+		/// Closes the connection unless cancel_timeout() is called within the given number of seconds (0 for no timeout).
+		/// Timeouts are rounded up to the 100 ms ticks of the io_context's timer wheel.
+		void set_timeout(const std::shared_ptr<Connection> &connection, size_t seconds) {
 			if (seconds == 0)
-				return nullptr;
-			auto timer = std::make_shared<asio::system_timer>(connection->socket->get_io_service());
-			timer->expires_at(std::chrono::system_clock::now() + std::chrono::seconds(static_cast<long>(seconds)));
-			timer->async_wait([connection](const std::error_code& ec){
-				if(!ec) {
-					connection->socket->lowest_layer().shutdown(asio::ip::tcp::socket::shutdown_both);
-					connection->socket->lowest_layer().close();
-				}
-			});
-			return timer;
+				connection->timeout.cancel();
+			else
+				connection->timeout.expires_after(connection, std::chrono::seconds(static_cast<long>(seconds)));
+		}
+
+		void cancel_timeout(const std::shared_ptr<Connection> &connection) {
+			connection->timeout.cancel();
 		}
 
 		void read_handshake(const std::shared_ptr<Connection> &connection) {
@@ -383,53 +446,35 @@ namespace webpp {
 			auto read_buffer = std::make_shared<asio::streambuf>();
 
 			//Set timeout on the following asio::async-read or write function
-			auto timer = get_timeout_timer(connection, config.timeout_request);
+			set_timeout(connection, config.timeout_request);
 
-			asio::async_read_until(*connection->socket, *read_buffer, "\r\n\r\n",
-					[this, connection, read_buffer, timer]
-					(const std::error_code& ec, size_t /*bytes_transferred*/) {
-				if(timer)
-					timer->cancel();
+			asio::async_read_until(*connection->socket, *read_buffer, head_end_condition(), connection->strand.wrap(
+					[this, connection, read_buffer]
+					(const std::error_code& ec, size_t bytes_transferred) {
+				cancel_timeout(connection);
 				if(!ec) {
-					//Convert to istream to extract string-lines
-					std::istream stream(read_buffer.get());
-
-					parse_handshake(connection, stream);
-
-					write_handshake(connection, read_buffer);
+					if(parse_handshake(connection, *read_buffer, bytes_transferred))
+						write_handshake(connection, read_buffer);
 				}
-			});
+			}));
 		}
 
-		void parse_handshake(const std::shared_ptr<Connection> &connection, std::istream& stream) const {
-			std::string line;
-			getline(stream, line);
-			size_t method_end;
-			if((method_end=line.find(' '))!=std::string::npos) {
-				size_t path_end;
-				if((path_end=line.find(' ', method_end+1))!=std::string::npos) {
-					connection->method=line.substr(0, method_end);
-					connection->path=line.substr(method_end+1, path_end-method_end-1);
-					if((path_end+6)<line.size())
-						connection->http_version=line.substr(path_end+6, line.size()-(path_end+6)-1);
-					else
-						connection->http_version="1.1";
-
-					getline(stream, line);
-					size_t param_end;
-					while((param_end=line.find(':'))!=std::string::npos) {
-						size_t value_start=param_end+1;
-						if((value_start)<line.size()) {
-							if(line[value_start]==' ')
-								value_start++;
-							if(value_start<line.size())
-								connection->header.emplace(line.substr(0, param_end), line.substr(value_start, line.size()-value_start-1));
-						}
+		bool parse_handshake(const std::shared_ptr<Connection> &connection, asio::streambuf &read_buffer, size_t head_size) const {
+			auto data=asio::buffer_cast<const char*>(read_buffer.data());
+			request_parser parser;
+			if(parser.parse(data, head_size)!=request_parser::result::complete)
+				return false;
 
-						getline(stream, line);
-					}
-				}
-			}
+			connection->method=parser.method(data);
+			connection->path=parser.path(data);
+			connection->http_version=parser.http_version(data);
+			header_fields header;
+			parser.fields(data, header);
+			for(auto& field: header)
+				connection->header.emplace(field.first, field.second);
+
+			read_buffer.consume(parser.head_size());
+			return true;
 		}
 
 		void write_handshake(const std::shared_ptr<Connection> &connection, const std::shared_ptr<asio::streambuf> &read_buffer) {
@@ -443,7 +488,7 @@ namespace webpp {
 					if(generate_handshake(connection, handshake)) {
 						connection->path_match=std::move(path_match);
 						//Capture write_buffer in lambda so it is not destroyed before async_write is finished
-						asio::async_write(*connection->socket, *write_buffer,
+						asio::async_write(*connection->socket, *write_buffer, connection->strand.wrap(
 								[this, connection, write_buffer, read_buffer, &regex_endpoint]
 								(const std::error_code& ec, size_t /*bytes_transferred*/) {
 							if(!ec) {
@@ -452,7 +497,7 @@ namespace webpp {
 							}
 							else
 								connection_error(connection, regex_endpoint.second, ec);
-						});
+						}));
 					}
 					return;
 				}
@@ -477,7 +522,7 @@ namespace webpp {
 
 		void read_message(const std::shared_ptr<Connection> &connection,
 						  const std::shared_ptr<asio::streambuf> &read_buffer, Endpoint& endpoint) const {
-			asio::async_read(*connection->socket, *read_buffer, asio::transfer_exactly(2),
+			asio::async_read(*connection->socket, *read_buffer, asio::transfer_exactly(2), connection->strand.wrap(
 					[this, connection, read_buffer, &endpoint]
 					(const std::error_code& ec, size_t bytes_transferred) {
 				if(!ec) {
@@ -505,7 +550,7 @@ namespace webpp {
 
 					if(length==126) {
 						//2 next bytes is the size of content
-						asio::async_read(*connection->socket, *read_buffer, asio::transfer_exactly(2),
+						asio::async_read(*connection->socket, *read_buffer, asio::transfer_exactly(2), connection->strand.wrap(
 								[this, connection, read_buffer, &endpoint, fin_rsv_opcode]
 								(const std::error_code& ec, size_t /*bytes_transferred*/) {
 							if(!ec) {
@@ -524,11 +569,11 @@ namespace webpp {
 							}
 							else
 								connection_error(connection, endpoint, ec);
-						});
+						}));
 					}
 					else if(length==127) {
 						//8 next bytes is the size of content
-						asio::async_read(*connection->socket, *read_buffer, asio::transfer_exactly(8),
+						asio::async_read(*connection->socket, *read_buffer, asio::transfer_exactly(8), connection->strand.wrap(
 								[this, connection, read_buffer, &endpoint, fin_rsv_opcode]
 								(const std::error_code& ec, size_t /*bytes_transferred*/) {
 							if(!ec) {
@@ -547,19 +592,19 @@ namespace webpp {
 							}
 							else
 								connection_error(connection, endpoint, ec);
-						});
+						}));
 					}
 					else
 						read_message_content(connection, read_buffer, length, endpoint, fin_rsv_opcode);
 				}
 				else
 					connection_error(connection, endpoint, ec);
-			});
+			}));
 		}
 
 		void read_message_content(const std::shared_ptr<Connection> &connection, const std::shared_ptr<asio::streambuf> &read_buffer,
 								  size_t length, Endpoint& endpoint, unsigned char fin_rsv_opcode) const {
-			asio::async_read(*connection->socket, *read_buffer, asio::transfer_exactly(4+length),
+			asio::async_read(*connection->socket, *read_buffer, asio::transfer_exactly(4+length), connection->strand.wrap(
 					[this, connection, read_buffer, length, &endpoint, fin_rsv_opcode]
 					(const std::error_code& ec, size_t /*bytes_transferred*/) {
 				if(!ec) {
@@ -611,7 +656,7 @@ namespace webpp {
 				}
 				else
 					connection_error(connection, endpoint, ec);
-			});
+			}));
 		}
 
 		void connection_open(const std::shared_ptr<Connection> &connection, Endpoint& endpoint) {
@@ -654,24 +699,28 @@ namespace webpp {
 
 		void timer_idle_init(const std::shared_ptr<Connection> &connection) {
 			if(config.timeout_idle>0) {
-				connection->timer_idle= std::make_unique<asio::system_timer>(connection->socket->get_io_service());
-				connection->timer_idle->expires_from_now(std::chrono::seconds(static_cast<unsigned long>(config.timeout_idle)));
 				timer_idle_expired_function(connection);
+				connection->timer_idle.expires_after(connection, std::chrono::seconds(static_cast<long>(config.timeout_idle)));
 			}
 		}
 		void timer_idle_reset(const std::shared_ptr<Connection> &connection) const {
-			if(config.timeout_idle>0 && connection->timer_idle->expires_from_now(std::chrono::seconds(static_cast<unsigned long>(config.timeout_idle)))>0)
-				timer_idle_expired_function(connection);
+			if(config.timeout_idle>0)
+				connection->timer_idle.extend(std::chrono::seconds(static_cast<long>(config.timeout_idle)));
 		}
 		void timer_idle_cancel(const std::shared_ptr<Connection> &connection) const {
-			if(config.timeout_idle>0)
-				connection->timer_idle->cancel();
+			connection->timer_idle.cancel();
 		}
 
 		void timer_idle_expired_function(const std::shared_ptr<Connection> &connection) const {
-			connection->timer_idle->async_wait([this, connection](const std::error_code& ec){
-				if(!ec)
-					send_close(connection, 1000, "idle timeout"); //1000=normal closure
+			//The wheel keeps the connection alive while the timer is armed, so the handler only holds a weak reference
+			std::weak_ptr<Connection> weak_connection = connection;
+			connection->timer_idle.on_expired([this, weak_connection]() {
+				auto connection = weak_connection.lock();
+				if(connection) {
+					connection->strand.post([this, connection]() {
+						send_close(connection, 1000, "idle timeout"); //1000=normal closure
+					});
+				}
 			});
 		}
 	};
@@ -692,15 +741,15 @@ namespace webpp {
 	public:
 		SocketServer() : SocketServerBase<WS>(80) {}
 	protected:
-		void accept() override {
+		void accept(asio::ip::tcp::acceptor &acceptor) override {
 			//Create new socket for this connection (stored in Connection::socket)
 			//Shared_ptr is used to pass temporary objects to the asynchronous functions
-			std::shared_ptr<Connection> connection(new Connection(new WS(*io_context)));
+			std::shared_ptr<Connection> connection(new Connection(new WS(acceptor.get_io_context())));
 
-			acceptor->async_accept(*connection->socket, [this, connection](const std::error_code& ec) {
+			acceptor.async_accept(*connection->socket, [this, &acceptor, connection](const std::error_code& ec) {
 				//Immediately start accepting a new connection (if io_context hasn't been stopped)
 				if (ec != asio::error::operation_aborted)
-					accept();
+					accept(acceptor);
 
 				if(!ec) {
 					asio::ip::tcp::no_delay option(true);
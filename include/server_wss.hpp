@@ -43,29 +43,28 @@ namespace webpp {
 	protected:
 		asio::ssl::context context;
 
-		void accept() override {
+		void accept(asio::ip::tcp::acceptor &acceptor) override {
 			//Create new socket for this connection (stored in Connection::socket)
 			//Shared_ptr is used to pass temporary objects to the asynchronous functions
-			std::shared_ptr<Connection> connection(new Connection(new WSS(*io_context, context)));
+			std::shared_ptr<Connection> connection(new Connection(new WSS(acceptor.get_io_context(), context)));
 
-			acceptor->async_accept(connection->socket->lowest_layer(), [this, connection](const std::error_code& ec) {
+			acceptor.async_accept(connection->socket->lowest_layer(), [this, &acceptor, connection](const std::error_code& ec) {
 				//Immediately start accepting a new connection (if io_context hasn't been stopped)
 				if (ec != asio::error::operation_aborted)
-					accept();
+					accept(acceptor);
 
 				if(!ec) {
 					asio::ip::tcp::no_delay option(true);
 					connection->socket->lowest_layer().set_option(option);
 
 					//Set timeout on the following asio::ssl::stream::async_handshake
-					auto timer = get_timeout_timer(connection, config.timeout_request);
-					connection->socket->async_handshake(asio::ssl::stream_base::server,
-							[this, connection, timer](const std::error_code& ec) {
-						if(timer)
-							timer->cancel();
+					set_timeout(connection, config.timeout_request);
+					connection->socket->async_handshake(asio::ssl::stream_base::server, connection->strand.wrap(
+							[this, connection](const std::error_code& ec) {
+						cancel_timeout(connection);
 						if(!ec)
 							read_handshake(connection);
-					});
+					}));
 				}
 			});
 		}
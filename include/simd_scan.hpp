@@ -0,0 +1,181 @@
+// license:MIT
+// copyright-holders:Miodrag Milanovic
+#ifndef SIMD_SCAN_HPP
+#define SIMD_SCAN_HPP
+
+#include <cstddef>
+#include <cstring>
+#include <utility>
+
+// Vectorized delimiter scanning for the HTTP head parsers. AVX2 is used when the compiler targets it
+// (for instance with -mavx2), SSE2 on any other x86-64 build and a plain loop everywhere else.
+// Define WEBPP_SCAN_SCALAR to force the plain loop.
+#if !defined(WEBPP_SCAN_SCALAR)
+#if defined(__AVX2__)
+#define WEBPP_SCAN_AVX2
+#define WEBPP_SCAN_SSE2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define WEBPP_SCAN_SSE2
+#endif
+#endif
+
+#if defined(WEBPP_SCAN_AVX2)
+#include <immintrin.h>
+#elif defined(WEBPP_SCAN_SSE2)
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER) && defined(WEBPP_SCAN_SSE2)
+#include <intrin.h>
+#endif
+
+namespace webpp {
+	namespace scan_detail {
+#if defined(WEBPP_SCAN_SSE2)
+		inline unsigned first_bit(unsigned mask) {
+#if defined(_MSC_VER)
+			unsigned long index;
+			_BitScanForward(&index, mask);
+			return static_cast<unsigned>(index);
+#else
+			return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+		}
+#endif
+
+		/// Returns the first position in [begin, end) holding c1, c2 or c3, or end.
+		inline const char *find_any(const char *begin, const char *end, char c1, char c2, char c3) {
+#if defined(WEBPP_SCAN_AVX2)
+			const __m256i v1_32 = _mm256_set1_epi8(c1);
+			const __m256i v2_32 = _mm256_set1_epi8(c2);
+			const __m256i v3_32 = _mm256_set1_epi8(c3);
+			while (end - begin >= 32) {
+				__m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+				__m256i eq = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, v1_32), _mm256_cmpeq_epi8(chunk, v2_32)),
+					_mm256_cmpeq_epi8(chunk, v3_32));
+				unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(eq));
+				if (mask)
+					return begin + first_bit(mask);
+				begin += 32;
+			}
+#endif
+#if defined(WEBPP_SCAN_SSE2)
+			const __m128i v1 = _mm_set1_epi8(c1);
+			const __m128i v2 = _mm_set1_epi8(c2);
+			const __m128i v3 = _mm_set1_epi8(c3);
+			while (end - begin >= 16) {
+				__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+				__m128i eq = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, v1), _mm_cmpeq_epi8(chunk, v2)), _mm_cmpeq_epi8(chunk, v3));
+				unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(eq));
+				if (mask)
+					return begin + first_bit(mask);
+				begin += 16;
+			}
+#endif
+			for (; begin != end; ++begin) {
+				if (*begin == c1 || *begin == c2 || *begin == c3)
+					return begin;
+			}
+			return end;
+		}
+	}
+
+	/// Returns the first position in [begin, end) holding c, or end.
+	inline const char *scan_for(const char *begin, const char *end, char c) {
+		return scan_detail::find_any(begin, end, c, c, c);
+	}
+
+	/// Returns the first position in [begin, end) holding c1 or c2, or end.
+	inline const char *scan_for_any(const char *begin, const char *end, char c1, char c2) {
+		return scan_detail::find_any(begin, end, c1, c2, c2);
+	}
+
+	/// Returns the first position in [begin, end) holding c1, c2 or c3, or end.
+	inline const char *scan_for_any(const char *begin, const char *end, char c1, char c2, char c3) {
+		return scan_detail::find_any(begin, end, c1, c2, c3);
+	}
+
+	/// Returns the position of the first "\r\n\r\n" in [begin, end), or end.
+	inline const char *scan_for_head_end(const char *begin, const char *end) {
+#if defined(WEBPP_SCAN_AVX2)
+		const __m256i cr32 = _mm256_set1_epi8('\r');
+		const __m256i lf32 = _mm256_set1_epi8('\n');
+		while (end - begin >= 32 + 3) {
+			__m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+			__m256i b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin + 1));
+			__m256i b2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin + 2));
+			__m256i b3 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin + 3));
+			__m256i eq = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(b0, cr32), _mm256_cmpeq_epi8(b1, lf32)),
+				_mm256_and_si256(_mm256_cmpeq_epi8(b2, cr32), _mm256_cmpeq_epi8(b3, lf32)));
+			unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(eq));
+			if (mask)
+				return begin + scan_detail::first_bit(mask);
+			begin += 32;
+		}
+#endif
+#if defined(WEBPP_SCAN_SSE2)
+		const __m128i cr = _mm_set1_epi8('\r');
+		const __m128i lf = _mm_set1_epi8('\n');
+		while (end - begin >= 16 + 3) {
+			__m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+			__m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin + 1));
+			__m128i b2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin + 2));
+			__m128i b3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin + 3));
+			__m128i eq = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, cr), _mm_cmpeq_epi8(b1, lf)),
+				_mm_and_si128(_mm_cmpeq_epi8(b2, cr), _mm_cmpeq_epi8(b3, lf)));
+			unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(eq));
+			if (mask)
+				return begin + scan_detail::first_bit(mask);
+			begin += 16;
+		}
+#endif
+		while (end - begin >= 4) {
+			begin = scan_for(begin, end - 3, '\r');
+			if (begin == end - 3)
+				break;
+			if (begin[1] == '\n' && begin[2] == '\r' && begin[3] == '\n')
+				return begin;
+			++begin;
+		}
+		return end;
+	}
+
+	/// MatchCondition for asio::async_read_until() that completes after the "\r\n\r\n" ending an HTTP head.
+	/// The buffer sequence is expected to be contiguous, as is the case for asio::streambuf; otherwise
+	/// the search falls back to a plain loop.
+	class head_end_condition {
+	public:
+		template <class Iterator>
+		std::pair<Iterator, bool> operator()(Iterator begin, Iterator end) const {
+			auto size = end - begin;
+			if (size < 4)
+				return std::make_pair(begin, false);
+
+			const char *first = &*begin;
+			if (&*(end - 1) - first == size - 1) {
+				const char *found = scan_for_head_end(first, first + size);
+				if (found != first + size)
+					return std::make_pair(begin + ((found - first) + 4), true);
+			}
+			else {
+				for (auto it = begin; end - it >= 4; ++it) {
+					if (it[0] == '\r' && it[1] == '\n' && it[2] == '\r' && it[3] == '\n')
+						return std::make_pair(it + 4, true);
+				}
+			}
+			//The last three bytes may start a delimiter completed by the next read
+			return std::make_pair(end - 3, false);
+		}
+	};
+}
+
+namespace asio {
+	template <class T> struct is_match_condition;
+
+	template <>
+	struct is_match_condition<webpp::head_end_condition> {
+		enum { value = true };
+	};
+}
+
+#endif  /* SIMD_SCAN_HPP */
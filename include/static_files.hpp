@@ -0,0 +1,228 @@
+// license:MIT
+// copyright-holders:Miodrag Milanovic
+#ifndef STATIC_FILES_HPP
+#define STATIC_FILES_HPP
+
+#include "server_http.hpp"
+#include "file_cache.hpp"
+#include "mime_types.hpp"
+
+#include <cstdio>
+#include <memory>
+#include <string>
+
+namespace webpp {
+	/// Returns true if the comma-separated list of entity tags is "*" or includes etag, ignoring weakness
+	inline bool etag_listed(const string_ref &list, const string_ref &etag) {
+		auto pos = list.begin();
+		auto end = list.end();
+		while (pos != end) {
+			while (pos != end && (*pos == ' ' || *pos == '\t' || *pos == ','))
+				++pos;
+			auto first = pos;
+			while (pos != end && *pos != ',')
+				++pos;
+			auto last = pos;
+			while (last != first && (last[-1] == ' ' || last[-1] == '\t'))
+				--last;
+			if (last - first >= 2 && first[0] == 'W' && first[1] == '/')
+				first += 2;
+			string_ref tag(first, static_cast<size_t>(last - first));
+			if (tag == "*" || tag == etag)
+				return true;
+		}
+		return false;
+	}
+
+	/// Appends the path of a request target, without its query and percent-decoded, to path. Returns false for
+	/// targets not starting with '/' and for paths with NUL characters, backslashes or ".." segments, decoded or not.
+	inline bool decode_target_path(const std::string &target, std::string &path) {
+		auto hex_value = [](char c) {
+			if (c >= '0' && c <= '9')
+				return c - '0';
+			if (c >= 'a' && c <= 'f')
+				return c - 'a' + 10;
+			if (c >= 'A' && c <= 'F')
+				return c - 'A' + 10;
+			return -1;
+		};
+		auto end = target.find('?');
+		if (end == std::string::npos)
+			end = target.size();
+		if (end == 0 || target[0] != '/')
+			return false;
+
+		auto start = path.size();
+		for (size_t c = 0; c < end; c++) {
+			char ch = target[c];
+			if (ch == '%' && c + 2 < end && hex_value(target[c + 1]) >= 0 && hex_value(target[c + 2]) >= 0) {
+				ch = static_cast<char>(hex_value(target[c + 1]) * 16 + hex_value(target[c + 2]));
+				c += 2;
+			}
+			if (ch == '\0' || ch == '\\')
+				return false;
+			path += ch;
+		}
+
+		//No ".." segments, decoded or not
+		size_t segment = start + 1;
+		while (segment <= path.size()) {
+			auto next = path.find('/', segment);
+			if (next == std::string::npos)
+				next = path.size();
+			if (path.compare(segment, next - segment, "..") == 0)
+				return false;
+			segment = next + 1;
+		}
+		return true;
+	}
+
+	/// Returns true if the conditional fields of a request show that the client's copy of a resource is current.
+	/// If-None-Match takes precedence over If-Modified-Since.
+	inline bool not_modified(const header_fields &header, const string_ref &etag, std::time_t modified) {
+		auto none_match = header.find("If-None-Match");
+		if (none_match != header.end())
+			return etag_listed(none_match->second, etag);
+		auto modified_since = header.find("If-Modified-Since");
+		std::time_t time;
+		return modified_since != header.end() && parse_http_date(modified_since->second, time) && modified <= time;
+	}
+
+	/// Request handler serving the files below a document root, to be registered for GET and HEAD:
+	///
+	///     webpp::static_files<webpp::HTTP> files(server, "web");
+	///     server.on_get(files);
+	///     server.on_head(files);
+	///
+	/// Files are kept open in a file_cache and sent with ServerBase::send_file(). Requests with If-None-Match or
+	/// If-Modified-Since are answered with 304 when the file did not change, and a Range of a single byte range
+	/// with 206. Copies of the handler share their cache.
+	template<class socket_type>
+	class static_files {
+	public:
+		using server_type = ServerBase<socket_type>;
+		using Response = typename server_type::Response;
+		using Request = typename server_type::Request;
+
+		/// index is served for paths ending with '/'
+		static_files(server_type &server, std::string root, std::string index = "index.html") : m_server(&server),
+			m_root(std::move(root)), m_index(std::move(index)), m_cache(std::make_shared<file_cache>()) {
+			while (!m_root.empty() && m_root.back() == '/')
+				m_root.pop_back();
+		}
+
+		void operator()(std::shared_ptr<Response> response, std::shared_ptr<Request> request) const {
+			std::string path;
+			if (!map_path(request->path, path)) {
+				response->status(400).send(std::string("Bad Request"));
+				return;
+			}
+			auto file = m_cache->open(path);
+			if (!file) {
+				response->status(404).send(std::string("Not Found"));
+				return;
+			}
+
+			auto size = file->size();
+			response->type(path_to_type(path));
+			response->header("Last-Modified", file->last_modified());
+			response->header("ETag", file->etag());
+			response->header("Accept-Ranges", "bytes");
+			if (not_modified(request->header, file->etag(), file->modified())) {
+				response->status(304).send_head(size);
+				return;
+			}
+
+			unsigned long long offset = 0, length = size;
+			char content_range[80];
+			switch (parse_range(*request, *file, offset, length)) {
+			case range::unsatisfiable:
+				std::snprintf(content_range, sizeof(content_range), "bytes */%llu", size);
+				response->header("Content-Range", content_range);
+				response->status(416).send_head(0);
+				return;
+			case range::partial:
+				std::snprintf(content_range, sizeof(content_range), "bytes %llu-%llu/%llu", offset, offset + length - 1, size);
+				response->header("Content-Range", content_range);
+				response->status(206);
+				break;
+			case range::whole:
+				response->status(200);
+				break;
+			}
+			response->send_head(length);
+			if (request->method != "HEAD")
+				m_server->send_file(response, file, offset, length);
+		}
+	private:
+		enum class range { whole, partial, unsatisfiable };
+
+		/// Maps the path of a request to a file below the root. Returns false for paths that would leave the root.
+		bool map_path(const std::string &target, std::string &path) const {
+			path = m_root;
+			if (!decode_target_path(target, path))
+				return false;
+			if (path.back() == '/')
+				path += m_index;
+			return true;
+		}
+
+		static bool parse_number(const std::string &str, unsigned long long &number) {
+			if (str.empty())
+				return false;
+			number = 0;
+			for (auto c : str) {
+				if (c < '0' || c > '9' || number > (~0ull - 9) / 10)
+					return false;
+				number = number * 10 + static_cast<unsigned long long>(c - '0');
+			}
+			return true;
+		}
+
+		/// Parses a Range field with a single byte range. Several ranges are not supported, the whole file is
+		/// sent instead as the standard allows, as it is for a Range with an If-Range that does not match.
+		static range parse_range(const Request &request, const open_file &file, unsigned long long &offset, unsigned long long &length) {
+			auto field = request.header.find("Range");
+			if (field == request.header.end())
+				return range::whole;
+			auto if_range = request.header.find("If-Range");
+			if (if_range != request.header.end() && if_range->second != file.etag() && if_range->second != file.last_modified())
+				return range::whole;
+
+			auto value = field->second.str();
+			auto dash = value.find('-');
+			if (value.compare(0, 6, "bytes=") != 0 || value.find(',') != std::string::npos || dash == std::string::npos)
+				return range::whole;
+			auto first_text = value.substr(6, dash - 6);
+			auto last_text = value.substr(dash + 1);
+			auto size = file.size();
+			unsigned long long first, last;
+			if (first_text.empty()) {
+				//The last bytes of the file
+				if (!parse_number(last_text, last))
+					return range::whole;
+				if (last == 0 || size == 0)
+					return range::unsatisfiable;
+				offset = size - std::min(last, size);
+				length = size - offset;
+				return range::partial;
+			}
+			if (!parse_number(first_text, first) || (!last_text.empty() && (!parse_number(last_text, last) || last < first)))
+				return range::whole;
+			if (first >= size)
+				return range::unsatisfiable;
+			if (last_text.empty() || last >= size)
+				last = size - 1;
+			offset = first;
+			length = last - first + 1;
+			return range::partial;
+		}
+
+		server_type *m_server;
+		std::string m_root;
+		std::string m_index;
+		std::shared_ptr<file_cache> m_cache;
+	};
+}
+
+#endif  /* STATIC_FILES_HPP */
@@ -0,0 +1,275 @@
+// license:MIT
+// copyright-holders:Miodrag Milanovic
+#ifndef TIMER_WHEEL_HPP
+#define TIMER_WHEEL_HPP
+
+#include "asio.h"
+#include "asio/steady_timer.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace webpp {
+	class deadline;
+
+	/// Hierarchical timing wheel for connection timeouts, one per io_context (see get()).
+	///
+	/// Deadlines are kept with a resolution of one tick (100 ms) of std::chrono::steady_clock, so changes of the
+	/// system clock do not affect them. The wheel has four levels of 64 slots, each level covering 64 times the
+	/// span of the previous one, and deadlines move down a level when the lower level wraps around. Arming and
+	/// cancelling a deadline is O(1) and does not involve asio's timer queue: the wheel keeps a single asio timer
+	/// waiting for the next tick, and only while deadlines are armed.
+	class timer_wheel : public std::enable_shared_from_this<timer_wheel> {
+		friend class deadline;
+	public:
+		using clock = std::chrono::steady_clock;
+
+		explicit timer_wheel(asio::io_context &io_context) : m_timer(new asio::steady_timer(io_context)), m_start(clock::now()),
+			m_now(0), m_armed(0), m_waiting(false) {
+			for (auto &level : m_slots) {
+				for (auto &slot : level)
+					slot.prev = slot.next = &slot;
+			}
+			m_expired.prev = m_expired.next = &m_expired;
+		}
+		timer_wheel(const timer_wheel&) = delete;
+		timer_wheel &operator=(const timer_wheel&) = delete;
+
+		/// Returns the wheel of io_context, creating it on first use.
+		static std::shared_ptr<timer_wheel> get(asio::io_context &io_context) {
+			return asio::use_service<service>(io_context).wheel();
+		}
+
+		/// Resolution of the wheel.
+		static clock::duration tick() { return std::chrono::milliseconds(100); }
+
+	private:
+		struct node {
+			node *prev = nullptr;
+			node *next = nullptr;
+			/// Tick at which the deadline expires
+			uint64_t expiry = 0;
+		};
+
+		/// Owns the wheel on behalf of the io_context and stops it when the io_context shuts down
+		class service : public asio::detail::service_base<service> {
+		public:
+			explicit service(asio::io_context &io_context) : asio::detail::service_base<service>(io_context),
+				m_wheel(std::make_shared<timer_wheel>(io_context)) {}
+			const std::shared_ptr<timer_wheel> &wheel() const { return m_wheel; }
+		private:
+			void shutdown() override { m_wheel->shutdown(); }
+			std::shared_ptr<timer_wheel> m_wheel;
+		};
+
+		static const unsigned level_bits = 6;
+		static const unsigned slots_per_level = 1u << level_bits;
+		static const unsigned levels = 4;
+
+		std::mutex m_mutex;
+		/// Reset when the io_context shuts down, after which deadlines are no longer armed
+		std::unique_ptr<asio::steady_timer> m_timer;
+		clock::time_point m_start;
+		/// Last tick processed
+		uint64_t m_now;
+		size_t m_armed;
+		bool m_waiting;
+		node m_slots[levels][slots_per_level];
+		/// Deadlines that expired and whose handler has not been called yet
+		node m_expired;
+
+		uint64_t current_tick() const {
+			return static_cast<uint64_t>((clock::now() - m_start) / tick());
+		}
+
+		static void unlink(node &entry) {
+			entry.prev->next = entry.next;
+			entry.next->prev = entry.prev;
+			entry.prev = entry.next = nullptr;
+		}
+
+		static void push_back(node &list, node &entry) {
+			entry.prev = list.prev;
+			entry.next = &list;
+			list.prev->next = &entry;
+			list.prev = &entry;
+		}
+
+		void insert(node &entry) {
+			uint64_t delta = entry.expiry > m_now ? entry.expiry - m_now : 0;
+			unsigned level = 0;
+			while (level + 1 < levels && delta >= (uint64_t(1) << (level_bits * (level + 1))))
+				level++;
+			if (delta >= (uint64_t(1) << (level_bits * levels))) {
+				//Beyond the span of the wheel, expire at its end instead
+				entry.expiry = m_now + (uint64_t(1) << (level_bits * levels)) - 1;
+			}
+			push_back(m_slots[level][(entry.expiry >> (level_bits * level)) & (slots_per_level - 1)], entry);
+		}
+
+		/// Processes one tick, moving the deadlines that expire into m_expired
+		void advance() {
+			m_now++;
+			for (unsigned level = 1; level < levels; level++) {
+				if ((m_now & ((uint64_t(1) << (level_bits * level)) - 1)) != 0)
+					break;
+				auto &slot = m_slots[level][(m_now >> (level_bits * level)) & (slots_per_level - 1)];
+				while (slot.next != &slot) {
+					auto entry = slot.next;
+					unlink(*entry);
+					insert(*entry);
+				}
+			}
+			auto &slot = m_slots[0][m_now & (slots_per_level - 1)];
+			while (slot.next != &slot) {
+				auto entry = slot.next;
+				unlink(*entry);
+				push_back(m_expired, *entry);
+			}
+		}
+
+		void schedule() {
+			m_waiting = true;
+			auto self = shared_from_this();
+			m_timer->expires_at(m_start + tick() * static_cast<clock::rep>(m_now + 1));
+			m_timer->async_wait([self](const std::error_code &ec) {
+				self->on_tick(ec);
+			});
+		}
+
+		inline void on_tick(const std::error_code &ec);
+
+		inline void shutdown();
+	};
+
+	/// A timeout that can be armed on a timer_wheel, typically one per connection.
+	///
+	/// While armed, the deadline keeps its owner (the connection) alive. When it expires, the handler is called
+	/// from the thread running the wheel's io_context, without any strand, so it should post its work to the
+	/// connection's strand.
+	class deadline : private timer_wheel::node {
+		friend class timer_wheel;
+	public:
+		explicit deadline(const std::shared_ptr<timer_wheel> &wheel, std::function<void()> handler = nullptr) : m_wheel(wheel), m_handler(std::move(handler)) {}
+		deadline(const deadline&) = delete;
+		deadline &operator=(const deadline&) = delete;
+		~deadline() { cancel(); }
+
+		/// Sets the function called on expiry. Not to be called while the deadline is armed.
+		void on_expired(std::function<void()> handler) { m_handler = std::move(handler); }
+
+		/// Arms the deadline, replacing an earlier expiry.
+		void expires_after(const std::shared_ptr<void> &owner, timer_wheel::clock::duration timeout) {
+			std::shared_ptr<void> previous_owner;
+			std::lock_guard<std::mutex> lock(m_wheel->m_mutex);
+			if (!m_wheel->m_timer)
+				return;
+			arm(timeout);
+			previous_owner = std::move(m_owner);
+			m_owner = owner;
+		}
+
+		/// Moves the expiry of an armed deadline, keeping its owner. Returns false if the deadline is not armed.
+		bool extend(timer_wheel::clock::duration timeout) {
+			std::lock_guard<std::mutex> lock(m_wheel->m_mutex);
+			if (!prev)
+				return false;
+			arm(timeout);
+			return true;
+		}
+
+		/// Disarms the deadline; the handler will not be called.
+		void cancel() {
+			std::shared_ptr<void> owner;
+			std::lock_guard<std::mutex> lock(m_wheel->m_mutex);
+			if (prev) {
+				timer_wheel::unlink(*this);
+				m_wheel->m_armed--;
+			}
+			owner = std::move(m_owner);
+		}
+	private:
+		/// Called with the wheel's lock held
+		void arm(timer_wheel::clock::duration timeout) {
+			auto &wheel = *m_wheel;
+			if (prev) {
+				timer_wheel::unlink(*this);
+				wheel.m_armed--;
+			}
+			//Catch up with the clock if nothing kept the wheel turning
+			auto now = wheel.current_tick();
+			if (wheel.m_armed == 0 && now > wheel.m_now)
+				wheel.m_now = now;
+
+			auto ticks = static_cast<uint64_t>((timeout + timer_wheel::tick() - timer_wheel::clock::duration(1)) / timer_wheel::tick());
+			expiry = std::max(now + ticks, wheel.m_now + 1);
+			wheel.insert(*this);
+			wheel.m_armed++;
+			if (!wheel.m_waiting)
+				wheel.schedule();
+		}
+
+		std::shared_ptr<timer_wheel> m_wheel;
+		std::function<void()> m_handler;
+		std::shared_ptr<void> m_owner;
+	};
+
+	/// Disarms all deadlines, releasing their owners: a connection holds its deadline, so an armed one would
+	/// otherwise keep the connection alive for good.
+	inline void timer_wheel::shutdown() {
+		std::vector<std::shared_ptr<void>> owners;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_timer.reset();
+			auto release = [&owners](node &list) {
+				while (list.next != &list) {
+					auto entry = static_cast<deadline*>(list.next);
+					unlink(*entry);
+					owners.push_back(std::move(entry->m_owner));
+				}
+			};
+			for (auto &level : m_slots) {
+				for (auto &slot : level)
+					release(slot);
+			}
+			release(m_expired);
+			m_armed = 0;
+		}
+		//Released without the lock, as destroying a connection cancels its deadline
+		owners.clear();
+	}
+
+	inline void timer_wheel::on_tick(const std::error_code &ec) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_waiting = false;
+		if (ec || !m_timer)
+			return;
+
+		auto target = current_tick();
+		while (m_now < target && m_armed > 0) {
+			advance();
+			//Handlers are called without the lock, so that they may arm deadlines and release connections
+			while (m_expired.next != &m_expired) {
+				auto entry = static_cast<deadline*>(m_expired.next);
+				unlink(*entry);
+				m_armed--;
+				auto owner = std::move(entry->m_owner);
+				lock.unlock();
+				entry->m_handler();
+				owner.reset();
+				lock.lock();
+			}
+		}
+		if (m_armed == 0 && target > m_now)
+			m_now = target;
+		if (m_armed > 0 && !m_waiting && m_timer)
+			schedule();
+	}
+}
+
+#endif  /* TIMER_WHEEL_HPP */